@@ -17,28 +17,51 @@
 
 #include <stdint.h>
 #include <string.h>
-#include <util/delay.h>
 
 #include <arduino/pins.h>
 #include <arduino/serial.h>
 #include <arduino/timer1.h>
 #include <arduino/sleep.h>
+#include <util/delay.h>
+#ifdef POWER_DOWN
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#endif
 
 #include "tools/mfrc522.h"
 
+#ifdef WIEGAND
+#define PIN_WIEGAND_D0  2       /* instead of the keypad */
+#define PIN_WIEGAND_D1  3
+#else
 #define PIN_CLK         2
 #define PIN_DATA        3
+#endif
 #define PIN_GREEN_LED   4
 #define PIN_YELLOW_LED  5
 #define PIN_OPEN_LOCK   6
 #define PIN_DAYMODE     7
 #define PIN_RFID_ENABLE 9
 #define PIN_STATUS_LED  A5
+#define PIN_MFRC522_IRQ A1      /* shared by all the MFRC522s */
+#define PIN_MFRC522_SS  10
+#define PIN_MFRC522_SS1 A2
+#define PIN_MFRC522_SS2 A3
+
+#ifndef MFRC522_READERS
+#define MFRC522_READERS 1
+#endif
+#if MFRC522_READERS < 1 || MFRC522_READERS > 3
+#error "MFRC522_READERS must be 1, 2 or 3"
+#endif
 
 static volatile char clk = 0;
 static volatile uint8_t value = 0;
-static volatile uint8_t cnt = 0;
+static uint8_t cnt = 0;
 static uint8_t data[256];
+#if MFRC522_READERS > 1
+static uint8_t data_reader = 0xff;  /* MFRC522 the card in data[] is from */
+#endif
 
 static volatile int second = 0;
 
@@ -46,22 +69,351 @@ enum events {
 	EV_NONE   = 0,
 	EV_SERIAL = 1 << 0,
 	EV_TIME   = 1 << 1,
-	EV_DATA   = 1 << 2
+	EV_DATA   = 1 << 2,
+	EV_OPENED = 1 << 3,
+	EV_MFRC522 = 1 << 4,
+	EV_RFID   = 1 << 5,
+	EV_POLL   = 1 << 6
 };
 
 volatile uint8_t events = EV_NONE;
 
+#include "tools/stats.c"
+
 #define SERIAL_INBUF 64
 #define SERIAL_OUTBUF 128
+#define SERIAL_HEADROOM 64      /* RDR+, a LOCALOPEN and the HASH+ after it */
 #include "tools/serial.c"
 #undef SERIAL_INBUF
 #undef SERIAL_OUTBUF
+#undef SERIAL_HEADROOM
 
 #include "tools/softserial.c"
+#include "tools/sequencer.c"
+#include "tools/seen.c"
+#include "tools/bloom.c"
+#include "tools/local.c"
+#include "tools/reader.c"
+#ifdef WIEGAND
+#include "tools/wiegand.c"
+
+/* 20ms of timer1 ticks after the last pulse */
+#define WIEGAND_TIMEOUT 5000
+#endif
 
+/* the short 80 round loop unless SHA1 in the Makefile says otherwise */
+#if !defined(SHA1_UNROLLED) && !defined(SHA1_ASM) && !defined(SHA1_SHORTCODE)
 #define SHA1_SHORTCODE
+#endif
 #include "tools/sha1.c"
-#undef SHA1_SHORTCODE
+
+/*
+ * events for the host, as lines of text or, once the host
+ * has asked for it with 'M', as frames, see tools/frame.h.
+ * events and answers to commands are urgent, diagnostics are
+ * not and can't crowd them out of the output buffer. what
+ * doesn't fit is dropped whole.
+ */
+static uint8_t serial_binary;
+
+static void
+send_message(uint8_t type, const char *line, uint8_t urgent)
+{
+	uint8_t len = type == FRAME_TEXT ? strlen(line) : 0;
+
+	if (!serial_binary) {
+		if (type != FRAME_TEXT)
+			len = strlen(line);
+		if (!serial_reserve(len + 1, urgent))
+			return;
+		serial_print(line);
+		serial_print("\n");
+	} else if (serial_reserve(len + 5, urgent))
+		serial_frame(type, line, len);
+}
+
+#define send_event(type, line) send_message(type, line, 1)
+#define send_line(line)        send_message(FRAME_TEXT, line, 1)
+#define send_diag(line)        send_message(FRAME_TEXT, line, 0)
+
+/*
+ * a heartbeat is redundant while anything else is
+ * still on its way to the host
+ */
+static void
+send_alive(void)
+{
+	if (serial_queued() == 0)
+		send_message(FRAME_ALIVE, "ALIVE", 0);
+}
+
+static void
+send_hash(const char *digest)
+{
+	if (serial_binary) {
+		if (serial_reserve(SHA1_DIGEST_LENGTH + 5, 1))
+			serial_frame(FRAME_HASH, digest, SHA1_DIGEST_LENGTH);
+	} else if (serial_reserve(5 + 2 * SHA1_DIGEST_LENGTH + 1, 1)) {
+		serial_print("HASH+");
+		serial_hexdump(digest, SHA1_DIGEST_LENGTH);
+		serial_print("\n");
+	}
+}
+
+#if MFRC522_READERS > 1
+/*
+ * with several MFRC522s, the outcome of a code with a card
+ * from one of them is preceded by RDR+<reader index>
+ */
+static void
+send_reader(void)
+{
+	char line[] = "RDR+0";
+
+	if (data_reader == 0xff)
+		return;
+
+	line[4] += data_reader;
+	send_line(line);
+}
+#endif
+
+static char *
+hex_put(char *p, const void *data, uint8_t len)
+{
+	const uint8_t *d = data;
+
+	for (; len > 0; len--, d++) {
+		*p++ = serial_hexdigit[*d >> 4];
+		*p++ = serial_hexdigit[*d & 0x0f];
+	}
+	*p = '\0';
+
+	return p;
+}
+
+/*
+ * 'M' changes the mode of the link: the argument is a baud rate
+ * from tools/frame.h, or'ed with FRAME_MODE_BINARY for frames. the
+ * MODEACK still goes out in the old mode, then we switch. the host
+ * must repeat the same 'M' in the new mode within 2 seconds, or we
+ * go back to 9600 baud and text.
+ */
+static uint8_t serial_mode;
+static uint8_t serial_mode_next;
+static uint8_t serial_mode_pending;
+static uint8_t serial_mode_confirm;  /* ticks left to confirm */
+
+static void
+serial_mode_set(uint8_t mode)
+{
+	switch (mode & ~FRAME_MODE_BINARY) {
+	case FRAME_BAUD_19200:
+		serial_baud_19200();
+		break;
+	case FRAME_BAUD_38400:
+		serial_baud_38400();
+		break;
+	case FRAME_BAUD_57600:
+		serial_baud_57600();
+		break;
+	case FRAME_BAUD_115200:
+		serial_baud_115200();
+		break;
+	case FRAME_BAUD_250000:
+		serial_baud_250000();
+		break;
+	default:
+		serial_baud_9600();
+		break;
+	}
+	serial_binary = mode & FRAME_MODE_BINARY ? 1 : 0;
+	serial_mode = mode;
+}
+
+static void
+serial_mode_request(uint8_t mode)
+{
+	if (serial_mode_confirm && mode == serial_mode) {
+		serial_mode_confirm = 0;
+		send_line("MODEACK");
+		return;
+	}
+	if ((mode & ~FRAME_MODE_BINARY) >= FRAME_BAUDS) {
+		send_line("MODEERR");
+		return;
+	}
+
+	send_line("MODEACK");
+	serial_mode_next = mode;
+	serial_mode_pending = 1;
+}
+
+/*
+ * switch once MODEACK has left the output buffer
+ */
+static void
+serial_mode_work(void)
+{
+	if (!serial_mode_pending || serial_queued())
+		return;
+
+	/* the last two bytes may still be in the UART */
+	_delay_ms(3);
+	serial_mode_set(serial_mode_next);
+	serial_mode_pending = 0;
+	/* 9600 baud and text is where we fall back to anyway */
+	serial_mode_confirm = serial_mode ? 2 * 4 : 0;
+}
+
+
+static const struct seq_step pattern_open[] PROGMEM = {
+	{ SEQ_GREEN,  0, 0 },
+	{ SEQ_LOCK,   0, SEQ_MS(500) },
+	{ SEQ_LOCK,   1, 0 },
+	{ SEQ_EVENT,  EV_OPENED, 0 },
+	{ SEQ_GREEN,  1, 0 },
+	{ SEQ_END,    0, 0 }
+};
+
+static const struct seq_step pattern_day[] PROGMEM = {
+	{ SEQ_GREEN,   0, 0 },
+	{ SEQ_DAYMODE, 0, 0 }, /* day mode   */
+	{ SEQ_STATUS,  1, 0 }, /* status on  */
+	{ SEQ_END,     0, 0 }
+};
+
+static const struct seq_step pattern_night[] PROGMEM = {
+	{ SEQ_GREEN,   1, 0 },
+	{ SEQ_DAYMODE, 1, 0 }, /* nightmode  */
+	{ SEQ_STATUS,  0, 0 }, /* status off */
+	{ SEQ_END,     0, 0 }
+};
+
+static const struct seq_step pattern_rejected[] PROGMEM = {
+	{ SEQ_YELLOW, 0, SEQ_MS(200) },
+	{ SEQ_YELLOW, 1, SEQ_MS(200) },
+	{ SEQ_YELLOW, 0, SEQ_MS(200) },
+	{ SEQ_YELLOW, 1, 0 },
+	{ SEQ_END,    0, 0 }
+};
+
+static const struct seq_step pattern_validated[] PROGMEM = {
+	{ SEQ_GREEN,  0, SEQ_MS(300) },
+	{ SEQ_GREEN,  1, SEQ_MS(200) },
+	{ SEQ_GREEN,  0, SEQ_MS(300) },
+	{ SEQ_GREEN,  1, SEQ_MS(200) },
+	{ SEQ_GREEN,  0, SEQ_MS(300) },
+	{ SEQ_GREEN,  1, 0 },
+	{ SEQ_END,    0, 0 }
+};
+
+static const struct seq_step pattern_card[] PROGMEM = {
+	{ SEQ_YELLOW, 0, SEQ_MS(80) },
+	{ SEQ_YELLOW, 1, SEQ_MS(80) },
+	{ SEQ_YELLOW, 0, SEQ_MS(80) },
+	{ SEQ_YELLOW, 1, SEQ_MS(80) },
+	{ SEQ_YELLOW, 0, SEQ_MS(80) },
+	{ SEQ_YELLOW, 1, SEQ_MS(80) },
+	{ SEQ_END,    0, 0 }
+};
+
+/*
+ * data[] is hashed incrementally while the main loop is idle.
+ * bytes are only ever appended at data[cnt], so a block is final
+ * once cnt has moved past it and can be absorbed into hash_mid.
+ * on top of that we speculate that the next byte will be '#' and
+ * hash the rest of the buffer, ie. the hypothetical 0xB4 followed
+ * by the identity filled tail from data_reset(), plus the padding.
+ * if the guess holds the digest is ready when '#' arrives.
+ */
+#define HASH_BLOCKS (sizeof(data) / SHA1_BLOCKSIZE)
+
+static struct sha1_context hash_mid;  /* state after hash_blocks */
+static uint8_t hash_blocks;
+static struct sha1_context hash_spec; /* speculative state */
+static uint8_t hash_spec_pos;         /* where we assume '#' */
+static uint8_t hash_spec_blocks;      /* HASH_BLOCKS + 1 when done */
+static char hash_digest[SHA1_DIGEST_LENGTH];
+
+static void
+hash_reset(void)
+{
+	sha1_init(&hash_mid);
+	hash_blocks = 0;
+	hash_spec_pos = 255;                  /* never a valid guess */
+}
+
+/* copy block n of data[] as if '#' was received at pos */
+static void
+hash_fill(char *buf, uint8_t n, uint8_t pos)
+{
+	uint8_t i = n * SHA1_BLOCKSIZE;
+
+	do {
+		if (i < pos)
+			*buf++ = data[i];
+		else if (i == pos)
+			*buf++ = (char)0xB4;
+		else
+			*buf++ = i;
+		i++;
+	} while (i & (SHA1_BLOCKSIZE - 1));
+}
+
+/*
+ * do one block worth of hashing towards the digest of data[]
+ * with '#' at pos. returns 0 once hash_digest is ready.
+ */
+static uint8_t
+hash_step(uint8_t pos)
+{
+	if (hash_spec_pos != pos) {
+		memcpy(hash_spec.state, hash_mid.state, sizeof(hash_spec.state));
+		hash_spec.length = hash_blocks * SHA1_BLOCKSIZE;
+		hash_spec_blocks = hash_blocks;
+		hash_spec_pos = pos;
+	}
+
+	if (hash_spec_blocks < HASH_BLOCKS) {
+		hash_fill(hash_spec.buf, hash_spec_blocks, pos);
+		stats_start(STATS_SHA1);
+		sha1_transform(hash_spec.state, hash_spec.buf);
+		stats_stop(STATS_SHA1);
+		hash_spec.length += SHA1_BLOCKSIZE;
+	} else if (hash_spec_blocks == HASH_BLOCKS)
+		sha1_final(&hash_spec, hash_digest);
+	else
+		return 0;
+
+	hash_spec_blocks++;
+	return 1;
+}
+
+/*
+ * use idle time to hash ahead. returns 0 when
+ * there is nothing more to do until new data arrives.
+ */
+static uint8_t
+hash_work(void)
+{
+	uint8_t n = cnt;
+
+	if ((hash_blocks + 1) * SHA1_BLOCKSIZE <= n) {
+		hash_fill(hash_mid.buf, hash_blocks, n);
+		stats_start(STATS_SHA1);
+		sha1_transform(hash_mid.state, hash_mid.buf);
+		stats_stop(STATS_SHA1);
+		hash_blocks++;
+		return 1;
+	}
+
+	/* only worth guessing if '#' would make a valid code */
+	if (n < 9 || n == 255)
+		return 0;
+
+	return hash_step(n);
+}
 
 static void
 data_reset(void)
@@ -72,12 +424,28 @@ data_reset(void)
 		data[i] = i;
 
 	cnt = 0;
+#if MFRC522_READERS > 1
+	data_reader = 0xff;
+#endif
+	hash_reset();
 }
 
+#ifndef WIEGAND
 /*
- * triggered when the clock signal goes high
+ * keys clocked in from the keypad that the
+ * main loop hasn't picked up yet
  */
-pin2_interrupt()
+static volatile struct {
+	uint8_t buf[8];
+	uint8_t start;
+	uint8_t end;
+} keypad_input;
+
+/*
+ * clock in a bit from the keypad
+ */
+static inline void
+keypad_clock(void)
 {
 	if (pin_is_high(PIN_DATA))
 		value |= 1 << (7 - clk);
@@ -87,15 +455,103 @@ pin2_interrupt()
 	timer1_count_set(0);
 	second = 0;
 	if (clk == 8) {
-		if (cnt < 255) {
-			data[cnt] = value;
-			cnt++;
+		uint8_t end = keypad_input.end;
+		uint8_t next = (end + 1) % sizeof(keypad_input.buf);
+
+		if (next != keypad_input.start) {
+			keypad_input.buf[end] = value;
+			keypad_input.end = next;
 			events |= EV_DATA;
 		}
 		clk = 0;
 		value = 0;
 	}
 }
+#endif
+
+#ifdef POWER_DOWN
+#define POWER_HOLD 2
+
+static volatile uint8_t power_sleeping;
+static volatile uint8_t power_hold = POWER_HOLD;  /* ticks to stay awake */
+#ifndef WIEGAND
+static uint8_t power_clk;       /* keypad clock level when powered down */
+#endif
+#ifdef STATS
+static uint16_t power_ticks_asleep;
+static uint16_t power_ticks_awake;
+#endif
+#endif
+
+#ifdef WIEGAND
+/*
+ * (re)start the timeout that ends the frame. the
+ * tick starts over as well, like with the keypad.
+ */
+static inline void
+wiegand_timeout(void)
+{
+	timer1_count_set(0);
+	timer1_flags_clear();
+	timer1_interrupt_b_enable();
+	second = 0;
+}
+
+static inline void
+wiegand_pulse(uint8_t one)
+{
+#ifdef POWER_DOWN
+	power_sleeping = 0;
+	power_hold = POWER_HOLD;
+#endif
+	wiegand_bit(one);
+	wiegand_timeout();
+}
+
+/*
+ * triggered when D0 goes low
+ */
+pin2_interrupt()
+{
+	stats_isr_start(STATS_PIN2);
+	wiegand_pulse(0);
+	stats_isr_stop(STATS_PIN2);
+}
+
+/*
+ * triggered when D1 goes low
+ */
+pin3_interrupt()
+{
+	stats_isr_start(STATS_PIN2);
+	wiegand_pulse(1);
+	stats_isr_stop(STATS_PIN2);
+}
+
+/*
+ * triggered WIEGAND_TIMEOUT after the last pulse
+ */
+timer1_interrupt_b()
+{
+	timer1_interrupt_b_disable();
+	wiegand_end();
+	events |= EV_DATA;
+}
+#else
+/*
+ * triggered when the clock signal goes high
+ */
+pin2_interrupt()
+{
+	stats_isr_start(STATS_PIN2);
+#ifdef POWER_DOWN
+	power_sleeping = 0;
+	power_hold = POWER_HOLD;
+#endif
+	keypad_clock();
+	stats_isr_stop(STATS_PIN2);
+}
+#endif
 
 /*
  * triggered 4 times every second
@@ -106,13 +562,450 @@ timer1_interrupt_a()
 	value = 0;
 	second++;
 	events |= EV_TIME;
+#if defined(POWER_DOWN) && defined(STATS)
+	power_ticks_awake++;
+#endif
+}
+
+
+#ifdef STATS
+enum stats_line {
+	STATS_SEEN = STATS_PROBES,
+	STATS_SERIAL,
+	STATS_READER,
+	STATS_MFRC522_IDS,
+	STATS_EM4100,
+#ifdef WIEGAND
+	STATS_WIEGAND,
+#endif
+#ifdef POWER_DOWN
+	STATS_POWER,
+#endif
+	STATS_DONE
+};
+
+static uint8_t stats_next = STATS_DONE;
+
+/*
+ * print the next line of an 'S' dump once there is room
+ * for it, framed or not, in the output buffer. the probes
+ * are followed by the seen cache counters as
+ * SEEN+<hits>+<misses>
+ * and the output buffer counters as
+ * SERIAL+<bytes dropped>+<high water mark>
+ * the reader polls that missed their deadline as
+ * READER+<missed>
+ * the MFRC522 card IDs that didn't fit in the buffer as
+ * MFRC522+<dropped>
+ * the soft UART's bytes with a low stop bit and bytes it had no room for as
+ * EM4100+<framing errors>+<overruns>
+ * with WIEGAND the bad or lost Wiegand frames as
+ * WIEGAND+<errors>
+ * and with POWER_DOWN the ticks spent powered down and awake as
+ * POWER+<asleep>+<awake>
+ */
+static void
+stats_work(void)
+{
+	char buf[STATS_LINE];
+	uint8_t n[2];
+	char *p;
+
+	if (stats_next == STATS_DONE)
+		return;
+	if (serial_room(0) < STATS_LINE + 5)
+		return;
+
+	if (stats_next == STATS_SEEN) {
+		strcpy(buf, "SEEN+");
+		n[0] = seen_hits >> 8;
+		n[1] = seen_hits;
+		p = hex_put(buf + 5, n, 2);
+		*p++ = '+';
+		n[0] = seen_misses >> 8;
+		n[1] = seen_misses;
+		hex_put(p, n, 2);
+		send_diag(buf);
+		stats_next++;
+		return;
+	}
+
+	if (stats_next == STATS_SERIAL) {
+		strcpy(buf, "SERIAL+");
+		n[0] = serial_dropped >> 8;
+		n[1] = serial_dropped;
+		p = hex_put(buf + 7, n, 2);
+		*p++ = '+';
+		hex_put(p, &serial_highwater, 1);
+		send_diag(buf);
+		stats_next++;
+		return;
+	}
+
+	if (stats_next == STATS_READER) {
+		strcpy(buf, "READER+");
+		n[0] = reader_missed >> 8;
+		n[1] = reader_missed;
+		hex_put(buf + 7, n, 2);
+		send_diag(buf);
+		stats_next++;
+		return;
+	}
+
+	if (stats_next == STATS_MFRC522_IDS) {
+		strcpy(buf, "MFRC522+");
+		n[0] = mfrc522_dropped >> 8;
+		n[1] = mfrc522_dropped;
+		hex_put(buf + 8, n, 2);
+		send_diag(buf);
+		stats_next++;
+		return;
+	}
+
+	if (stats_next == STATS_EM4100) {
+		uint16_t errors, overruns;
+
+		/* counted by the soft UART interrupts */
+		cli();
+		errors = softserial_framing_errors;
+		overruns = softserial_overruns;
+		sei();
+
+		strcpy(buf, "EM4100+");
+		n[0] = errors >> 8;
+		n[1] = errors;
+		p = hex_put(buf + 7, n, 2);
+		*p++ = '+';
+		n[0] = overruns >> 8;
+		n[1] = overruns;
+		hex_put(p, n, 2);
+		send_diag(buf);
+		stats_next++;
+		return;
+	}
+
+#ifdef WIEGAND
+	if (stats_next == STATS_WIEGAND) {
+		uint16_t errors;
+
+		cli();
+		errors = wiegand_errors;
+		sei();
+
+		strcpy(buf, "WIEGAND+");
+		n[0] = errors >> 8;
+		n[1] = errors;
+		hex_put(buf + 8, n, 2);
+		send_diag(buf);
+		stats_next++;
+		return;
+	}
+#endif
+
+#ifdef POWER_DOWN
+	if (stats_next == STATS_POWER) {
+		uint16_t asleep, awake;
+
+		/* counted by the watchdog and timer1 interrupts */
+		cli();
+		asleep = power_ticks_asleep;
+		awake = power_ticks_awake;
+		sei();
+
+		strcpy(buf, "POWER+");
+		n[0] = asleep >> 8;
+		n[1] = asleep;
+		p = hex_put(buf + 6, n, 2);
+		*p++ = '+';
+		n[0] = awake >> 8;
+		n[1] = awake;
+		hex_put(p, n, 2);
+		send_diag(buf);
+		stats_next++;
+		return;
+	}
+#endif
+
+	stats_format(stats_next++, buf);
+	send_diag(buf);
+}
+#endif
+
+#ifdef POWER_DOWN
+/*
+ * Power-down between events.
+ *
+ * In idle mode the timers and the UART keep running, which is most of
+ * what the door draws while nothing happens. When there is nothing left
+ * to do, not even bytes on their way out, the door powers down instead
+ * and the watchdog takes over the ticks from timer1, so second, the
+ * seen cache and the reader polling go on as before.
+ *
+ * Without the I/O clock INT0 can't see edges, and the UART and timer0
+ * can't receive, so the keypad clock and RXD wake the MCU up through
+ * their pin change interrupts. The softserial pin and the MFRC522 IRQ
+ * have theirs already. The byte that wakes it up is lost, except for
+ * the first keypad bit which is clocked in by hand. It must still be
+ * there once the oscillator has started, so program the low fuse to
+ * 0xFE for 1K CK (64us) instead of the default 16K CK (1ms). Hosts
+ * send a NUL first, which the door ignores, to wake it up.
+ *
+ * After a keypad edge, a byte from the host or the EM4100 reader, the
+ * door stays awake for two ticks, so a code being typed or a tag being
+ * read isn't cut into pieces.
+ */
+static uint8_t power_down;               /* in power-down, not idle */
+
+/*
+ * triggered every 256ms while powered down
+ */
+ISR(WDT_vect)
+{
+	/* unless the keypad woke us up with it and is one bit in */
+	if (power_sleeping) {
+		clk = 0;
+		value = 0;
+	}
+	second++;
+	events |= EV_TIME;
+	/* the next timer1 tick is a whole tick away */
+	timer1_count_set(0);
+#ifdef STATS
+	power_ticks_asleep++;
+#endif
+}
+
+#ifdef WIEGAND
+/*
+ * triggered by D0, D1 and RXD while powered down
+ */
+pin_0to7_interrupt()
+{
+	if (!power_sleeping)
+		return;
+
+	/* INT0 and INT1 missed the pulse that woke us up */
+	if (pin_is_low(PIN_WIEGAND_D0))
+		wiegand_pulse(0);
+	else if (pin_is_low(PIN_WIEGAND_D1))
+		wiegand_pulse(1);
+	else {
+		power_sleeping = 0;
+		power_hold = POWER_HOLD;
+		wiegand_wake();
+		wiegand_timeout();
+	}
+}
+#else
+/*
+ * triggered by the keypad clock and RXD while powered down
+ */
+pin_0to7_interrupt()
+{
+	if (!power_sleeping)
+		return;
+
+	power_sleeping = 0;
+	power_hold = POWER_HOLD;
+	/*
+	 * INT0 missed the edge that woke us up, if it was a rising one.
+	 * the flag is set by changes while awake as well, so with the
+	 * clock held high it fires as soon as it is enabled.
+	 */
+	if (pin_is_high(PIN_CLK) && !power_clk)
+		keypad_clock();
+}
+#endif
+
+static uint8_t
+power_can_sleep(void)
+{
+	return !power_hold && serial_quiet() && !serial_mode_pending &&
+		!serial_mode_confirm && !seq_left && !softserial_state &&
+#ifdef WIEGAND
+		!wiegand_count &&
+#endif
+#ifdef STATS
+		stats_next == STATS_DONE &&
+#endif
+		eeprom_is_ready();
+}
+
+/*
+ * pick the sleep mode, called with interrupts disabled
+ */
+static void
+power_sleep(void)
+{
+	if (!power_can_sleep())
+		return;
+
+	power_down = 1;
+	power_sleeping = 1;
+#ifndef WIEGAND
+	power_clk = pin_is_high(PIN_CLK);
+#endif
+	pin_0to7_interrupt_enable();
+	wdt_reset();
+	WDTCSR = _BV(WDCE) | _BV(WDE);
+	WDTCSR = _BV(WDIE) | _BV(WDP2);   /* 256ms */
+	sleep_mode_power_down();
+}
+
+static void
+power_wake(void)
+{
+	if (!power_down)
+		return;
+
+	cli();
+	power_down = 0;
+	/* the ticks and the MFRC522 come back on their own */
+	if ((events & ~(EV_TIME | EV_MFRC522)) || softserial_state)
+		power_hold = POWER_HOLD;
+	power_sleeping = 0;
+	pin_0to7_interrupt_disable();
+	wdt_reset();
+	WDTCSR = _BV(WDCE) | _BV(WDE);
+	WDTCSR = 0;
+	sei();
+	sleep_mode_idle();
+}
+#endif
+
+#ifdef MFRC522_USE_IRQ
+/*
+ * triggered when the MFRC522 IRQ line changes,
+ * it is active low
+ */
+pin_A0toA5_interrupt()
+{
+	if (pin_is_low(PIN_MFRC522_IRQ))
+		events |= EV_MFRC522;
+}
+#endif
+
+static uint8_t
+hex2int(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - ('a' - 10);
+	else if (c >= 'A' && c <= 'F')
+		return c - ('A' - 10);
+	else
+		return 0xff;
+}
+
+/*
+ * some commands are followed by a fixed number of hex encoded
+ * bytes, they are collected here and the command is run once
+ * they are all in.
+ *
+ *   A<4 bytes>  add the code whose digest starts with these bytes
+ *               to the local store
+ *   E<4 bytes>  erase it from the local store
+ *   W<2 bytes offset><8 bytes>  write to the Bloom filter
+ *   M<1 byte>   change the mode of the link
+ */
+#define ARG_MAX 10
+
+static uint8_t arg_cmd;
+static uint8_t arg_digits;           /* read so far */
+static uint8_t arg_len;              /* bytes expected */
+static char arg[ARG_MAX];
+
+static void
+command_start(char c, uint8_t len)
+{
+	arg_cmd = c;
+	arg_digits = 0;
+	arg_len = len;
+}
+
+static void
+command_run(void)
+{
+	switch (arg_cmd) {
+	/*
+	 * the writes are only queued and done from the main loop. when
+	 * the queue is full the answer is LOCALBUSY and the host sends
+	 * the command again later.
+	 */
+	case 'A':
+		if (local_queue_full())
+			send_line("LOCALBUSY");
+		else if (local_add(arg))
+			send_line("LOCALACK");
+		else
+			send_line("LOCALFULL");
+		break;
+
+	case 'E':
+		if (local_queue_full()) {
+			send_line("LOCALBUSY");
+			break;
+		}
+		local_remove(arg);
+		send_line("LOCALACK");
+		break;
+	case 'M':
+		serial_mode_request(arg[0]);
+		break;
+#ifdef BLOOM_BYTES
+	case 'W':
+		if (bloom_write((uint8_t)arg[0] << 8 | (uint8_t)arg[1],
+				arg + 2, 8))
+			send_line("BLOOMACK");
+		else
+			send_line("BLOOMERR");
+		break;
+#endif
+	}
+}
+
+/*
+ * returns 1 if c was part of an argument
+ */
+static uint8_t
+command_argument(char c)
+{
+	uint8_t v;
+
+	if (arg_cmd == 0)
+		return 0;
+
+	v = hex2int(c);
+	if (v == 0xff) {
+		/* not a hex digit, drop the command */
+		arg_cmd = 0;
+		return 0;
+	}
+
+	if (arg_digits & 1)
+		arg[arg_digits / 2] |= v;
+	else
+		arg[arg_digits / 2] = v << 4;
+	if (++arg_digits < 2 * arg_len)
+		return 1;
+
+	command_run();
+	arg_cmd = 0;
+	return 1;
 }
 
 static void
 handle_serial_input(void)
 {
+	char c;
+
 	while (1) {
-		switch (serial_getchar()) {
+		c = serial_getchar();
+		if (c != '\0' && command_argument(c))
+			continue;
+
+		switch (c) {
 		case '\0':
 			cli();
 			if (!serial_available())
@@ -121,88 +1014,196 @@ handle_serial_input(void)
 			return;
 
 		case 'O': /* open */
-			pin_low(PIN_GREEN_LED);
-			pin_low(PIN_OPEN_LOCK);
-			_delay_ms(500);
-			pin_high(PIN_OPEN_LOCK);
-			serial_print("OPENAKCK\n");
-			pin_high(PIN_GREEN_LED);
+			seq_play_urgent(pattern_open);
 			break;
 
 		case 'D': /* day */
-			pin_low(PIN_GREEN_LED);
-			pin_low(PIN_DAYMODE);     /* day mode   */
-			pin_high(PIN_STATUS_LED); /* status on  */
+			seq_play_urgent(pattern_day);
 			break;
 
 		case 'N': /* night */
-			pin_high(PIN_GREEN_LED);
-			pin_high(PIN_DAYMODE);    /* nightmode  */
-			pin_low(PIN_STATUS_LED);  /* status off */
+			seq_play_urgent(pattern_night);
 			break;
 
+		/* only the LEDs, the host hears if they were dropped */
 		case 'R': /* rejected */
-			pin_low(PIN_YELLOW_LED);
-			_delay_ms(200);
-			pin_high(PIN_YELLOW_LED);
-			_delay_ms(200);
-			pin_low(PIN_YELLOW_LED);
-			_delay_ms(200);
-			pin_high(PIN_YELLOW_LED);
+			if (!seq_play(pattern_rejected))
+				send_line("SEQFULL");
 			break;
 
 		case 'V': /* validated */
-			pin_low(PIN_GREEN_LED);
-			_delay_ms(300);
-			pin_high(PIN_GREEN_LED);
-			_delay_ms(200);
-			pin_low(PIN_GREEN_LED);
-			_delay_ms(300);
-			pin_high(PIN_GREEN_LED);
-			_delay_ms(200);
-			pin_low(PIN_GREEN_LED);
-			_delay_ms(300);
-			pin_high(PIN_GREEN_LED);
+			if (!seq_play(pattern_validated))
+				send_line("SEQFULL");
+			break;
+
+		case 'A': /* add to the local store */
+		case 'E': /* erase from the local store */
+			command_start(c, LOCAL_KEY);
+			break;
+
+		case 'M': /* mode */
+			command_start(c, 1);
+			break;
+
+		case 'C': /* clear the local store */
+			/*
+			 * LOCALACK once it is done, which takes seconds
+			 * for a full table. until then 'A' answers
+			 * LOCALFULL, 'E' does nothing and no code is
+			 * opened locally, so the host has to wait.
+			 */
+			local_clear();
+			break;
+#ifdef BLOOM_BYTES
+		case 'B': /* begin Bloom filter upload */
+			bloom_begin();
+			send_line("BLOOMACK");
+			break;
+
+		case 'W': /* write Bloom filter */
+			command_start(c, 10);
+			break;
+
+		case 'F': /* finish Bloom filter upload */
+			send_line(bloom_finish() ? "BLOOMACK" : "BLOOMERR");
+			break;
+#endif
+#ifdef STATS
+		case 'S': /* stats */
+			stats_next = 0;
 			break;
+#endif
 		}
 	}
 }
 
+/*
+ * The readers only ever add to data[] through reader_key() and
+ * reader_card(), so the same rules hold for all of them.
+ */
+static void
+reader_key(uint8_t c)
+{
+	if (cnt < 255)
+		data[cnt++] = c;
+}
+
+/*
+ * the readers report a card over and over while it is close, it is
+ * only taken once, while it stays in the seen cache. a card that
+ * shows up while the buffer is in use is picked up once it has been
+ * cleared, returns 0 if that is why it wasn't taken now.
+ */
 static uint8_t
-hex2int(char c)
+reader_card(const char *id, uint8_t len)
 {
-	if (c >= '0' && c <= '9')
-		return c - '0';
-	else if (c >= 'a' && c <= 'f')
-		return c - ('a' - 10);
-	else if (c >= 'A' && c <= 'F')
-		return c - ('A' - 10);
+	uint8_t i;
+
+	if (seen_lookup(id, len))
+		return 1;
+	if (cnt != 0)
+		return 0;
+
+	seen_add(id, len);
+	for (i = 0; i < len && cnt < 255; i++)
+		data[cnt++] = id[i];
+	/* only a blink, never worth dropping another pattern for */
+	seq_play(pattern_card);
+	return 1;
+}
+
+#ifdef WIEGAND
+static void
+wiegand_init(void)
+{
+	pin_mode_input(PIN_WIEGAND_D0);
+	pin_mode_input(PIN_WIEGAND_D1);
+
+	timer1_compare_b_set(WIEGAND_TIMEOUT);
+	pin2_interrupt_mode_falling();
+	pin2_interrupt_enable();
+	pin3_interrupt_mode_falling();
+	pin3_interrupt_enable();
+#ifdef POWER_DOWN
+	pin_interrupt_mask(PIN_WIEGAND_D0); /* wake-up sources */
+	pin_interrupt_mask(PIN_WIEGAND_D1);
+#endif
+}
+
+/*
+ * cards are taken like the other readers' cards,
+ * keys like the keypad's with '#' as 0xB4
+ */
+static void
+wiegand_event(void)
+{
+	uint8_t f[WIEGAND_BITS / 8];
+	char id[3 + 9];
+	uint8_t bits;
+	uint8_t len;
+	uint8_t k;
+
+	bits = wiegand_take(f);
+	if (bits == 0)
+		return;
+
+	len = wiegand_card(f, bits, id);
+	if (len) {
+		reader_card(id, len);
+		return;
+	}
+
+	k = wiegand_key(f, bits);
+	if (k == WIEGAND_KEY_HASH)
+		reader_key(0xB4);
+	else if (k != 0xff)
+		reader_key(k);
 	else
-		return 0xff;
+		wiegand_errors++;
 }
+#else
+static void
+keypad_init(void)
+{
+	pin_mode_input(PIN_CLK);         /* clk             */
+	pin_mode_input(PIN_DATA);        /* data            */
 
+	/* trigger pin2 interrupt when the clock
+	 * signal goes high */
+	pin2_interrupt_mode_rising();
+	pin2_interrupt_enable();
+#ifdef POWER_DOWN
+	pin_interrupt_mask(PIN_CLK);     /* wake-up source  */
+#endif
+}
 
 static void
-copy_card_data_to_buffer(char *buf, uint8_t len)
+keypad_event(void)
 {
-  uint8_t i;
-  /*
-    We got an RFID tag.
-    Copy it into the card reader buffer to
-    emulate a read card data string.
-  */
-  for (i = 0; i < len && cnt < 255; ++i, ++cnt)
-    data[cnt] = buf[i];
-  for (i = 0; i < 3; i++) {
-    pin_low(PIN_YELLOW_LED);
-    _delay_ms(80);
-    pin_high(PIN_YELLOW_LED);
-    _delay_ms(80);
-  }
+	uint8_t start = keypad_input.start;
+
+	while (start != keypad_input.end) {
+		reader_key(keypad_input.buf[start]);
+		start = (start + 1) % sizeof(keypad_input.buf);
+	}
+	keypad_input.start = start;
+}
+#endif
+
+static void
+rfid_init(void)
+{
+	softserial_init();
+	pin_mode_output(PIN_RFID_ENABLE);
+	pin_low(PIN_RFID_ENABLE);
 }
 
+/*
+ * EM4100 frames are STX, 10 hex digits of ID, 2 of
+ * checksum, CR, LF and ETX
+ */
 static void
-handle_rfid_input(void)
+rfid_event(void)
 {
 	static char buf[14];
 	static uint8_t idx = 0;
@@ -219,18 +1220,16 @@ handle_rfid_input(void)
 			idx = 0;
 			break;
 		case 3:
-			if (idx == 14 && cnt == 0) {
-				/* Check for correct checksum and CR / LF */
+			/* Check for correct checksum and CR / LF */
+			if (idx == 14 && buf[12] == 13 && buf[13] == 10) {
 				checksum = 0;
 				for (i = 0; i < 12; i += 2)
 					checksum ^= ((hex2int(buf[i]) << 4) |
 						     hex2int(buf[i+1]));
-				if (checksum)
-					break;
-				if (buf[12] != 13 || buf[13] != 10)
-					break;
-                                copy_card_data_to_buffer(buf, 10);
+				if (checksum == 0)
+					reader_card(buf, 10);
 			}
+			/* fall through */
 		default:
 			if (idx < 14)
 			{
@@ -242,22 +1241,157 @@ handle_rfid_input(void)
 	}
 }
 
+static struct mfrc522 mfr[MFRC522_READERS] = {
+  { .ss = PIN_MFRC522_SS },
+#if MFRC522_READERS > 1
+  { .ss = PIN_MFRC522_SS1 },
+#endif
+#if MFRC522_READERS > 2
+  { .ss = PIN_MFRC522_SS2 },
+#endif
+};
+
+/* CARD+<ID string in hex> for every card, once while it is there */
+static void
+mfr_report(const char *id, uint8_t len)
+{
+  char line[5 + 2 * MFRC522_ID_MAX + 1] = "CARD+";
+
+  hex_put(line + 5, id, len);
+  send_line(line);
+}
+
+/* A card of the current pass of each reader has been handled. */
+static uint8_t mfr_handled[MFRC522_READERS];
+
+/*
+  The ID strings of cards reader i found in its current pass, one after
+  the other, len bytes of them. The first card found wins, and the others
+  that were in the field with it count as seen, so they aren't taken one
+  after the other once the buffer is free again. A card that finds the
+  buffer in use waits for it like the other readers' cards.
+*/
+static void
+mfr_cards(uint8_t i, const char *id, uint8_t len)
+{
+  uint8_t empty, n;
+
+  for (; len >= 10; id += n, len -= n)
+  {
+    n = mfrc522_id_len(id);
+    if (n > len)
+      break;
+
+    if (mfr_handled[i])
+    {
+      if (!seen_lookup(id, n))
+      {
+        seen_add(id, n);
+        mfr_report(id, n);
+      }
+      continue;
+    }
+
+    empty = cnt == 0;
+    if (!reader_card(id, n))
+      return;
+    mfr_handled[i] = 1;
+    /* Once we have the card, the reader just checks that it is still there. */
+    mfrc522_expect(&mfr[i], id);
+    if (empty && cnt)
+    {
+      mfr_report(id, n);
+#if MFRC522_READERS > 1
+      data_reader = i;
+#endif
+    }
+  }
+}
+
+static void
+mfr_init(void)
+{
+  init_mfrc522(mfr, MFRC522_READERS);
+#ifdef MFRC522_USE_IRQ
+  mfrc522_irq_start(mfr, MFRC522_READERS);
+#endif
+}
+
+#ifdef MFRC522_USE_IRQ
+static void
+mfr_event(void)
+{
+  char buf[MFRC522_READERS][MFRC522_ID_MAX];
+  uint8_t len[MFRC522_READERS];
+  uint8_t i;
+
+  /* One card per step, the others of the pass come with later events. */
+  mfrc522_irq_event(mfr, MFRC522_READERS, buf[0], MFRC522_ID_MAX, len);
+  for (i = 0; i < MFRC522_READERS; i++)
+  {
+    if (len[i] == 0)
+      continue;
+    /* Numbered from 1 within the pass. */
+    if (mfr[i].cards == 1)
+      mfr_handled[i] = 0;
+    mfr_cards(i, buf[i], len[i]);
+  }
+#if MFRC522_READERS > 1
+  /* Another reader may have pulled the shared line low meanwhile. */
+  if (pin_is_low(PIN_MFRC522_IRQ)) {
+    cli();
+    events |= EV_MFRC522;
+    sei();
+  }
+#endif
+}
 
 static void
-handle_mfr_input(char *data, uint8_t len)
+mfr_poll(void)
 {
-  if (len == 0)
-    return;                                     /* No data */
-  /*
-    The MFR sends card data continously while the card is close to the reader.
-    We only process it when the buffer is empty; this ensures that we only
-    get the card data once. An idle timeout elsewhere clears the buffer after
-    some time of inactivity.
-  */
-  if (cnt !=0)
-    return;
-  copy_card_data_to_buffer(data, len);
+#ifdef POWER_DOWN
+  mfrc522_irq_poll(mfr, MFRC522_READERS);
+#endif
+  /* don't get stuck if an edge was lost */
+  if (pin_is_low(PIN_MFRC522_IRQ)) {
+    cli();
+    events |= EV_MFRC522;
+    sei();
+  }
 }
+#else
+static void
+mfr_poll(void)
+{
+  char buf[MFRC522_READERS][MFRC522_IDS_MAX];
+  uint8_t len[MFRC522_READERS];
+  uint8_t i;
+
+  check_mfrc522(mfr, MFRC522_READERS, buf[0], MFRC522_IDS_MAX, len);
+  for (i = 0; i < MFRC522_READERS; i++)
+  {
+    mfr_handled[i] = 0;
+    mfr_cards(i, buf[i], len[i]);
+  }
+}
+#endif
+
+/*
+ * init, event, poll, event bit, poll interval in ticks, stats probe
+ */
+static const struct reader readers[] = {
+#ifdef WIEGAND
+	{ wiegand_init, wiegand_event, NULL, EV_DATA, 0, STATS_KEYPAD },
+#else
+	{ keypad_init, keypad_event, NULL, EV_DATA, 0, STATS_KEYPAD },
+#endif
+	{ rfid_init, rfid_event, NULL, EV_RFID, 0, STATS_RFID },
+#ifdef MFRC522_USE_IRQ
+	{ mfr_init, mfr_event, mfr_poll, EV_MFRC522, 1, STATS_MFRC522 },
+#else
+	{ mfr_init, NULL, mfr_poll, 0, 1, STATS_MFRC522 },
+#endif
+};
 
 
 int
@@ -267,8 +1401,6 @@ door_main(void)
 
 	pin_mode_output(PIN_RFID_ENABLE);
 
-	pin_mode_input(PIN_CLK);         /* clk             */
-	pin_mode_input(PIN_DATA);        /* data            */
 	pin_mode_output(PIN_GREEN_LED);  /* green led lock  */
 	pin_mode_output(PIN_YELLOW_LED); /* yellow led lock */
 	pin_mode_output(PIN_OPEN_LOCK);  /* open            */
@@ -280,12 +1412,13 @@ door_main(void)
 	pin_high(PIN_GREEN_LED);
 	pin_high(PIN_YELLOW_LED);
 
-	/* trigger pin2 interrupt when the clock
-	 * signal goes high */
-	pin2_interrupt_mode_rising();
-	pin2_interrupt_enable();
+#ifdef POWER_DOWN
+	/* wake-up source, enabled while powered down */
+	pin_interrupt_mask(0);           /* RXD */
+#endif
 
 	data_reset();
+	local_init();
 
 	/* setup timer1 to trigger interrupt a 4 times a second */
 	timer1_mode_ctc();
@@ -293,26 +1426,41 @@ door_main(void)
 	timer1_clock_d64();
 	timer1_interrupt_a_enable();
 
-        softserial_init();
-	pin_mode_output(PIN_RFID_ENABLE);
-	pin_low(PIN_RFID_ENABLE);
-
-        init_mfrc522();
+	reader_init(readers, sizeof(readers) / sizeof(readers[0]));
+	stats_init();
 
 	sleep_mode_idle();
 
 	while (1) {
+		serial_mode_work();
+#ifdef STATS
+		stats_work();
+#endif
+		if (events == EV_NONE && hash_work())
+			continue;
+		if (events == EV_NONE && local_busy()) {
+			if (local_work())
+				send_line("LOCALACK");
+			continue;
+		}
+
 		/*
 		 * sleep if no new events need to be handled
 		 * while avoiding race conditions. see
 		 * http://www.nongnu.org/avr-libc/user-manual/group__avr__sleep.html
 		 */
 		cli();
-		if (events == EV_NONE && !ev_softserial) {
+		if (events == EV_NONE) {
+#ifdef POWER_DOWN
+			power_sleep();
+#endif
 			sleep_enable();
 			sei();
 			sleep_cpu();
 			sleep_disable();
+#ifdef POWER_DOWN
+			power_wake();
+#endif
 			continue;
 		}
 		sei();
@@ -322,22 +1470,54 @@ door_main(void)
 			continue;
 		}
 
-		if (ev_softserial) {
-			handle_rfid_input();
+		if (events & EV_OPENED) {
+			cli();
+			events &= ~EV_OPENED;
+			sei();
+			send_event(FRAME_OPENED, "OPENAKCK");
+			continue;
 		}
 
-		events &= ~EV_DATA;
+		reader_work();
+
 		if (cnt > 0 && data[cnt - 1] == 0xB4) {
 			if (cnt >= 10) {
-				struct sha1_context ctx;
-				char digest[SHA1_DIGEST_LENGTH];
-
-				sha1_init(&ctx);
-				sha1_update(&ctx, (char *)data, 256);
-				sha1_final(&ctx, digest);
-				serial_print("HASH+");
-				serial_hexdump(digest, SHA1_DIGEST_LENGTH);
-				serial_print("\n");
+				uint8_t local;
+
+				while (hash_step(cnt - 1))
+					;
+#if MFRC522_READERS > 1
+				send_reader();
+#endif
+				/* open right away if we know the code */
+				local = local_lookup(hash_digest);
+				if (local) {
+					seq_play_urgent(pattern_open);
+					/* ahead of the HASH+, so the
+					 * host knows not to answer it */
+					send_event(FRAME_LOCALOPEN, "LOCALOPEN");
+				} else if (!bloom_check(hash_digest)) {
+					/* can't be valid, don't bother the host.
+					 * LOCALREJECT tells it if the blinking
+					 * didn't fit in the queue */
+					seq_play(pattern_rejected);
+					send_event(FRAME_LOCALREJECT, "LOCALREJECT");
+					data_reset();
+					continue;
+				}
+				send_hash(hash_digest);
+#ifdef HASH_LATENCY
+				{
+					/* timer1 was zeroed by the last clock
+					 * edge of '#', one tick is 4usec */
+					uint16_t t = timer1_count();
+					uint8_t n[2] = { t >> 8, t };
+					char buf[13] = "LATENCY+";
+
+					hex_put(buf + 8, n, sizeof(n));
+					send_diag(buf);
+				}
+#endif
 			}
 			data_reset();
 			continue;
@@ -345,15 +1525,20 @@ door_main(void)
 
                 if (events & EV_TIME)
                 {
-                  char buf[20];
-                  uint8_t len;
-
-                  len = check_mfrc522(buf, sizeof(buf));
-                  handle_mfr_input(buf, len);
+                  cli();
+                  events &= ~EV_TIME;
+                  sei();
+                  seen_tick();
+                  serial_tick();
+                  if (serial_mode_confirm && --serial_mode_confirm == 0)
+                    serial_mode_set(0);
+#ifdef POWER_DOWN
+                  if (power_hold)
+                    power_hold--;
+#endif
+                  reader_tick();
                 }
 
-		events &= ~EV_TIME;
-
                 /*
                   This code can be used during development, to simulate the
                   press of the '#' button 8 seconds after every idle timeout:
@@ -367,7 +1552,7 @@ door_main(void)
                 */
 
 		if (second > 10*4) {
-			serial_print("ALIVE\n");
+			send_alive();
 			second = 0;
 			data_reset();
 			continue;
@@ -375,7 +1560,16 @@ door_main(void)
 	}
 }
 
-#ifndef ARDUINO
+#ifdef SIM
+const unsigned char *
+door_data(unsigned int *n)
+{
+	*n = cnt;
+	return data;
+}
+#endif
+
+#if !defined(ARDUINO) && !defined(SIM)
 int
 main(int argc __attribute__((unused)), char *argv[] __attribute__((unused)))
 {
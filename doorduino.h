@@ -3,6 +3,10 @@ extern "C" {
 #endif
 
   int door_main(void);
+#ifdef SIM
+  /* data[] and cnt, for the harnesses in sim/ */
+  const unsigned char *door_data(unsigned int *cnt);
+#endif
 
 #ifdef __cplusplus
 }
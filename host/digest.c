@@ -0,0 +1,61 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The digests the door prints, for the host tools.
+ * Needs <string.h>.
+ */
+
+#define DIGEST_LENGTH 20
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * parse 40 hex digits, with or without the HASH+
+ * in front, returns 0 on success
+ */
+static int
+parse_digest(const char *line, char *digest)
+{
+	int i;
+
+	if (strncmp(line, "HASH+", 5) == 0)
+		line += 5;
+
+	for (i = 0; i < 2 * DIGEST_LENGTH; i++) {
+		int v = hexval(line[i]);
+
+		if (v < 0)
+			return -1;
+		if (i & 1)
+			digest[i / 2] |= v;
+		else
+			digest[i / 2] = v << 4;
+	}
+
+	return hexval(line[i]) < 0 ? 0 : -1;
+}
@@ -0,0 +1,199 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Builds the Bloom filter of authorized codes for a door built with
+ * -DBLOOM_BYTES, see tools/bloom.c, and uploads it.
+ *
+ * usage: doorbloom [-b bytes] [-k hashes] [-d tty] < digests
+ *
+ * Reads one digest per line, as 40 hex digits with or without the
+ * HASH+ in front, like the door prints them. With -d the filter is
+ * uploaded to the door on that tty, waiting for every command to be
+ * acknowledged. Otherwise the commands are written to stdout.
+ *
+ * -b and -k must match the BLOOM_BYTES and BLOOM_HASHES the firmware
+ * was built with.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#ifndef BLOOM_BYTES
+#define BLOOM_BYTES 512
+#endif
+#include "tools/bloom.h"
+#include "host/digest.c"
+#include "host/tty.c"
+
+#define CHUNK 8
+
+/*
+ * send cmd and wait for BLOOMACK, skipping whatever
+ * else the door prints meanwhile
+ */
+static int
+tty_command(int fd, const char *cmd)
+{
+	char line[128];
+	size_t len = 0;
+
+	if (tty_write(fd, cmd, strlen(cmd)) < 0)
+		return -1;
+
+	while (1) {
+		struct pollfd p = { fd, POLLIN, 0 };
+		char c;
+
+		if (poll(&p, 1, 2000) <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (read(fd, &c, 1) != 1)
+			return -1;
+
+		if (c != '\n') {
+			if (len < sizeof(line) - 1)
+				line[len++] = c;
+			continue;
+		}
+
+		line[len] = '\0';
+		len = 0;
+		if (strcmp(line, "BLOOMACK") == 0)
+			return 0;
+		if (strcmp(line, "BLOOMERR") == 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+}
+
+/* upload a command, or print it if there is no tty */
+static int
+command(int fd, const char *cmd)
+{
+	if (fd < 0)
+		return printf("%s\n", cmd) < 0 ? -1 : 0;
+
+	return tty_command(fd, cmd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long bytes = BLOOM_BYTES;
+	unsigned long hashes = BLOOM_HASHES;
+	const char *tty = NULL;
+	unsigned char *filter;
+	char line[256];
+	char digest[DIGEST_LENGTH];
+	char cmd[32];
+	unsigned long n = 0;
+	unsigned long lineno = 0;
+	uint16_t bits;
+	unsigned long i, j;
+	int fd = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:k:d:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			hashes = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			tty = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b bytes] [-k hashes] "
+			        "[-d tty] < digests\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (bytes < 2 || bytes > 8192 || hashes < 1 ||
+	    hashes > DIGEST_LENGTH / 2) {
+		fprintf(stderr, "%s: bad filter size\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bits = BLOOM_BITS(bytes);
+	filter = calloc(1, bytes - 1);
+	if (filter == NULL) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	while (fgets(line, sizeof(line), stdin)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		if (parse_digest(line, digest)) {
+			fprintf(stderr, "%s: line %lu: bad digest\n",
+			        argv[0], lineno);
+			return EXIT_FAILURE;
+		}
+		for (j = 0; j < hashes; j++) {
+			uint16_t bit = bloom_bit(digest, j, bits);
+
+			filter[bit / 8] |= 1 << (bit % 8);
+		}
+		n++;
+	}
+
+	fprintf(stderr, "%lu codes in %u bits with %lu hashes, "
+	        "%.2f%% false positives\n", n, bits, hashes,
+	        100 * pow(1 - exp(-(double)hashes * n / bits), hashes));
+
+	if (tty) {
+		fd = tty_open(tty);
+		if (fd < 0) {
+			perror(tty);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (command(fd, "B") < 0)
+		goto fail;
+	for (i = 0; i < bytes - 1; i += CHUNK) {
+		char *p = cmd + sprintf(cmd, "W%04lX", i);
+
+		for (j = i; j < i + CHUNK; j++)
+			p += sprintf(p, "%02X", j < bytes - 1 ? filter[j] : 0);
+		if (command(fd, cmd) < 0)
+			goto fail;
+	}
+	if (command(fd, "F") < 0)
+		goto fail;
+
+	return EXIT_SUCCESS;
+
+fail:
+	fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+	return EXIT_FAILURE;
+}
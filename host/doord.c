@@ -0,0 +1,636 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The host side of the doors: answers every HASH+ with 'V' and 'O'
+ * if the digest is in the member store, see host/store.c, and with
+ * 'R' otherwise. A door that knows the code itself opens without us
+ * and says LOCALOPEN ahead of its HASH+, which is then only logged.
+ * LOCALREJECT is a code the door turned away on its own.
+ *
+ * usage: doord [-v] -s store tty...
+ *        doord -c store < digests
+ *
+ * Serves the doors on the ttys, which may as well be ptys, at 9600
+ * baud from one epoll loop and prints what they do on stdout. Each
+ * pass reads what the doors have sent, takes the HASH+ lines of all
+ * of them through one lookup stage, then queues the answers of each
+ * door and writes them as fast as its line takes them. A door that
+ * goes away is opened again every second, and one that hasn't said
+ * anything for QUIET_SECS is reported.
+ *
+ * The store is mapped again when it is replaced, or on SIGHUP, and
+ * the old one is used until the new one is ready, so no code waits
+ * for a reload. A store that doesn't load is logged and the old one
+ * kept.
+ *
+ * SIGUSR1 prints the counts and answer latencies of every door, the
+ * time from reading a HASH+ to having written the answer, and so
+ * does SIGINT or SIGTERM before exiting.
+ *
+ * With -c the store is written from one digest per line on stdin,
+ * as 40 hex digits with or without the HASH+ in front, and renamed
+ * into place, which a running doord picks up within a second.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host/digest.c"
+#include "host/store.c"
+#include "host/tty.c"
+
+#define LINE_MAX_LEN 128
+#define ANSWERS      64         /* answers queued for a slow line */
+#define BATCH        64         /* codes looked up together */
+#define EVENTS       64
+#define QUIET_SECS   30         /* the door says ALIVE every 10s */
+#define BUCKETS      24         /* latencies by powers of two of usecs */
+#define LOCAL_USECS  1000000    /* for the HASH+ after a LOCALOPEN */
+
+struct answer {
+	uint64_t start;         /* when the HASH+ was read */
+	uint8_t len;
+	char buf[3];            /* with the NUL that wakes up the door */
+};
+
+struct door {
+	const char *path;
+	int fd;
+	int out;                /* waiting for EPOLLOUT */
+	size_t len;
+	char line[LINE_MAX_LEN];
+	/* answers on their way out, the first written up to off */
+	struct answer answer[ANSWERS];
+	uint8_t first;
+	uint8_t queued;
+	uint8_t off;
+	time_t heard;
+	int quiet;
+	uint64_t local;         /* when LOCALOPEN came, 0 for none */
+	/* since the start */
+	unsigned long codes;
+	unsigned long opens;
+	unsigned long opened;
+	unsigned long alive;
+	unsigned long dropped;
+	unsigned long local_opens;
+	unsigned long local_rejects;
+	uint64_t lat_min;
+	uint64_t lat_max;
+	uint64_t lat_sum;
+	unsigned long lat[BUCKETS];
+};
+
+struct lookup {
+	struct door *d;
+	uint64_t start;
+	char digest[DIGEST_LENGTH];
+};
+
+static const char *store_path;
+static struct store store;
+static struct door *doors;
+static int ndoors;
+static int epfd;
+static int verbose;
+
+static struct lookup batch[BATCH];
+static int batched;
+
+static uint64_t
+usecs(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void
+store_reload(void)
+{
+	struct store s;
+	struct stat st;
+
+	if (store_open(&s, store_path) < 0) {
+		fprintf(stderr, "%s: %s, keeping the old one\n",
+		        store_path, strerror(errno));
+		/* until it is replaced again */
+		if (stat(store_path, &st) == 0) {
+			store.dev = st.st_dev;
+			store.ino = st.st_ino;
+			store.mtime = st.st_mtim;
+		}
+		return;
+	}
+	store_close(&store);
+	store = s;
+	printf("%s: %u codes\n", store_path, store.h->count);
+}
+
+static void
+door_watch(struct door *d, int op, int out)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.u32 = d - doors;
+	epoll_ctl(epfd, op, d->fd, &ev);
+	d->out = out;
+}
+
+static void
+door_open(struct door *d)
+{
+	d->fd = tty_open(d->path);
+	if (d->fd < 0)
+		return;
+
+	fcntl(d->fd, F_SETFL, fcntl(d->fd, F_GETFL) | O_NONBLOCK);
+	d->len = 0;
+	d->first = 0;
+	d->queued = 0;
+	d->off = 0;
+	d->heard = time(NULL);
+	d->quiet = 0;
+	d->local = 0;
+	door_watch(d, EPOLL_CTL_ADD, 0);
+	printf("%s: up\n", d->path);
+}
+
+static void
+door_close(struct door *d)
+{
+	int i;
+
+	/* the lookup stage may still have codes from it */
+	for (i = 0; i < batched; i++)
+		if (batch[i].d == d)
+			batch[i].d = NULL;
+
+	close(d->fd);
+	d->fd = -1;
+	printf("%s: down\n", d->path);
+}
+
+static void
+door_latency(struct door *d, uint64_t us)
+{
+	int b = 0;
+
+	while (b < BUCKETS - 1 && us >> b)
+		b++;
+	d->lat[b]++;
+	if (d->lat_sum == 0 || us < d->lat_min)
+		d->lat_min = us;
+	if (us > d->lat_max)
+		d->lat_max = us;
+	d->lat_sum += us;
+}
+
+/* write what the line takes, returns -1 if the door has gone away */
+static int
+door_flush(struct door *d)
+{
+	while (d->queued) {
+		struct answer *a = &d->answer[d->first];
+		ssize_t n = write(d->fd, a->buf + d->off, a->len - d->off);
+
+		if (n < 0) {
+			if (errno != EAGAIN)
+				return -1;
+			if (!d->out)
+				door_watch(d, EPOLL_CTL_MOD, 1);
+			return 0;
+		}
+		d->off += n;
+		if (d->off < a->len)
+			continue;
+
+		door_latency(d, usecs() - a->start);
+		d->off = 0;
+		d->first = (d->first + 1) % ANSWERS;
+		d->queued--;
+	}
+	if (d->out)
+		door_watch(d, EPOLL_CTL_MOD, 0);
+	return 0;
+}
+
+static void
+door_answer(struct door *d, int member, uint64_t start)
+{
+	struct answer *a;
+
+	d->codes++;
+	if (member)
+		d->opens++;
+	if (d->queued == ANSWERS && door_flush(d) == 0 &&
+	    d->queued == ANSWERS) {
+		/* the door isn't reading, there's no point in more */
+		d->dropped++;
+		return;
+	}
+
+	a = &d->answer[(d->first + d->queued) % ANSWERS];
+	a->start = start;
+	a->buf[0] = '\0';
+	if (member) {
+		a->buf[1] = 'V';
+		a->buf[2] = 'O';
+		a->len = 3;
+	} else {
+		a->buf[1] = 'R';
+		a->len = 2;
+	}
+	d->queued++;
+}
+
+static void
+print_digest(const char *digest)
+{
+	int i;
+
+	for (i = 0; i < DIGEST_LENGTH; i++)
+		printf("%02x", (unsigned char)digest[i]);
+}
+
+/*
+ * the lookup stage, all codes read in this pass
+ * at once, then out with the answers
+ */
+static void
+lookups(void)
+{
+	int member[BATCH];
+	int i;
+
+	for (i = 0; i < batched; i++)
+		store_prefetch(&store, batch[i].digest);
+	for (i = 0; i < batched; i++)
+		member[i] = store_find(&store, batch[i].digest);
+
+	for (i = 0; i < batched; i++)
+		if (batch[i].d)
+			door_answer(batch[i].d, member[i], batch[i].start);
+	for (i = 0; i < batched; i++) {
+		struct door *d = batch[i].d;
+
+		if (d && d->fd >= 0 && door_flush(d) < 0)
+			door_close(d);
+	}
+
+	/* the log can wait until the doors have their answers */
+	for (i = 0; i < batched; i++) {
+		if (batch[i].d == NULL)
+			continue;
+		printf("%s: %s ", batch[i].d->path,
+		       member[i] ? "open" : "reject");
+		print_digest(batch[i].digest);
+		printf("\n");
+	}
+	batched = 0;
+}
+
+static void
+door_line(struct door *d, uint64_t start)
+{
+	struct lookup *l;
+	uint64_t local = d->local;
+
+	/* only the line right after LOCALOPEN is its HASH+ */
+	d->local = 0;
+	if (strncmp(d->line, "HASH+", 5) == 0) {
+		l = &batch[batched];
+		if (parse_digest(d->line, l->digest)) {
+			printf("%s: bad %s\n", d->path, d->line);
+			return;
+		}
+		if (local && start - local < LOCAL_USECS) {
+			/* the door has opened already */
+			printf("%s: local open ", d->path);
+			print_digest(l->digest);
+			printf("\n");
+			return;
+		}
+		l->d = d;
+		l->start = start;
+		if (++batched == BATCH)
+			lookups();
+	} else if (strcmp(d->line, "ALIVE") == 0) {
+		d->alive++;
+		if (verbose)
+			printf("%s: alive\n", d->path);
+	} else if (strcmp(d->line, "OPENAKCK") == 0) {
+		d->opened++;
+		printf("%s: opened\n", d->path);
+	} else if (strcmp(d->line, "LOCALOPEN") == 0) {
+		d->local_opens++;
+		d->local = start;
+	} else if (strcmp(d->line, "LOCALREJECT") == 0) {
+		d->local_rejects++;
+		printf("%s: local reject\n", d->path);
+	} else
+		printf("%s: %s\n", d->path, d->line);
+}
+
+/* returns -1 once the door has gone away */
+static int
+door_read(struct door *d)
+{
+	char buf[256];
+	uint64_t start;
+	ssize_t n, i;
+
+	while ((n = read(d->fd, buf, sizeof(buf))) > 0) {
+		start = usecs();
+		d->heard = time(NULL);
+		if (d->quiet) {
+			d->quiet = 0;
+			printf("%s: talking again\n", d->path);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\r' || buf[i] == '\0')
+				continue;
+			if (buf[i] != '\n') {
+				if (d->len < sizeof(d->line) - 1)
+					d->line[d->len++] = buf[i];
+				continue;
+			}
+			d->line[d->len] = '\0';
+			d->len = 0;
+			door_line(d, start);
+			/* a full batch may have found it gone */
+			if (d->fd < 0)
+				return 0;
+		}
+	}
+
+	return n < 0 && errno == EAGAIN ? 0 : -1;
+}
+
+static void
+print_stats(void)
+{
+	int i, b;
+
+	for (i = 0; i < ndoors; i++) {
+		struct door *d = &doors[i];
+		unsigned long answered = 0;
+		unsigned long n = 0;
+
+		for (b = 0; b < BUCKETS; b++)
+			answered += d->lat[b];
+		/* the bucket the 99th percentile is in */
+		for (b = 0; b < BUCKETS - 1; b++) {
+			n += d->lat[b];
+			if (n >= answered - answered / 100)
+				break;
+		}
+
+		printf("%s: %lu codes, %lu open, %lu opened, %lu alive, "
+		       "%lu dropped, %lu local open, %lu local reject",
+		       d->path, d->codes, d->opens, d->opened, d->alive,
+		       d->dropped, d->local_opens, d->local_rejects);
+		if (answered)
+			printf(", %lu/%lu/%lu us min/avg/max, "
+			       "99%% under %lu us",
+			       (unsigned long)d->lat_min,
+			       (unsigned long)(d->lat_sum / answered),
+			       (unsigned long)d->lat_max, 1UL << b);
+		printf("\n");
+	}
+}
+
+/* returns 1 when it is time to go */
+static int
+signals(int fd)
+{
+	struct signalfd_siginfo si;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGHUP:
+			store_reload();
+			break;
+		case SIGUSR1:
+			print_stats();
+			break;
+		default:
+			print_stats();
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* once a second */
+static void
+tick(time_t now)
+{
+	int i;
+
+	if (store_changed(&store, store_path))
+		store_reload();
+
+	for (i = 0; i < ndoors; i++) {
+		struct door *d = &doors[i];
+
+		if (d->fd < 0) {
+			door_open(d);
+			continue;
+		}
+		if (!d->quiet && now - d->heard > QUIET_SECS) {
+			d->quiet = 1;
+			printf("%s: quiet\n", d->path);
+		}
+	}
+}
+
+static int
+compile(const char *path)
+{
+	char line[256];
+	char *digests = NULL;
+	unsigned long size = 0;
+	unsigned long n = 0;
+	unsigned long lineno = 0;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		if (n == size) {
+			size = size ? 2 * size : 1024;
+			digests = realloc(digests, size * DIGEST_LENGTH);
+			if (digests == NULL)
+				goto fail;
+		}
+		if (parse_digest(line, digests + n * DIGEST_LENGTH)) {
+			fprintf(stderr, "%s: line %lu: bad digest\n",
+			        path, lineno);
+			return EXIT_FAILURE;
+		}
+		n++;
+	}
+	if (n > UINT32_MAX / 2) {
+		errno = EFBIG;
+		goto fail;
+	}
+
+	if (store_write(path, digests, n) < 0 ||
+	    store_open(&store, path) < 0)
+		goto fail;
+	fprintf(stderr, "%u codes in %u slots\n",
+	        store.h->count, store.h->slots);
+	return EXIT_SUCCESS;
+
+fail:
+	fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return EXIT_FAILURE;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct epoll_event ev[EVENTS];
+	struct epoll_event sev;
+	sigset_t mask;
+	const char *out = NULL;
+	time_t checked = 0;
+	int sfd;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "c:s:v")) != -1) {
+		switch (opt) {
+		case 'c':
+			out = optarg;
+			break;
+		case 's':
+			store_path = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (out)
+		return compile(out);
+	if (store_path == NULL || optind == argc)
+		goto usage;
+
+	if (store_open(&store, store_path) < 0) {
+		perror(store_path);
+		return EXIT_FAILURE;
+	}
+
+	ndoors = argc - optind;
+	doors = calloc(ndoors, sizeof(*doors));
+	if (doors == NULL) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (epfd < 0 || sfd < 0) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+	sev.events = EPOLLIN;
+	sev.data.u32 = ndoors;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &sev);
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("%s: %u codes\n", store_path, store.h->count);
+	for (i = 0; i < ndoors; i++) {
+		doors[i].path = argv[optind + i];
+		door_open(&doors[i]);
+		if (doors[i].fd < 0)
+			perror(doors[i].path);
+	}
+
+	while (1) {
+		time_t now;
+		int n = epoll_wait(epfd, ev, EVENTS, 1000);
+
+		if (n < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < n; i++) {
+			struct door *d;
+
+			if (ev[i].data.u32 == (uint32_t)ndoors) {
+				if (signals(sfd))
+					return EXIT_SUCCESS;
+				continue;
+			}
+
+			d = &doors[ev[i].data.u32];
+			if (d->fd < 0)
+				continue;
+			if ((ev[i].events & EPOLLOUT) && door_flush(d) < 0) {
+				door_close(d);
+				continue;
+			}
+			if ((ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+			    door_read(d) < 0)
+				door_close(d);
+		}
+		lookups();
+
+		now = time(NULL);
+		if (now != checked) {
+			checked = now;
+			tick(now);
+		}
+	}
+
+	perror(argv[0]);
+	return EXIT_FAILURE;
+
+usage:
+	fprintf(stderr, "usage: %s [-v] -s store tty...\n"
+	        "       %s -c store < digests\n", argv[0], argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,686 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs doord against pty pairs standing in for the doors and checks
+ * every answer it gives.
+ *
+ * usage: doordtest [-n doors] [-k codes] [-d doord]
+ *
+ * All doors send their codes at once, in pieces of random length,
+ * with ALIVE, OPENAKCK and lines doord doesn't know in between.
+ * Codes a door has opened for on its own, with LOCALOPEN ahead of
+ * their HASH+, must not be answered.
+ * Then the store is replaced, which has to turn every answer around,
+ * and one door asks one code at a time to time the round trip.
+ * A store with every slot taken must not hang doord.
+ * Finally the counts doord prints when it is stopped must match
+ * what was sent.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DIGEST_LENGTH 20
+#define PINGS 200
+#define TIMEOUT_MS 10000
+
+struct pty {
+	int master;
+	int slave;
+	char name[64];
+	/* to doord */
+	char *out;
+	size_t out_len;
+	size_t out_off;
+	/* from doord, and what it should be */
+	char *got;
+	size_t got_len;
+	char *want;
+	size_t want_len;
+	/* sent since the start */
+	unsigned long codes;
+	unsigned long opens;
+	unsigned long opened;
+	unsigned long alive;
+	unsigned long local_opens;
+	unsigned long local_rejects;
+	/* from the stats doord prints */
+	int reported;
+	unsigned long r_codes;
+	unsigned long r_opens;
+	unsigned long r_opened;
+	unsigned long r_alive;
+	unsigned long r_dropped;
+	unsigned long r_local_opens;
+	unsigned long r_local_rejects;
+};
+
+static struct pty *ptys;
+static int doors = 8;
+static int codes = 500;
+static char *digests;           /* doors * codes of them */
+static unsigned char *member;   /* in the first store */
+
+static const char *doord_path = "./doord";
+static char store_path[] = "/tmp/doordtest.XXXXXX";
+static pid_t doord;
+static int doord_out;
+static char line[256];
+static size_t line_len;
+static int ups;
+static int reloads;
+static int reloads_wanted = 1;
+
+static uint32_t seed = 1;
+static unsigned int failures;
+
+static uint32_t
+random32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static uint64_t
+usecs(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void
+check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+static void *
+grow(void *p, size_t len)
+{
+	p = realloc(p, len);
+	if (p == NULL) {
+		perror("doordtest");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void
+append(char **buf, size_t *len, const char *s, size_t n)
+{
+	*buf = grow(*buf, *len + n);
+	memcpy(*buf + *len, s, n);
+	*len += n;
+}
+
+static void
+send_line(struct pty *p, const char *s)
+{
+	append(&p->out, &p->out_len, s, strlen(s));
+	append(&p->out, &p->out_len, "\n", 1);
+}
+
+static void
+send_hash(struct pty *p, const char *digest)
+{
+	char buf[6 + 2 * DIGEST_LENGTH];
+	int i;
+
+	strcpy(buf, "HASH+");
+	for (i = 0; i < DIGEST_LENGTH; i++)
+		sprintf(buf + 5 + 2 * i, "%02X", (unsigned char)digest[i]);
+	send_line(p, buf);
+}
+
+static void
+send_code(struct pty *p, const char *digest, int open)
+{
+	send_hash(p, digest);
+	if (open)
+		append(&p->want, &p->want_len, "\0VO", 3);
+	else
+		append(&p->want, &p->want_len, "\0R", 2);
+	p->codes++;
+	p->opens += open;
+}
+
+static struct pty *
+find_pty(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < doors; i++)
+		if (strlen(ptys[i].name) == len &&
+		    strncmp(ptys[i].name, name, len) == 0)
+			return &ptys[i];
+	return NULL;
+}
+
+static void
+doord_line(void)
+{
+	char *colon = strstr(line, ": ");
+	struct pty *p;
+
+	if (colon == NULL)
+		return;
+	if (strlen(store_path) == (size_t)(colon - line) &&
+	    strncmp(line, store_path, colon - line) == 0) {
+		reloads++;
+		return;
+	}
+
+	p = find_pty(line, colon - line);
+	if (p == NULL)
+		return;
+	if (strcmp(colon, ": up") == 0)
+		ups++;
+	else if (sscanf(colon, ": %lu codes, %lu open, %lu opened, "
+	                "%lu alive, %lu dropped, %lu local open, "
+	                "%lu local reject", &p->r_codes, &p->r_opens,
+	                &p->r_opened, &p->r_alive, &p->r_dropped,
+	                &p->r_local_opens, &p->r_local_rejects) == 7) {
+		p->reported = 1;
+		printf("%s\n", line);
+	}
+}
+
+/* returns -1 at the end of doord's output */
+static int
+doord_read(void)
+{
+	char buf[4096];
+	ssize_t n = read(doord_out, buf, sizeof(buf));
+	ssize_t i;
+
+	if (n <= 0)
+		return n < 0 && errno == EAGAIN ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		if (buf[i] != '\n') {
+			if (line_len < sizeof(line) - 1)
+				line[line_len++] = buf[i];
+			continue;
+		}
+		line[line_len] = '\0';
+		line_len = 0;
+		doord_line();
+	}
+	return 0;
+}
+
+static int
+done(void)
+{
+	int i;
+
+	for (i = 0; i < doors; i++)
+		if (ptys[i].out_off < ptys[i].out_len ||
+		    ptys[i].got_len < ptys[i].want_len)
+			return 0;
+	return 1;
+}
+
+/*
+ * move bytes both ways until until() or the time is up,
+ * returns 0 on timeout
+ */
+static int
+pump(int (*until)(void))
+{
+	struct pollfd *fds = grow(NULL, (doors + 1) * sizeof(*fds));
+	uint64_t end = usecs() + 1000ULL * TIMEOUT_MS;
+	int i;
+
+	while (!until()) {
+		char buf[4096];
+		ssize_t n;
+
+		if (usecs() > end) {
+			free(fds);
+			return 0;
+		}
+
+		for (i = 0; i < doors; i++) {
+			struct pty *p = &ptys[i];
+
+			fds[i].fd = p->master;
+			fds[i].events = POLLIN;
+			if (p->out_off < p->out_len)
+				fds[i].events |= POLLOUT;
+		}
+		fds[doors].fd = doord_out;
+		fds[doors].events = POLLIN;
+		if (poll(fds, doors + 1, 100) < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < doors; i++) {
+			struct pty *p = &ptys[i];
+
+			if (fds[i].revents & POLLIN) {
+				n = read(p->master, buf, sizeof(buf));
+				if (n > 0)
+					append(&p->got, &p->got_len, buf, n);
+			}
+			if (fds[i].revents & POLLOUT) {
+				size_t len = 1 + random32() % 64;
+
+				if (len > p->out_len - p->out_off)
+					len = p->out_len - p->out_off;
+				n = write(p->master, p->out + p->out_off, len);
+				if (n > 0)
+					p->out_off += n;
+			}
+		}
+		if ((fds[doors].revents & (POLLIN | POLLHUP)) &&
+		    doord_read() < 0)
+			break;
+	}
+
+	free(fds);
+	return until();
+}
+
+static int
+all_up(void)
+{
+	return ups == doors;
+}
+
+static int
+reloaded(void)
+{
+	return reloads >= reloads_wanted;
+}
+
+static int
+answers_match(void)
+{
+	int i;
+
+	for (i = 0; i < doors; i++)
+		if (ptys[i].got_len != ptys[i].want_len ||
+		    memcmp(ptys[i].got, ptys[i].want, ptys[i].want_len))
+			return 0;
+	return 1;
+}
+
+/*
+ * a store with the codes that are members,
+ * or those that aren't, written by doord -c
+ */
+static void
+write_store(int members)
+{
+	char cmd[512];
+	FILE *f;
+	int i, j;
+
+	snprintf(cmd, sizeof(cmd), "%s -c %s 2>/dev/null", doord_path,
+	         store_path);
+	f = popen(cmd, "w");
+	if (f == NULL) {
+		perror(doord_path);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < doors * codes; i++) {
+		if (member[i] != members)
+			continue;
+		for (j = 0; j < DIGEST_LENGTH; j++)
+			fprintf(f, "%02x", (unsigned char)
+			        digests[(size_t)i * DIGEST_LENGTH + j]);
+		fprintf(f, "\n");
+	}
+	if (pclose(f) != 0) {
+		fprintf(stderr, "%s: %s -c failed\n", store_path, doord_path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+open_ptys(void)
+{
+	int i;
+
+	ptys = grow(NULL, doors * sizeof(*ptys));
+	memset(ptys, 0, doors * sizeof(*ptys));
+	for (i = 0; i < doors; i++) {
+		struct pty *p = &ptys[i];
+		struct termios t;
+
+		p->master = posix_openpt(O_RDWR | O_NOCTTY);
+		if (p->master < 0 || grantpt(p->master) < 0 ||
+		    unlockpt(p->master) < 0) {
+			perror("posix_openpt");
+			exit(EXIT_FAILURE);
+		}
+		snprintf(p->name, sizeof(p->name), "%s", ptsname(p->master));
+		fcntl(p->master, F_SETFL, O_NONBLOCK);
+
+		/* held open, and raw so nothing is echoed before doord is up */
+		p->slave = open(p->name, O_RDWR | O_NOCTTY);
+		if (p->slave < 0 || tcgetattr(p->slave, &t) < 0) {
+			perror(p->name);
+			exit(EXIT_FAILURE);
+		}
+		cfmakeraw(&t);
+		tcsetattr(p->slave, TCSANOW, &t);
+	}
+}
+
+static void
+start_doord(void)
+{
+	char **argv = grow(NULL, (doors + 4) * sizeof(*argv));
+	int fd[2];
+	int i;
+
+	argv[0] = (char *)doord_path;
+	argv[1] = "-s";
+	argv[2] = store_path;
+	for (i = 0; i < doors; i++)
+		argv[3 + i] = ptys[i].name;
+	argv[3 + doors] = NULL;
+
+	if (pipe(fd) < 0 || (doord = fork()) < 0) {
+		perror("doordtest");
+		exit(EXIT_FAILURE);
+	}
+	if (doord == 0) {
+		dup2(fd[1], STDOUT_FILENO);
+		close(fd[0]);
+		close(fd[1]);
+		execv(doord_path, argv);
+		perror(doord_path);
+		_exit(EXIT_FAILURE);
+	}
+	close(fd[1]);
+	doord_out = fd[0];
+	fcntl(doord_out, F_SETFL, O_NONBLOCK);
+	free(argv);
+}
+
+static void
+test_burst(void)
+{
+	int i, j;
+
+	for (i = 0; i < doors; i++) {
+		struct pty *p = &ptys[i];
+
+		for (j = 0; j < codes; j++) {
+			int k = i * codes + j;
+
+			send_code(p, digests + (size_t)k * DIGEST_LENGTH,
+			          member[k]);
+			if (member[k] && random32() % 2) {
+				send_line(p, "OPENAKCK");
+				p->opened++;
+			}
+			if (random32() % 10 == 0) {
+				send_line(p, "ALIVE");
+				p->alive++;
+			}
+			if (random32() % 50 == 0)
+				send_line(p, "RDR+1");
+			if (random32() % 50 == 0)
+				send_line(p, "HASH+nothex");
+		}
+	}
+
+	check(pump(done) && answers_match(),
+	      "every door gets the right answers in a burst");
+}
+
+/*
+ * the door opened for these itself, a stray answer would show up
+ * ahead of the one to the code after them. a LOCALOPEN with another
+ * line before the HASH+ doesn't count.
+ */
+static void
+test_local(void)
+{
+	int i, j;
+
+	for (i = 0; i < doors; i++) {
+		struct pty *p = &ptys[i];
+
+		for (j = 0; j < codes / 10; j++) {
+			int k = i * codes + j;
+			const char *digest = digests + (size_t)k * DIGEST_LENGTH;
+
+			send_line(p, "LOCALOPEN");
+			p->local_opens++;
+			if (j % 5 == 4) {
+				send_line(p, "ALIVE");
+				p->alive++;
+				send_code(p, digest, member[k]);
+			} else
+				send_hash(p, digest);
+			if (j % 3 == 0) {
+				send_line(p, "LOCALREJECT");
+				p->local_rejects++;
+			}
+			send_code(p, digest, member[k]);
+		}
+	}
+
+	check(pump(done) && answers_match(),
+	      "codes the doors opened for are not answered");
+}
+
+static void
+test_reload(void)
+{
+	int i, j;
+
+	write_store(0);
+	reloads_wanted++;
+	kill(doord, SIGHUP);
+	check(pump(reloaded), "doord maps the new store");
+
+	for (i = 0; i < doors; i++)
+		for (j = 0; j < codes / 10; j++) {
+			int k = i * codes + j;
+
+			send_code(&ptys[i], digests + (size_t)k * DIGEST_LENGTH,
+			          !member[k]);
+		}
+	check(pump(done) && answers_match(),
+	      "the new store turns the answers around");
+}
+
+/*
+ * a damaged store whose header says it has room, but every slot
+ * is taken. lookups must still end, with no for an answer.
+ */
+static void
+test_full_store(void)
+{
+	char tmp[sizeof(store_path) + 4];
+	unsigned char buf[16 + 4 * DIGEST_LENGTH];
+	int fd;
+	int i;
+
+	memset(buf, 0xff, sizeof(buf));
+	memcpy(buf, "DOORDB1", 8);
+	memcpy(buf + 8, "\4\0\0\0\1\0\0\0", 8);  /* 4 slots, 1 code */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", store_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf) ||
+	    close(fd) < 0 || rename(tmp, store_path) < 0) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+	reloads_wanted++;
+	kill(doord, SIGHUP);
+	check(pump(reloaded), "doord maps a store without an empty slot");
+
+	for (i = 0; i < doors; i++)
+		send_code(&ptys[i], digests + (size_t)i * codes *
+		          DIGEST_LENGTH, 0);
+	check(pump(done) && answers_match(),
+	      "a store without an empty slot rejects");
+}
+
+static void
+test_pings(void)
+{
+	struct pty *p = &ptys[0];
+	uint64_t sum = 0, max = 0;
+	int ok = 1;
+	int i;
+
+	for (i = 0; i < PINGS && ok; i++) {
+		int k = random32() % (doors * codes);
+		uint64_t start = usecs();
+		uint64_t t;
+
+		send_code(p, digests + (size_t)k * DIGEST_LENGTH, !member[k]);
+		ok = pump(done) && answers_match();
+		t = usecs() - start;
+		sum += t;
+		if (t > max)
+			max = t;
+	}
+
+	check(ok, "answers to one code at a time");
+	printf("round trip %lu/%lu us avg/max\n",
+	       (unsigned long)(sum / PINGS), (unsigned long)max);
+}
+
+static void
+test_stats(void)
+{
+	int status = 0;
+	int ok = 1;
+	int i;
+
+	kill(doord, SIGTERM);
+	while (doord_read() >= 0) {
+		struct pollfd p = { doord_out, POLLIN, 0 };
+
+		if (poll(&p, 1, TIMEOUT_MS) <= 0)
+			break;
+	}
+	/* one that is stuck doesn't hang the test */
+	if (waitpid(doord, &status, WNOHANG) != doord) {
+		kill(doord, SIGKILL);
+		waitpid(doord, &status, 0);
+	}
+	check(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	      "doord exits on SIGTERM");
+
+	for (i = 0; i < doors; i++) {
+		struct pty *p = &ptys[i];
+
+		if (!p->reported || p->r_codes != p->codes ||
+		    p->r_opens != p->opens || p->r_opened != p->opened ||
+		    p->r_alive != p->alive || p->r_dropped != 0 ||
+		    p->r_local_opens != p->local_opens ||
+		    p->r_local_rejects != p->local_rejects)
+			ok = 0;
+	}
+	check(ok, "doord counts what every door sent");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int fd;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:k:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			doors = atoi(optarg);
+			break;
+		case 'k':
+			codes = atoi(optarg);
+			break;
+		case 'd':
+			doord_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n doors] [-k codes] "
+			        "[-d doord]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (doors < 1 || codes < 10) {
+		fprintf(stderr, "%s: too few doors or codes\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	digests = grow(NULL, (size_t)doors * codes * DIGEST_LENGTH);
+	member = grow(NULL, (size_t)doors * codes);
+	for (i = 0; i < doors * codes * DIGEST_LENGTH; i++)
+		digests[i] = random32();
+	for (i = 0; i < doors * codes; i++)
+		member[i] = random32() % 2;
+
+	fd = mkstemp(store_path);
+	if (fd < 0) {
+		perror(store_path);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	write_store(1);
+
+	open_ptys();
+	start_doord();
+	if (!pump(all_up) || !pump(reloaded)) {
+		fprintf(stderr, "%s: %s does not start\n", argv[0],
+		        doord_path);
+		kill(doord, SIGKILL);
+		unlink(store_path);
+		return EXIT_FAILURE;
+	}
+
+	test_burst();
+	test_local();
+	test_reload();
+	test_pings();
+	test_full_store();
+	test_stats();
+	unlink(store_path);
+
+	printf("doordtest: %s, %d doors, %d codes each\n",
+	       failures ? "FAILED" : "OK", doors, codes);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
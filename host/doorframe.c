@@ -0,0 +1,225 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Talks to the door on a faster link, see the 'M' command and
+ * tools/frame.h, for host software that only knows the old lines.
+ *
+ * usage: doorframe [-b baud] [-m] -d tty
+ *
+ * Switches the link to baud, and with -m to binary frames, then
+ * prints every event as the line the door would have printed at
+ * 9600 baud and passes stdin on to the door. If the door goes
+ * quiet for longer than it ever should, it has probably been reset,
+ * so the link is negotiated again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define FRAME_DECODER
+#include "tools/frame.h"
+#include "host/tty.c"
+
+#define QUIET_MS 30000  /* the door says ALIVE every 10s */
+
+static const unsigned long bauds[FRAME_BAUDS] = {
+	9600, 19200, 38400, 57600, 115200, 250000
+};
+
+static struct frame_decoder decoder;
+
+/*
+ * read from the door for up to ms milliseconds. returns 1
+ * when a complete line is in line, 0 on timeout
+ */
+static int
+tty_line(int fd, char *line, int ms)
+{
+	while (1) {
+		struct pollfd p = { fd, POLLIN, 0 };
+		uint8_t c;
+
+		if (poll(&p, 1, ms) <= 0)
+			return 0;
+		if (read(fd, &c, 1) != 1)
+			return -1;
+		if (frame_decode(&decoder, c)) {
+			frame_line(&decoder, line);
+			return 1;
+		}
+	}
+}
+
+/* send cmd, then wait for MODEACK */
+static int
+mode_command(int fd, const char *cmd)
+{
+	char line[2 * FRAME_MAX + 6];
+	int r;
+
+	if (tty_write(fd, cmd, strlen(cmd)) < 0)
+		return -1;
+
+	while ((r = tty_line(fd, line, 1000)) > 0) {
+		if (!strcmp(line, "MODEACK"))
+			return 0;
+		if (!strcmp(line, "MODEERR"))
+			break;
+	}
+	return -1;
+}
+
+/*
+ * ask for mode at the rate the door is at now, follow it
+ * to the new rate and confirm there. a door left in mode
+ * by an earlier run is found at the new rate already.
+ */
+static int
+negotiate(int fd, uint8_t mode)
+{
+	unsigned long baud = bauds[mode & ~FRAME_MODE_BINARY];
+	char cmd[4];
+	int i;
+
+	sprintf(cmd, "M%02X", mode);
+	for (i = 0; i < 2; i++) {
+		if (tty_baud(fd, i ? baud : 9600) < 0)
+			return -1;
+		tcflush(fd, TCIOFLUSH);
+		decoder.len = 0;
+		if (mode_command(fd, cmd) == 0)
+			break;
+	}
+	if (i == 2)
+		return -1;
+
+	/* the door switches once the MODEACK has gone out */
+	tcdrain(fd);
+	if (tty_baud(fd, baud) < 0)
+		return -1;
+	usleep(10000);
+	tcflush(fd, TCIFLUSH);
+	decoder.len = 0;
+
+	return mode_command(fd, cmd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *tty = NULL;
+	unsigned long baud = 9600;
+	uint8_t mode = 0;
+	char line[2 * FRAME_MAX + 6];
+	char buf[256];
+	ssize_t n;
+	int fd;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "b:md:")) != -1) {
+		switch (opt) {
+		case 'b':
+			baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			mode |= FRAME_MODE_BINARY;
+			break;
+		case 'd':
+			tty = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (tty == NULL)
+		goto usage;
+
+	for (i = 0; i < FRAME_BAUDS && bauds[i] != baud; i++)
+		;
+	if (i == FRAME_BAUDS || tty_speed(baud) == B0) {
+		fprintf(stderr, "%s: unsupported baud rate %lu\n", argv[0], baud);
+		return EXIT_FAILURE;
+	}
+	mode |= i;
+
+	fd = tty_open(tty);
+	if (fd < 0) {
+		perror(tty);
+		return EXIT_FAILURE;
+	}
+	if (mode && negotiate(fd, mode) < 0) {
+		fprintf(stderr, "%s: the door does not answer\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	while (1) {
+		struct pollfd p[2] = {
+			{ fd, POLLIN, 0 },
+			{ STDIN_FILENO, POLLIN, 0 }
+		};
+		int r = poll(p, 2, mode ? QUIET_MS : -1);
+
+		if (r < 0 && errno != EINTR)
+			break;
+		if (r == 0) {
+			fprintf(stderr, "%s: door is quiet, "
+			        "negotiating again\n", argv[0]);
+			if (negotiate(fd, mode) < 0)
+				fprintf(stderr, "%s: the door does not "
+				        "answer\n", argv[0]);
+			continue;
+		}
+
+		if (p[0].revents) {
+			n = read(fd, buf, sizeof(buf));
+			if (n <= 0)
+				break;
+			for (i = 0; i < n; i++) {
+				if (!frame_decode(&decoder, buf[i]))
+					continue;
+				frame_line(&decoder, line);
+				printf("%s\n", line);
+			}
+		}
+
+		if (p[1].revents) {
+			n = read(STDIN_FILENO, buf, sizeof(buf));
+			if (n <= 0)
+				break;
+			if (tty_write(fd, buf, n) < 0)
+				break;
+		}
+	}
+
+	if (decoder.crc_errors)
+		fprintf(stderr, "%s: %lu CRC errors\n", argv[0],
+		        decoder.crc_errors);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "usage: %s [-b baud] [-m] -d tty\n", argv[0]);
+	return EXIT_FAILURE;
+}
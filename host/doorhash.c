@@ -0,0 +1,263 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks every implementation of host/sha1mb.c the CPU has against
+ * tools/sha1.c, and with -b how many door buffers each of them
+ * hashes in a second.
+ *
+ * usage: doorhash [-b] [-i implementation]
+ *
+ * The scalar code has to pass its own SHA1_TEST first. Then every
+ * implementation has to agree with it on the SHA1_TEST vectors, on
+ * random messages of every length up to a few blocks and on door
+ * buffers with random codes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* for its test vectors, and its test */
+#define SHA1_TEST
+#define main sha1_test
+#include "tools/sha1.c"
+#undef main
+#include "host/sha1mb.c"
+
+#define LANES_MAX_LEN 300       /* random messages up to this */
+#define MESSAGES      19        /* more than two groups, and a bit */
+#define DOORS         4096
+#define BENCH_DOORS   65536
+
+static unsigned int failures;
+static uint32_t seed = 1;
+
+static uint32_t
+random32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+check(int ok, const char *impl, const char *what)
+{
+	printf("%s: %s: %s\n", ok ? "PASS" : "FAIL", impl, what);
+	if (!ok)
+		failures++;
+}
+
+static void
+reference(const char *msg, size_t len, char *out)
+{
+	struct sha1_context ctx;
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, msg, len);
+	sha1_final(&ctx, out);
+}
+
+/* the SHA1_TEST vectors, as many copies as makes the lanes uneven */
+static int
+test_vectors(void)
+{
+	const char *msg[MESSAGES];
+	char out[MESSAGES][SHA1_DIGEST_LENGTH];
+	char hex[2 * SHA1_DIGEST_LENGTH + 5];
+	char *million;
+	unsigned int i, j;
+	int ok = 1;
+
+	for (i = 0; i < sizeof(test_data) / sizeof(test_data[0]); i++) {
+		for (j = 0; j < MESSAGES; j++)
+			msg[j] = test_data[i];
+		sha1mb(msg, strlen(test_data[i]), out, MESSAGES);
+		for (j = 0; j < MESSAGES; j++) {
+			digest_to_hex(out[j], hex);
+			if (strcmp(hex, test_results[i]))
+				ok = 0;
+		}
+	}
+
+	million = malloc(1000000);
+	if (million == NULL)
+		return 0;
+	memset(million, 'a', 1000000);
+	msg[0] = msg[1] = million;
+	sha1mb(msg, 1000000, out, 2);
+	for (j = 0; j < 2; j++) {
+		digest_to_hex(out[j], hex);
+		if (strcmp(hex, "34AA973C D4C4DAA4 F61EEB2B DBAD2731 6534016F"))
+			ok = 0;
+	}
+	free(million);
+
+	return ok;
+}
+
+/*
+ * random messages of every length, some of them the same so that
+ * the lanes share blocks now and then
+ */
+static int
+test_lengths(void)
+{
+	static char buf[MESSAGES][LANES_MAX_LEN];
+	const char *msg[MESSAGES];
+	char out[MESSAGES][SHA1_DIGEST_LENGTH];
+	char want[SHA1_DIGEST_LENGTH];
+	size_t len;
+	unsigned int i, j;
+
+	for (len = 0; len <= LANES_MAX_LEN; len++) {
+		for (j = 0; j < MESSAGES; j++) {
+			for (i = 0; i < len; i++)
+				buf[j][i] = random32();
+			msg[j] = random32() % 4 ? buf[j] : buf[0];
+		}
+		sha1mb(msg, len, out, MESSAGES);
+		for (j = 0; j < MESSAGES; j++) {
+			reference(msg[j], len, want);
+			if (memcmp(out[j], want, SHA1_DIGEST_LENGTH))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* random codes of random lengths, short ones mostly */
+static void
+door_buffers(char (*buf)[SHA1MB_DOOR], const char **msg, size_t n)
+{
+	char code[254];
+	size_t len;
+	size_t i, j;
+
+	for (i = 0; i < n; i++) {
+		len = random32() % 8 ? 4 + random32() % 12 : random32() % 255;
+		for (j = 0; j < len; j++)
+			code[j] = random32() % 4 ? random32() % 10 : random32();
+		sha1mb_door_buffer(buf[i], code, len);
+		msg[i] = buf[i];
+	}
+}
+
+static int
+test_doors(void)
+{
+	static char buf[DOORS][SHA1MB_DOOR];
+	static const char *msg[DOORS];
+	static char out[DOORS][SHA1_DIGEST_LENGTH];
+	char want[SHA1_DIGEST_LENGTH];
+	unsigned int i;
+
+	door_buffers(buf, msg, DOORS);
+	sha1mb(msg, SHA1MB_DOOR, out, DOORS);
+	for (i = 0; i < DOORS; i++) {
+		reference(buf[i], SHA1MB_DOOR, want);
+		if (memcmp(out[i], want, SHA1_DIGEST_LENGTH))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+bench(void)
+{
+	static char buf[BENCH_DOORS][SHA1MB_DOOR];
+	static const char *msg[BENCH_DOORS];
+	static char out[BENCH_DOORS][SHA1_DIGEST_LENGTH];
+	unsigned long n = 0;
+	double start, t;
+
+	door_buffers(buf, msg, BENCH_DOORS);
+	start = now();
+	do {
+		sha1mb(msg, SHA1MB_DOOR, out, BENCH_DOORS);
+		n += BENCH_DOORS;
+		t = now() - start;
+	} while (t < 0.5);
+
+	printf("%s: %.0f door hashes/s, %.1f MB/s\n", sha1mb_impl->name,
+	       n / t, n * SHA1MB_DOOR / t / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct sha1mb_impl *impl;
+	const char *only = NULL;
+	int benchmark = 0;
+	int tested = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "bi:")) != -1) {
+		switch (opt) {
+		case 'b':
+			benchmark = 1;
+			break;
+		case 'i':
+			only = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b] [-i implementation]\n",
+			        argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (sha1_test(argc, argv) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	for (impl = sha1mb_impls; impl->name; impl++) {
+		if (only && strcmp(only, impl->name))
+			continue;
+		if (sha1mb_use(impl->name) < 0) {
+			printf("SKIP: %s: not on this CPU\n", impl->name);
+			continue;
+		}
+		tested++;
+
+		check(test_vectors(), impl->name, "SHA1_TEST vectors");
+		check(test_lengths(), impl->name,
+		      "random messages of 0 to 300 bytes");
+		check(test_doors(), impl->name, "door buffers");
+		if (benchmark)
+			bench();
+	}
+
+	sha1mb_use(NULL);
+	printf("doorhash: %s, %d implementations, %s is used\n",
+	       failures || !tested ? "FAILED" : "OK", tested,
+	       sha1mb_impl->name);
+	return failures || !tested ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,435 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the SHA-1 code the door runs, and has run, against the NIST
+ * vectors and against each other, and with -b times it.
+ *
+ * usage: doorsha1 [-b]
+ *
+ *   shortcode  tools/sha1.c with SHA1_SHORTCODE, as doorduino.c has it
+ *   unrolled   tools/sha1.c with the unrolled rounds
+ *   test       tools/sha1.c with SHA1_TEST, which counts the length
+ *              in 64 bits instead of 16
+ *   legacy     SHA1Once() of arduino_code/arduino_code.pde, cut out of
+ *              the sketch by the Makefile as sha1once.c
+ *
+ * The firmware builds count the length in a uint16_t and only get
+ * messages of up to 8191 bytes right, the legacy code up to 65535, so
+ * the million 'a' vector is for the test build only. The AVR assembly
+ * of tools/sha1.S doesn't run here.
+ *
+ * The benchmark feeds each build 4096 bytes at every sha1_update()
+ * chunk size from 1 to 64 and then doubling up to 4096, and hashes
+ * door buffers like door_main() does.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the builds are picked here, not by SHA1 in the Makefile */
+#undef SHA1_SHORTCODE
+#undef SHA1_UNROLLED
+#undef SHA1_ASM
+
+#define SHA1_TEST
+#define main sha1_test
+#include "tools/sha1.c"
+#undef main
+#undef SHA1_TEST
+
+#define sha1_context   sha1_context_short
+#define sha1_transform sha1_transform_short
+#define sha1_init      sha1_init_short
+#define sha1_update    sha1_update_short
+#define sha1_final     sha1_final_short
+#define SHA1_SHORTCODE
+#include "tools/sha1.c"
+#undef SHA1_SHORTCODE
+#undef sha1_context
+#undef sha1_transform
+#undef sha1_init
+#undef sha1_update
+#undef sha1_final
+
+#define sha1_context   sha1_context_unrolled
+#define sha1_transform sha1_transform_unrolled
+#define sha1_init      sha1_init_unrolled
+#define sha1_update    sha1_update_unrolled
+#define sha1_final     sha1_final_unrolled
+#include "tools/sha1.c"
+#undef sha1_context
+#undef sha1_transform
+#undef sha1_init
+#undef sha1_update
+#undef sha1_final
+
+#include "sha1once.c"
+
+#define DOOR          256     /* door_main() hashes all of data[] */
+#define DOOR_MIN      10      /* and only once there are 10 bytes */
+#define FIRMWARE_MAX  8191    /* bytes a 16 bit length gets right */
+#define LEGACY_MAX    65535   /* and a 16 bit length times 8 in 32 bits */
+#define DIFF_MAX      1000    /* random messages up to this */
+#define DOORS         4096
+#define BENCH_LEN     4096
+#define BENCH_TIME    0.02    /* seconds per measurement */
+
+/* one-shot digest, and one fed in chunk byte pieces where that exists */
+struct build {
+	const char *name;
+	void (*once)(const char *msg, size_t len, char *out);
+	void (*chunked)(const char *msg, size_t len, size_t chunk, char *out);
+	size_t max;
+};
+
+static unsigned int failures;
+static uint32_t seed = 1;
+
+static uint32_t
+random32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+check(int ok, const char *build, const char *what)
+{
+	printf("%s: %s: %s\n", ok ? "PASS" : "FAIL", build, what);
+	if (!ok)
+		failures++;
+}
+
+#define CHUNKED(name, ctx_type, init, update, final) \
+static void \
+name(const char *msg, size_t len, size_t chunk, char *out) \
+{ \
+	struct ctx_type ctx; \
+	size_t n; \
+\
+	init(&ctx); \
+	for (; len > 0; msg += n, len -= n) { \
+		n = len < chunk ? len : chunk; \
+		update(&ctx, msg, n); \
+	} \
+	final(&ctx, out); \
+}
+
+CHUNKED(test_chunked, sha1_context, sha1_init, sha1_update, sha1_final)
+CHUNKED(short_chunked, sha1_context_short, sha1_init_short,
+        sha1_update_short, sha1_final_short)
+CHUNKED(unrolled_chunked, sha1_context_unrolled, sha1_init_unrolled,
+        sha1_update_unrolled, sha1_final_unrolled)
+
+static void
+test_once(const char *msg, size_t len, char *out)
+{
+	test_chunked(msg, len, len, out);
+}
+
+static void
+short_once(const char *msg, size_t len, char *out)
+{
+	short_chunked(msg, len, len, out);
+}
+
+static void
+unrolled_once(const char *msg, size_t len, char *out)
+{
+	unrolled_chunked(msg, len, len, out);
+}
+
+/*
+ * SHA1Block() swaps whole words in, so it reads up to 3 bytes past
+ * the end of a message. the messages here all have room for that.
+ */
+static void
+legacy_once(const char *msg, size_t len, char *out)
+{
+	SHA1Once((const unsigned char *)msg, len);
+	memcpy(out, shadigest.data, SHA1_DIGEST_LENGTH);
+}
+
+static const struct build builds[] = {
+	{ "shortcode", short_once,    short_chunked,    FIRMWARE_MAX },
+	{ "unrolled",  unrolled_once, unrolled_chunked, FIRMWARE_MAX },
+	{ "test",      test_once,     test_chunked,     SIZE_MAX },
+	{ "legacy",    legacy_once,   NULL,             LEGACY_MAX },
+};
+
+#define BUILDS (sizeof(builds) / sizeof(builds[0]))
+
+/* FIPS 180-2 appendix A, and the empty message */
+static const struct {
+	const char *msg;
+	const char *digest;
+} nist[] = {
+	{ "",
+	  "DA39A3EE 5E6B4B0D 3255BFEF 95601890 AFD80709" },
+	{ "abc",
+	  "A9993E36 4706816A BA3E2571 7850C26C 9CD0D89D" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	  "84983E44 1C3BD26E BAAE4AA1 F95129E5 E54670F1" },
+	{ "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+	  "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+	  "A49B2446 A02C645B F419F995 B6709125 3A04A259" },
+};
+
+static int
+hex_is(const char *digest, const char *want)
+{
+	char hex[2 * SHA1_DIGEST_LENGTH + 5];
+
+	digest_to_hex(digest, hex);
+	return !strcmp(hex, want);
+}
+
+static int
+test_nist(const struct build *b)
+{
+	char msg[128 + 3];
+	char out[SHA1_DIGEST_LENGTH];
+	char *million;
+	unsigned int i;
+	size_t len;
+	size_t chunk;
+	int ok = 1;
+
+	for (i = 0; i < sizeof(nist) / sizeof(nist[0]); i++) {
+		len = strlen(nist[i].msg);
+		memcpy(msg, nist[i].msg, len);
+		b->once(msg, len, out);
+		if (!hex_is(out, nist[i].digest))
+			ok = 0;
+		for (chunk = 1; b->chunked && chunk <= len; chunk++) {
+			b->chunked(msg, len, chunk, out);
+			if (!hex_is(out, nist[i].digest))
+				ok = 0;
+		}
+	}
+
+	if (b->max < 1000000)
+		return ok;
+	million = malloc(1000000);
+	if (million == NULL)
+		return 0;
+	memset(million, 'a', 1000000);
+	b->once(million, 1000000, out);
+	if (!hex_is(out, "34AA973C D4C4DAA4 F61EEB2B DBAD2731 6534016F"))
+		ok = 0;
+	b->chunked(million, 1000000, 1000, out);
+	if (!hex_is(out, "34AA973C D4C4DAA4 F61EEB2B DBAD2731 6534016F"))
+		ok = 0;
+	free(million);
+
+	return ok;
+}
+
+/* random messages of every length against the test build in one go */
+static int
+test_random(const struct build *b)
+{
+	static char msg[DIFF_MAX + 3];
+	char out[SHA1_DIGEST_LENGTH];
+	char want[SHA1_DIGEST_LENGTH];
+	size_t len;
+	size_t i;
+
+	for (len = 0; len <= DIFF_MAX; len++) {
+		for (i = 0; i < len; i++)
+			msg[i] = random32();
+		test_once(msg, len, want);
+		b->once(msg, len, out);
+		if (memcmp(out, want, SHA1_DIGEST_LENGTH))
+			return 0;
+		if (b->chunked == NULL)
+			continue;
+		b->chunked(msg, len, 1 + random32() % (len + 1), out);
+		if (memcmp(out, want, SHA1_DIGEST_LENGTH))
+			return 0;
+	}
+	return 1;
+}
+
+/* data[] as data_reset() leaves it with the code and '#' on top */
+static void
+door_buffer(char *data, const char *code, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < DOOR; i++)
+		data[i] = i;
+	memcpy(data, code, len);
+	data[len] = (char)0xB4;
+}
+
+/*
+ * nine key bytes and '#', the shortest code door_main() hashes,
+ * then random codes of every length that fits
+ */
+static int
+test_doors(const struct build *b)
+{
+	static const char keys[DOOR_MIN - 1] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+	char data[DOOR + 3];
+	char code[DOOR - 1];
+	char out[SHA1_DIGEST_LENGTH];
+	char want[SHA1_DIGEST_LENGTH];
+	unsigned int n;
+	size_t len;
+	size_t i;
+
+	door_buffer(data, keys, sizeof(keys));
+	b->once(data, DOOR, out);
+	if (!hex_is(out, "6314489D 982F9805 A1C600E4 CBD23AC1 02CF7F08"))
+		return 0;
+
+	for (n = 0; n < DOORS; n++) {
+		len = n < DOOR - DOOR_MIN ? DOOR_MIN - 1 + n :
+		      DOOR_MIN - 1 + random32() % (DOOR - DOOR_MIN);
+		for (i = 0; i < len; i++)
+			code[i] = random32() % 4 ? random32() % 10 : random32();
+		door_buffer(data, code, len);
+		test_once(data, DOOR, want);
+		b->once(data, DOOR, out);
+		if (memcmp(out, want, SHA1_DIGEST_LENGTH))
+			return 0;
+		if (b->chunked == NULL)
+			continue;
+		b->chunked(data, DOOR, 1 + random32() % DOOR, out);
+		if (memcmp(out, want, SHA1_DIGEST_LENGTH))
+			return 0;
+	}
+	return 1;
+}
+
+/* MB/s and ns per sha1_update() fed chunk bytes at a time */
+static void
+bench_chunk(const struct build *b, const char *msg, size_t chunk,
+            double *mbs, double *ns)
+{
+	char out[SHA1_DIGEST_LENGTH];
+	unsigned long n = 0;
+	double start, t;
+
+	start = now();
+	do {
+		b->chunked(msg, BENCH_LEN, chunk, out);
+		n++;
+		t = now() - start;
+	} while (t < BENCH_TIME);
+
+	*mbs = n * BENCH_LEN / t / 1e6;
+	*ns = t / (n * ((BENCH_LEN + chunk - 1) / chunk)) * 1e9;
+}
+
+static void
+bench(void)
+{
+	static char msg[BENCH_LEN + 3];
+	char data[DOOR + 3];
+	char out[SHA1_DIGEST_LENGTH];
+	double mbs, ns, start, t;
+	unsigned long n;
+	unsigned int i;
+	size_t chunk;
+
+	for (i = 0; i < BENCH_LEN; i++)
+		msg[i] = random32();
+
+	printf("\nchunk");
+	for (i = 0; i < BUILDS; i++)
+		if (builds[i].chunked)
+			printf("  %9s MB/s ns/update", builds[i].name);
+	printf("\n");
+	for (chunk = 1; chunk <= BENCH_LEN; chunk += chunk < 64 ? 1 : chunk) {
+		printf("%5zu", chunk);
+		for (i = 0; i < BUILDS; i++) {
+			if (builds[i].chunked == NULL)
+				continue;
+			bench_chunk(&builds[i], msg, chunk, &mbs, &ns);
+			printf("  %14.1f %9.0f", mbs, ns);
+		}
+		printf("\n");
+	}
+
+	printf("\n");
+	door_buffer(data, "\1\2\3\4\5\6\7\10\11", DOOR_MIN - 1);
+	for (i = 0; i < BUILDS; i++) {
+		n = 0;
+		start = now();
+		do {
+			builds[i].once(data, DOOR, out);
+			n++;
+			t = now() - start;
+		} while (t < 5 * BENCH_TIME);
+		printf("%s: %.0f ns per door hash\n", builds[i].name,
+		       t / n * 1e9);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int benchmark = 0;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b")) != -1) {
+		switch (opt) {
+		case 'b':
+			benchmark = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (sha1_test(argc, argv) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < BUILDS; i++) {
+		check(test_nist(&builds[i]), builds[i].name, "NIST vectors");
+		check(test_random(&builds[i]), builds[i].name,
+		      "random messages of 0 to 1000 bytes");
+		check(test_doors(&builds[i]), builds[i].name, "door buffers");
+	}
+
+	if (benchmark && !failures)
+		bench();
+
+	printf("doorsha1: %s, %u builds\n", failures ? "FAILED" : "OK",
+	       (unsigned int)BUILDS);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
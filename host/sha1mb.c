@@ -0,0 +1,358 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SHA-1 of many independent messages of the same length, for the
+ * host tools that hash door buffers by the million to enroll or
+ * audit codes.
+ *
+ * sha1mb() hashes the messages with the best implementation the CPU
+ * has, or the one picked with sha1mb_use():
+ *
+ *   avx2    8 messages at once in the lanes of AVX2 registers
+ *   sha-ni  the SHA extensions, one message at a time
+ *   sse2    4 messages at once in SSE2 registers
+ *   scalar  sha1_init(), sha1_update() and sha1_final()
+ *
+ * The lanes take their blocks in step and never look at what is in
+ * them: checking whether a block is the same in all the lanes, as the
+ * identity fill of door buffers past a short code is, costs more than
+ * the rounds it would save.
+ *
+ * Needs <stdint.h>, <string.h> and tools/sha1.c.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define SHA1MB_X86
+#endif
+
+#define SHA1MB_MAX_LANES 8
+#define SHA1MB_DOOR      256    /* the door hashes all of data[] */
+
+struct sha1mb_impl {
+	const char *name;
+	unsigned int lanes;
+	int (*supported)(void);
+	void (*hash)(const char *const *msg, size_t len,
+	             char (*out)[SHA1_DIGEST_LENGTH]);
+};
+
+static const uint32_t sha1mb_h0[5] = {
+	0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static inline uint32_t
+sha1mb_be32(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+
+	return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 |
+	       (uint32_t)b[2] << 8 | b[3];
+}
+
+static inline void
+sha1mb_put_be32(char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* blocks in a message of len bytes, padding included */
+static inline size_t
+sha1mb_blocks(size_t len)
+{
+	return (len + 8) / SHA1_BLOCKSIZE + 1;
+}
+
+/*
+ * point p[] at block n of the messages, padded in pad if it
+ * is one of the last ones
+ */
+static void
+sha1mb_block(const char *const *msg, unsigned int lanes, size_t len,
+             size_t n, const char **p, char (*pad)[SHA1_BLOCKSIZE])
+{
+	size_t off = n * SHA1_BLOCKSIZE;
+	uint64_t bits = (uint64_t)len * 8;
+	unsigned int i, j;
+
+	for (j = 0; j < lanes; j++) {
+		if (off + SHA1_BLOCKSIZE <= len)
+			p[j] = msg[j] + off;
+		else {
+			memset(pad[j], 0, SHA1_BLOCKSIZE);
+			if (len >= off) {
+				memcpy(pad[j], msg[j] + off, len - off);
+				pad[j][len - off] = (char)0x80;
+			}
+			if (n == sha1mb_blocks(len) - 1)
+				for (i = 0; i < 8; i++)
+					pad[j][SHA1_BLOCKSIZE - 1 - i] =
+						bits >> (8 * i);
+			p[j] = pad[j];
+		}
+	}
+}
+
+static int
+sha1mb_scalar_supported(void)
+{
+	return 1;
+}
+
+static void
+sha1mb_scalar(const char *const *msg, size_t len,
+              char (*out)[SHA1_DIGEST_LENGTH])
+{
+	struct sha1_context ctx;
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, msg[0], len);
+	sha1_final(&ctx, out[0]);
+}
+
+#ifdef SHA1MB_X86
+#include <immintrin.h>
+
+typedef uint32_t sha1mb_v4 __attribute__((vector_size(16)));
+typedef uint32_t sha1mb_v8 __attribute__((vector_size(32)));
+
+#define SHA1MB_LANES  4
+#define SHA1MB_V      sha1mb_v4
+#define SHA1MB_FUNC   sha1mb_sse2
+#define SHA1MB_TARGET "sse2"
+#include "host/sha1mb_lanes.c"
+#undef SHA1MB_LANES
+#undef SHA1MB_V
+#undef SHA1MB_FUNC
+#undef SHA1MB_TARGET
+
+#define SHA1MB_LANES  8
+#define SHA1MB_V      sha1mb_v8
+#define SHA1MB_FUNC   sha1mb_avx2
+#define SHA1MB_TARGET "avx2"
+#include "host/sha1mb_lanes.c"
+#undef SHA1MB_LANES
+#undef SHA1MB_V
+#undef SHA1MB_FUNC
+#undef SHA1MB_TARGET
+
+static int
+sha1mb_sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int
+sha1mb_avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/* not every gcc knows __builtin_cpu_supports("sha") */
+static int
+sha1mb_sha_ni_supported(void)
+{
+	unsigned int a, b, c, d;
+
+	if (__get_cpuid_max(0, NULL) < 7 ||
+	    !__builtin_cpu_supports("sse4.1"))
+		return 0;
+	__cpuid_count(7, 0, a, b, c, d);
+	return (b >> 29) & 1;
+}
+
+/*
+ * rounds 4g to 4g+3, from g = 3 on. e is the E of these rounds,
+ * f the E of the next ones, m0 to m3 the schedule from w[4g] on.
+ */
+#define NI_ROUNDS(g, e, f, m0, m1, m2, m3) do { \
+	e = _mm_sha1nexte_epu32(e, m0); \
+	f = abcd; \
+	m1 = _mm_sha1msg2_epu32(m1, m0); \
+	abcd = _mm_sha1rnds4_epu32(abcd, e, (g) / 5); \
+	m3 = _mm_sha1msg1_epu32(m3, m0); \
+	m2 = _mm_xor_si128(m2, m0); \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1mb_ni_transform(uint32_t state[5], const char *block)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+	                                    0x08090a0b0c0d0e0fULL);
+	const __m128i *p = (const __m128i *)block;
+	__m128i abcd, abcd_save, e0, e0_save, e1;
+	__m128i m0, m1, m2, m3;
+
+	abcd = _mm_loadu_si128((const __m128i *)state);
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+	abcd_save = abcd;
+	e0_save = e0;
+
+	m0 = _mm_shuffle_epi8(_mm_loadu_si128(p), mask);
+	e0 = _mm_add_epi32(e0, m0);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+	m1 = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), mask);
+	e1 = _mm_sha1nexte_epu32(e1, m1);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+	m0 = _mm_sha1msg1_epu32(m0, m1);
+
+	m2 = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), mask);
+	e0 = _mm_sha1nexte_epu32(e0, m2);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+	m1 = _mm_sha1msg1_epu32(m1, m2);
+	m0 = _mm_xor_si128(m0, m2);
+
+	m3 = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), mask);
+	NI_ROUNDS( 3, e1, e0, m3, m0, m1, m2);
+	NI_ROUNDS( 4, e0, e1, m0, m1, m2, m3);
+	NI_ROUNDS( 5, e1, e0, m1, m2, m3, m0);
+	NI_ROUNDS( 6, e0, e1, m2, m3, m0, m1);
+	NI_ROUNDS( 7, e1, e0, m3, m0, m1, m2);
+	NI_ROUNDS( 8, e0, e1, m0, m1, m2, m3);
+	NI_ROUNDS( 9, e1, e0, m1, m2, m3, m0);
+	NI_ROUNDS(10, e0, e1, m2, m3, m0, m1);
+	NI_ROUNDS(11, e1, e0, m3, m0, m1, m2);
+	NI_ROUNDS(12, e0, e1, m0, m1, m2, m3);
+	NI_ROUNDS(13, e1, e0, m1, m2, m3, m0);
+	NI_ROUNDS(14, e0, e1, m2, m3, m0, m1);
+	NI_ROUNDS(15, e1, e0, m3, m0, m1, m2);
+	NI_ROUNDS(16, e0, e1, m0, m1, m2, m3);
+	NI_ROUNDS(17, e1, e0, m1, m2, m3, m0);
+	NI_ROUNDS(18, e0, e1, m2, m3, m0, m1);
+	NI_ROUNDS(19, e1, e0, m3, m0, m1, m2);
+
+	e0 = _mm_sha1nexte_epu32(e0, e0_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	_mm_storeu_si128((__m128i *)state, abcd);
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#undef NI_ROUNDS
+
+static void
+sha1mb_sha_ni(const char *const *msg, size_t len,
+              char (*out)[SHA1_DIGEST_LENGTH])
+{
+	char pad[1][SHA1_BLOCKSIZE];
+	const char *p;
+	uint32_t state[5];
+	size_t blocks = sha1mb_blocks(len);
+	size_t n;
+	unsigned int i;
+
+	memcpy(state, sha1mb_h0, sizeof(state));
+	for (n = 0; n < blocks; n++) {
+		sha1mb_block(msg, 1, len, n, &p, pad);
+		sha1mb_ni_transform(state, p);
+	}
+
+	for (i = 0; i < 5; i++)
+		sha1mb_put_be32(out[0] + 4 * i, state[i]);
+}
+#endif
+
+/*
+ * fastest first. eight lanes of AVX2 beat the SHA extensions on
+ * a single message, whose rounds wait on each other.
+ */
+static const struct sha1mb_impl sha1mb_impls[] = {
+#ifdef SHA1MB_X86
+	{ "avx2",   8, sha1mb_avx2_supported,   sha1mb_avx2 },
+	{ "sha-ni", 1, sha1mb_sha_ni_supported, sha1mb_sha_ni },
+	{ "sse2",   4, sha1mb_sse2_supported,   sha1mb_sse2 },
+#endif
+	{ "scalar", 1, sha1mb_scalar_supported, sha1mb_scalar },
+	{ NULL, 0, NULL, NULL }
+};
+
+static const struct sha1mb_impl *sha1mb_impl;
+
+/*
+ * use the implementation called name, or the best one if name
+ * is NULL. returns -1 if the CPU doesn't have what it takes.
+ */
+static int
+sha1mb_use(const char *name)
+{
+	const struct sha1mb_impl *i;
+
+	for (i = sha1mb_impls; i->name; i++) {
+		if (name && strcmp(name, i->name))
+			continue;
+		if (!i->supported()) {
+			if (name)
+				return -1;
+			continue;
+		}
+		sha1mb_impl = i;
+		return 0;
+	}
+	return -1;
+}
+
+/* the digests of the n messages of len bytes at msg[] */
+static void
+sha1mb(const char *const *msg, size_t len,
+       char (*out)[SHA1_DIGEST_LENGTH], size_t n)
+{
+	const char *lane[SHA1MB_MAX_LANES];
+	char rest[SHA1MB_MAX_LANES][SHA1_DIGEST_LENGTH];
+	unsigned int lanes;
+	size_t i, j;
+
+	if (sha1mb_impl == NULL)
+		sha1mb_use(NULL);
+	lanes = sha1mb_impl->lanes;
+
+	for (i = 0; i + lanes <= n; i += lanes)
+		sha1mb_impl->hash(msg + i, len, out + i);
+	if (i == n)
+		return;
+
+	/* fill the lanes that are left over with the last message */
+	for (j = 0; j < lanes; j++)
+		lane[j] = msg[i + j < n ? i + j : n - 1];
+	sha1mb_impl->hash(lane, len, rest);
+	memcpy(out + i, rest, (n - i) * SHA1_DIGEST_LENGTH);
+}
+
+/*
+ * data[] as the door hashes it once the code, the key or card
+ * bytes before the '#', has been entered. len is at most 254.
+ */
+static void
+sha1mb_door_buffer(char buf[SHA1MB_DOOR], const char *code, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHA1MB_DOOR; i++)
+		buf[i] = i;
+	memcpy(buf, code, len);
+	buf[len] = (char)0xB4;
+}
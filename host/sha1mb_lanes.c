@@ -0,0 +1,96 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SHA-1 of SHA1MB_LANES messages at once, one in each lane of a
+ * SHA1MB_V vector, included by host/sha1mb.c once for every vector
+ * width. The function is called SHA1MB_FUNC and compiled for
+ * SHA1MB_TARGET.
+ */
+
+#define V_ROL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+#define V_R(v,w,x,y,z,i,f,k) \
+	z += (f) + wk[i] + (k) + V_ROL(v, 5); w = V_ROL(w, 30)
+#define V_R0(v,w,x,y,z,i) V_R(v,w,x,y,z,i, (w&(x^y))^y,      0x5A827999)
+#define V_R2(v,w,x,y,z,i) V_R(v,w,x,y,z,i, w^x^y,            0x6ED9EBA1)
+#define V_R3(v,w,x,y,z,i) V_R(v,w,x,y,z,i, ((w|x)&y)|(w&x), 0x8F1BBCDC)
+#define V_R4(v,w,x,y,z,i) V_R(v,w,x,y,z,i, w^x^y,            0xCA62C1D6)
+#define V_FIVE(R, i) do { \
+	R(a,b,c,d,e,i);     R(e,a,b,c,d,i + 1); R(d,e,a,b,c,i + 2); \
+	R(c,d,e,a,b,i + 3); R(b,c,d,e,a,i + 4); \
+} while (0)
+
+__attribute__((target(SHA1MB_TARGET)))
+static void
+SHA1MB_FUNC(const char *const *msg, size_t len,
+            char (*out)[SHA1_DIGEST_LENGTH])
+{
+	SHA1MB_V s[5], wk[80];
+	SHA1MB_V a, b, c, d, e;
+	const char *p[SHA1MB_LANES];
+	char pad[SHA1MB_LANES][SHA1_BLOCKSIZE];
+	uint32_t tw[16][SHA1MB_LANES];
+	size_t blocks = sha1mb_blocks(len);
+	size_t n;
+	unsigned int i, j;
+
+	for (i = 0; i < 5; i++)
+		s[i] = (SHA1MB_V){ 0 } + sha1mb_h0[i];
+
+	for (n = 0; n < blocks; n++) {
+		sha1mb_block(msg, SHA1MB_LANES, len, n, p, pad);
+		for (i = 0; i < 16; i++)
+			for (j = 0; j < SHA1MB_LANES; j++)
+				tw[i][j] = sha1mb_be32(p[j] + 4 * i);
+		memcpy(wk, tw, sizeof(tw));
+		for (i = 16; i < 80; i++) {
+			a = wk[i - 3] ^ wk[i - 8] ^ wk[i - 14] ^ wk[i - 16];
+			wk[i] = V_ROL(a, 1);
+		}
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+		V_FIVE(V_R0,  0); V_FIVE(V_R0,  5);
+		V_FIVE(V_R0, 10); V_FIVE(V_R0, 15);
+		V_FIVE(V_R2, 20); V_FIVE(V_R2, 25);
+		V_FIVE(V_R2, 30); V_FIVE(V_R2, 35);
+		V_FIVE(V_R3, 40); V_FIVE(V_R3, 45);
+		V_FIVE(V_R3, 50); V_FIVE(V_R3, 55);
+		V_FIVE(V_R4, 60); V_FIVE(V_R4, 65);
+		V_FIVE(V_R4, 70); V_FIVE(V_R4, 75);
+		s[0] += a;
+		s[1] += b;
+		s[2] += c;
+		s[3] += d;
+		s[4] += e;
+	}
+
+	for (j = 0; j < SHA1MB_LANES; j++)
+		for (i = 0; i < 5; i++)
+			sha1mb_put_be32(out[j] + 4 * i, s[i][j]);
+}
+
+#undef V_ROL
+#undef V_R
+#undef V_R0
+#undef V_R2
+#undef V_R3
+#undef V_R4
+#undef V_FIVE
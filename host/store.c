@@ -0,0 +1,249 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The member store of the host daemon, a file of authorized digests
+ * that is used straight from an mmap.
+ *
+ * The file is a struct store_header followed by a power of two
+ * number of 20 byte slots, an open addressing hash table with linear
+ * probing that is at most half full. SHA-1 digests are uniformly
+ * distributed already, so a digest's home slot is simply its first
+ * 32 bit little endian word modulo the number of slots. An all zero
+ * slot is empty, which is why that digest can't be stored.
+ *
+ * store_write() writes the new file next to the old one and renames
+ * it over it, so a daemon with the old file mapped keeps using it
+ * until it has mapped the new one. Anything else that updates the
+ * store has to do the same, a mapped file that is truncated or
+ * rewritten in place crashes the daemon with SIGBUS.
+ *
+ * Needs <errno.h>, <fcntl.h>, <stdint.h>, <stdio.h>, <stdlib.h>,
+ * <string.h>, <sys/mman.h>, <sys/stat.h>, <unistd.h> and digest.c.
+ */
+
+#define STORE_MAGIC "DOORDB1"
+
+struct store_header {
+	char magic[8];
+	uint32_t slots;
+	uint32_t count;
+};
+
+struct store {
+	const struct store_header *h;
+	const unsigned char *slot;
+	size_t size;
+	/* to see if the file has been replaced */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
+static uint32_t
+store_home(const unsigned char *digest, uint32_t slots)
+{
+	return ((uint32_t)digest[0] | (uint32_t)digest[1] << 8 |
+	        (uint32_t)digest[2] << 16 | (uint32_t)digest[3] << 24) &
+	       (slots - 1);
+}
+
+static int
+store_empty(const unsigned char *slot)
+{
+	static const unsigned char zero[DIGEST_LENGTH];
+
+	return memcmp(slot, zero, DIGEST_LENGTH) == 0;
+}
+
+/*
+ * start loading the home slot of digest, so a batch
+ * of lookups waits for memory only once
+ */
+static void
+store_prefetch(const struct store *s, const char *digest)
+{
+	uint32_t i = store_home((const unsigned char *)digest, s->h->slots);
+
+	__builtin_prefetch(s->slot + (size_t)i * DIGEST_LENGTH);
+}
+
+/*
+ * returns 1 if digest is in the store. the header only promises an
+ * empty slot, a damaged file may not have one, so no more than all
+ * slots are probed.
+ */
+static int
+store_find(const struct store *s, const char *digest)
+{
+	uint32_t mask = s->h->slots - 1;
+	uint32_t i = store_home((const unsigned char *)digest, s->h->slots);
+	uint32_t n;
+
+	for (n = 0; n < s->h->slots; n++) {
+		const unsigned char *slot = s->slot + (size_t)i * DIGEST_LENGTH;
+
+		if (memcmp(slot, digest, DIGEST_LENGTH) == 0)
+			return !store_empty(slot);
+		if (store_empty(slot))
+			return 0;
+		i = (i + 1) & mask;
+	}
+	return 0;
+}
+
+/* map the store in path, returns -1 with errno set on failure */
+static int
+store_open(struct store *s, const char *path)
+{
+	struct stat st;
+	void *p;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0)
+		goto fail;
+	if ((size_t)st.st_size < sizeof(struct store_header)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	close(fd);
+
+	s->h = p;
+	s->slot = (const unsigned char *)p + sizeof(struct store_header);
+	s->size = st.st_size;
+	s->dev = st.st_dev;
+	s->ino = st.st_ino;
+	s->mtime = st.st_mtim;
+
+	/* it has to be at least one slot bigger than full */
+	if (memcmp(s->h->magic, STORE_MAGIC, sizeof(s->h->magic)) ||
+	    s->h->slots < 2 || (s->h->slots & (s->h->slots - 1)) ||
+	    s->h->count >= s->h->slots ||
+	    s->size != sizeof(struct store_header) +
+	               (size_t)s->h->slots * DIGEST_LENGTH) {
+		munmap(p, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	madvise(p, st.st_size, MADV_WILLNEED);
+	return 0;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+static void
+store_close(struct store *s)
+{
+	if (s->h)
+		munmap((void *)s->h, s->size);
+	s->h = NULL;
+}
+
+/* returns 1 if path is no longer the file s was mapped from */
+static int
+store_changed(const struct store *s, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return 0;
+
+	return st.st_dev != s->dev || st.st_ino != s->ino ||
+	       st.st_mtim.tv_sec != s->mtime.tv_sec ||
+	       st.st_mtim.tv_nsec != s->mtime.tv_nsec;
+}
+
+/*
+ * write the n digests to a new store in path, duplicates are only
+ * stored once. returns -1 with errno set on failure.
+ */
+static int
+store_write(const char *path, const char *digests, uint32_t n)
+{
+	struct store_header h;
+	unsigned char *slot;
+	char tmp[4096];
+	uint32_t i;
+	FILE *f;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, STORE_MAGIC, sizeof(h.magic));
+	for (h.slots = 2; h.slots < 2 * (uint64_t)n; h.slots <<= 1)
+		if (h.slots == 0x80000000) {
+			errno = EFBIG;
+			return -1;
+		}
+
+	slot = calloc(h.slots, DIGEST_LENGTH);
+	if (slot == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		const unsigned char *d = (const unsigned char *)digests +
+		                         (size_t)i * DIGEST_LENGTH;
+		uint32_t j = store_home(d, h.slots);
+
+		if (store_empty(d)) {
+			free(slot);
+			errno = EINVAL;
+			return -1;
+		}
+		while (!store_empty(slot + (size_t)j * DIGEST_LENGTH) &&
+		       memcmp(slot + (size_t)j * DIGEST_LENGTH, d,
+		              DIGEST_LENGTH))
+			j = (j + 1) & (h.slots - 1);
+		if (store_empty(slot + (size_t)j * DIGEST_LENGTH)) {
+			memcpy(slot + (size_t)j * DIGEST_LENGTH, d,
+			       DIGEST_LENGTH);
+			h.count++;
+		}
+	}
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		free(slot);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		free(slot);
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+	    fwrite(slot, DIGEST_LENGTH, h.slots, f) != h.slots ||
+	    fflush(f) || fsync(fileno(f))) {
+		fclose(f);
+		free(slot);
+		unlink(tmp);
+		return -1;
+	}
+	free(slot);
+	if (fclose(f) || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The door's serial port for the host tools.
+ * Needs <fcntl.h>, <termios.h> and <unistd.h>.
+ */
+
+static speed_t
+tty_speed(unsigned long baud)
+{
+	switch (baud) {
+	case 9600:
+		return B9600;
+	case 19200:
+		return B19200;
+	case 38400:
+		return B38400;
+	case 57600:
+		return B57600;
+	case 115200:
+		return B115200;
+#ifdef B250000
+	case 250000:
+		return B250000;
+#endif
+	}
+	return B0;
+}
+
+/*
+ * switch to baud, 8E2 like the door. returns -1 if
+ * the rate is not supported here.
+ */
+static int
+tty_baud(int fd, unsigned long baud)
+{
+	struct termios t;
+	speed_t speed = tty_speed(baud);
+
+	if (speed == B0 || tcgetattr(fd, &t) < 0)
+		return -1;
+
+	cfmakeraw(&t);
+	t.c_cflag |= CS8 | PARENB | CSTOPB | CLOCAL | CREAD;
+	t.c_cflag &= ~PARODD;
+	cfsetispeed(&t, speed);
+	cfsetospeed(&t, speed);
+
+	/* let what is on its way out go at the old rate */
+	return tcsetattr(fd, TCSADRAIN, &t);
+}
+
+static int
+tty_open(const char *path)
+{
+	int fd = open(path, O_RDWR | O_NOCTTY);
+
+	if (fd < 0)
+		return -1;
+
+	if (tty_baud(fd, 9600) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+/*
+ * write buf, after a NUL that wakes up a door built with -DPOWER_DOWN
+ * and is ignored otherwise. returns -1 unless all of it was written.
+ */
+static inline int
+tty_write(int fd, const void *buf, size_t len)
+{
+	static const char wake = '\0';
+
+	if (write(fd, &wake, 1) != 1 ||
+	    write(fd, buf, len) != (ssize_t)len)
+		return -1;
+	return 0;
+}
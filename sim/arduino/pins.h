@@ -0,0 +1,58 @@
+/*
+ * Simulated <arduino/pins.h>, see sim/sim.h
+ */
+
+#ifndef _ARDUINO_PINS_H
+#define _ARDUINO_PINS_H
+
+#include <sim.h>
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+#define cli() sim_cli()
+#define sei() sim_sei()
+
+#define pin_mode_input(pin)  sim_pin_mode(pin, 0)
+#define pin_mode_output(pin) sim_pin_mode(pin, 1)
+#define pin_high(pin)        sim_pin_write(pin, 1)
+#define pin_low(pin)         sim_pin_write(pin, 0)
+#define pin_toggle(pin)      sim_pin_write(pin, !sim_pin_read(pin))
+#define pin_is_high(pin)     sim_pin_read(pin)
+#define pin_is_low(pin)      (!sim_pin_read(pin))
+
+#define pin2_interrupt_mode_low()     sim_int_sense(0, SIM_LOW)
+#define pin2_interrupt_mode_change()  sim_int_sense(0, SIM_CHANGE)
+#define pin2_interrupt_mode_falling() sim_int_sense(0, SIM_FALLING)
+#define pin2_interrupt_mode_rising()  sim_int_sense(0, SIM_RISING)
+#define pin2_interrupt_enable()       sim_irq_enable(SIM_INT0)
+#define pin2_interrupt_disable()      sim_irq_disable(SIM_INT0)
+#define pin2_interrupt()              SIM_ISR(INT0)
+
+#define pin3_interrupt_mode_low()     sim_int_sense(1, SIM_LOW)
+#define pin3_interrupt_mode_change()  sim_int_sense(1, SIM_CHANGE)
+#define pin3_interrupt_mode_falling() sim_int_sense(1, SIM_FALLING)
+#define pin3_interrupt_mode_rising()  sim_int_sense(1, SIM_RISING)
+#define pin3_interrupt_enable()       sim_irq_enable(SIM_INT1)
+#define pin3_interrupt_disable()      sim_irq_disable(SIM_INT1)
+#define pin3_interrupt()              SIM_ISR(INT1)
+
+#define pin_interrupt_mask(pin)       sim_pcint_mask(pin)
+
+#define pin_0to7_interrupt_enable()   sim_irq_enable(SIM_PCINT2)
+#define pin_0to7_interrupt_disable()  sim_irq_disable(SIM_PCINT2)
+#define pin_0to7_interrupt()          SIM_ISR(PCINT2)
+
+#define pin_8to13_interrupt_enable()  sim_irq_enable(SIM_PCINT0)
+#define pin_8to13_interrupt_disable() sim_irq_disable(SIM_PCINT0)
+#define pin_8to13_interrupt()         SIM_ISR(PCINT0)
+
+#define pin_A0toA5_interrupt_enable()  sim_irq_enable(SIM_PCINT1)
+#define pin_A0toA5_interrupt_disable() sim_irq_disable(SIM_PCINT1)
+#define pin_A0toA5_interrupt()         SIM_ISR(PCINT1)
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Simulated <arduino/serial.h>, see sim/sim.h
+ */
+
+#ifndef _ARDUINO_SERIAL_H
+#define _ARDUINO_SERIAL_H
+
+#include <sim.h>
+
+#define serial_baud_9600()   sim_uart_baud(9600)
+#define serial_baud_19200()  sim_uart_baud(19200)
+#define serial_baud_38400()  sim_uart_baud(38400)
+#define serial_baud_57600()  sim_uart_baud(57600)
+#define serial_baud_115200() sim_uart_baud(115200)
+#define serial_baud_250000() sim_uart_baud(250000)
+
+/* start bit + data bits + parity + stop bits */
+#define serial_mode_8n1() sim_uart_frame(10)
+#define serial_mode_8e1() sim_uart_frame(11)
+#define serial_mode_8e2() sim_uart_frame(12)
+
+#define serial_transmitter_enable() do {} while (0)
+#define serial_receiver_enable()    do {} while (0)
+
+#define serial_read()    sim_uart_read()
+#define serial_write(c)  sim_uart_write(c)
+
+#define serial_interrupt_rx_enable()   sim_irq_enable(SIM_USART_RX)
+#define serial_interrupt_rx_disable()  sim_irq_disable(SIM_USART_RX)
+#define serial_interrupt_rx()          SIM_ISR(USART_RX)
+
+#define serial_interrupt_dre_enable()  sim_irq_enable(SIM_USART_UDRE)
+#define serial_interrupt_dre_disable() sim_irq_disable(SIM_USART_UDRE)
+#define serial_interrupt_dre()         SIM_ISR(USART_UDRE)
+
+#endif
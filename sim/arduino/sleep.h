@@ -0,0 +1,17 @@
+/*
+ * Simulated <arduino/sleep.h>, see sim/sim.h
+ */
+
+#ifndef _ARDUINO_SLEEP_H
+#define _ARDUINO_SLEEP_H
+
+#include <sim.h>
+
+#define sleep_mode_idle()       sim_sleep_mode(0)
+#define sleep_mode_power_down() sim_sleep_mode(2)
+
+#define sleep_enable()  sim_sleep_enable(1)
+#define sleep_disable() sim_sleep_enable(0)
+#define sleep_cpu()     sim_sleep_cpu()
+
+#endif
@@ -0,0 +1,17 @@
+/*
+ * Simulated <arduino/spi.h>, see sim/sim.h
+ */
+
+#ifndef _ARDUINO_SPI_H
+#define _ARDUINO_SPI_H
+
+#include <sim.h>
+
+#define spi_mode_master() do {} while (0)
+#define spi_enable()      do {} while (0)
+
+#define spi_write(c)            sim_spi_write(c)
+#define spi_read()              sim_spi_read()
+#define spi_interrupt_flag()    1
+
+#endif
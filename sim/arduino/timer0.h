@@ -0,0 +1,32 @@
+/*
+ * Simulated <arduino/timer0.h>, see sim/sim.h
+ */
+
+#ifndef _ARDUINO_TIMER0_H
+#define _ARDUINO_TIMER0_H
+
+#include <sim.h>
+
+#define timer0_clock_off()   sim_timer0_clock(0)
+#define timer0_clock_d1()    sim_timer0_clock(1)
+#define timer0_clock_d8()    sim_timer0_clock(8)
+#define timer0_clock_d64()   sim_timer0_clock(64)
+#define timer0_clock_d256()  sim_timer0_clock(256)
+#define timer0_clock_d1024() sim_timer0_clock(1024)
+
+#define timer0_mode_normal() do {} while (0)
+
+#define timer0_count()           sim_timer0_count()
+#define timer0_compare_a_set(v)  sim_timer0_compare(0, v)
+#define timer0_compare_b_set(v)  sim_timer0_compare(1, v)
+#define timer0_flags_clear()     sim_timer0_flags_clear()
+
+#define timer0_interrupt_a_enable()  sim_irq_enable(SIM_TIMER0_COMPA)
+#define timer0_interrupt_a_disable() sim_irq_disable(SIM_TIMER0_COMPA)
+#define timer0_interrupt_a()         SIM_ISR(TIMER0_COMPA)
+
+#define timer0_interrupt_b_enable()  sim_irq_enable(SIM_TIMER0_COMPB)
+#define timer0_interrupt_b_disable() sim_irq_disable(SIM_TIMER0_COMPB)
+#define timer0_interrupt_b()         SIM_ISR(TIMER0_COMPB)
+
+#endif
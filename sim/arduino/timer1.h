@@ -0,0 +1,35 @@
+/*
+ * Simulated <arduino/timer1.h>, see sim/sim.h
+ */
+
+#ifndef _ARDUINO_TIMER1_H
+#define _ARDUINO_TIMER1_H
+
+#include <sim.h>
+
+#define timer1_clock_off()   sim_timer1_clock(0)
+#define timer1_clock_d1()    sim_timer1_clock(1)
+#define timer1_clock_d8()    sim_timer1_clock(8)
+#define timer1_clock_d64()   sim_timer1_clock(64)
+#define timer1_clock_d256()  sim_timer1_clock(256)
+#define timer1_clock_d1024() sim_timer1_clock(1024)
+#define timer1_clock_reset() do {} while (0)
+
+#define timer1_mode_normal() sim_timer1_ctc(0)
+#define timer1_mode_ctc()    sim_timer1_ctc(1)
+
+#define timer1_count()          sim_timer1_count()
+#define timer1_count_set(v)     sim_timer1_count_set(v)
+#define timer1_compare_a_set(v) sim_timer1_compare_a(v)
+#define timer1_compare_b_set(v) sim_timer1_compare_b(v)
+#define timer1_flags_clear()    sim_timer1_flags_clear()
+
+#define timer1_interrupt_a_enable()  sim_irq_enable(SIM_TIMER1_COMPA)
+#define timer1_interrupt_a_disable() sim_irq_disable(SIM_TIMER1_COMPA)
+#define timer1_interrupt_a()         SIM_ISR(TIMER1_COMPA)
+
+#define timer1_interrupt_b_enable()  sim_irq_enable(SIM_TIMER1_COMPB)
+#define timer1_interrupt_b_disable() sim_irq_disable(SIM_TIMER1_COMPB)
+#define timer1_interrupt_b()         SIM_ISR(TIMER1_COMPB)
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * Simulated <arduino/timer2.h>, see sim/sim.h
+ */
+
+#ifndef _ARDUINO_TIMER2_H
+#define _ARDUINO_TIMER2_H
+
+#include <sim.h>
+
+#define timer2_clock_off()   sim_timer2_clock(0)
+#define timer2_clock_d1()    sim_timer2_clock(1)
+#define timer2_clock_d8()    sim_timer2_clock(8)
+#define timer2_clock_d32()   sim_timer2_clock(32)
+#define timer2_clock_d64()   sim_timer2_clock(64)
+#define timer2_clock_d128()  sim_timer2_clock(128)
+#define timer2_clock_d256()  sim_timer2_clock(256)
+#define timer2_clock_d1024() sim_timer2_clock(1024)
+
+#define timer2_mode_normal() do {} while (0)
+
+#define timer2_count()         sim_timer2_count()
+#define timer2_overflow_flag() sim_irq_pending(SIM_TIMER2_OVF)
+
+#define timer2_interrupt_overflow_enable()  sim_irq_enable(SIM_TIMER2_OVF)
+#define timer2_interrupt_overflow_disable() sim_irq_disable(SIM_TIMER2_OVF)
+#define timer2_interrupt_overflow()         SIM_ISR(TIMER2_OVF)
+
+#endif
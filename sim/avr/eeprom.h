@@ -0,0 +1,50 @@
+/*
+ * Simulated <avr/eeprom.h>, see sim/sim.h
+ */
+
+#ifndef _AVR_EEPROM_H
+#define _AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sim.h>
+
+#define E2END (SIM_EEPROM_SIZE - 1)
+
+#define eeprom_is_ready()  1
+#define eeprom_busy_wait() do {} while (0)
+
+static inline uint8_t
+eeprom_read_byte(const uint8_t *p)
+{
+	return sim_eeprom_read((uintptr_t)p);
+}
+
+static inline void
+eeprom_update_byte(uint8_t *p, uint8_t value)
+{
+	if (sim_eeprom_read((uintptr_t)p) != value)
+		sim_eeprom_write((uintptr_t)p, value);
+}
+
+static inline void
+eeprom_read_block(void *dst, const void *src, size_t n)
+{
+	uint8_t *d = dst;
+	uintptr_t a = (uintptr_t)src;
+
+	while (n--)
+		*d++ = sim_eeprom_read(a++);
+}
+
+static inline void
+eeprom_update_block(const void *src, void *dst, size_t n)
+{
+	const uint8_t *s = src;
+	uint8_t *a = dst;
+
+	while (n--)
+		eeprom_update_byte(a++, *s++);
+}
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * Simulated <avr/interrupt.h>, see sim/sim.h
+ */
+
+#ifndef _AVR_INTERRUPT_H
+#define _AVR_INTERRUPT_H
+
+#include <sim.h>
+
+#define WDT_vect WDT
+
+/* expand WDT_vect before it is pasted */
+#define SIM_ISR_VECTOR(vector) SIM_ISR(vector)
+#define ISR(vector)            SIM_ISR_VECTOR(vector)
+
+#endif
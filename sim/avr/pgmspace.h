@@ -0,0 +1,15 @@
+/*
+ * Simulated <avr/pgmspace.h>, see sim/sim.h
+ *
+ * The host has one address space, so flash is plain const data.
+ */
+
+#ifndef _AVR_PGMSPACE_H
+#define _AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+
+#endif
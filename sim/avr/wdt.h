@@ -0,0 +1,31 @@
+/*
+ * Simulated <avr/wdt.h>, see sim/sim.h
+ *
+ * Only the interrupt mode of the watchdog is simulated. WDTCSR is a
+ * plain variable the simulator looks at, so the timed sequence that
+ * unlocks it on real hardware is accepted but not needed.
+ */
+
+#ifndef _AVR_WDT_H
+#define _AVR_WDT_H
+
+#include <sim.h>
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE  3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+#define WDIF 7
+
+#define WDTCSR sim_wdtcsr
+
+#define wdt_reset() sim_wdt_reset()
+
+#endif
@@ -0,0 +1,955 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the firmware against the simulated HAL and checks
+ * that the door still behaves the way the host expects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "doorduino.h"
+#include "tools/sha1.c"
+#define FRAME_DECODER
+#include "tools/frame.h"
+#ifdef BLOOM_BYTES
+#include "tools/bloom.h"
+#endif
+
+#ifndef MFRC522_READERS
+#define MFRC522_READERS 1
+#endif
+
+static const uint8_t mfrc522_ss[] = {
+	SIM_PIN_MFRC522_SS, SIM_PIN_MFRC522_SS1, SIM_PIN_MFRC522_SS2
+};
+
+static char output[4096];
+static size_t output_len;
+static unsigned int failures;
+
+/* the firmware sends frames, decode them into output */
+static int binary;
+static struct frame_decoder decoder;
+static unsigned int unframed;
+
+static void
+firmware(void)
+{
+	door_main();
+}
+
+static void
+run(uint64_t cycles)
+{
+	char buf[256];
+	size_t i, n;
+
+	sim_run(cycles);
+	if (!binary) {
+		output_len += sim_uart_tx(output + output_len,
+		                          sizeof(output) - 1 - output_len);
+		output[output_len] = '\0';
+		return;
+	}
+
+	while ((n = sim_uart_tx(buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			char line[2 * FRAME_MAX + 8];
+
+			if (!frame_decode(&decoder, buf[i]))
+				continue;
+			if (!decoder.framed) {
+				unframed++;
+				continue;
+			}
+			frame_line(&decoder, line);
+			strcat(line, "\n");
+			if (output_len + strlen(line) < sizeof(output)) {
+				strcpy(output + output_len, line);
+				output_len += strlen(line);
+			}
+		}
+	}
+}
+
+#ifdef WIEGAND
+/* the door times the frame out 20ms after the last pulse */
+static void
+wiegand_send(uint64_t frame, uint8_t bits)
+{
+	run(sim_wiegand_at(sim_now, frame, bits) - sim_now + SIM_MS(22));
+}
+
+/* an 8 bit Wiegand key, with '#' as 0xB4 like on the keypad */
+static void
+keypad_send(uint8_t c)
+{
+	uint8_t k = c == 0xB4 ? 11 : c;
+
+	wiegand_send((~k & 0x0f) << 4 | k, 8);
+}
+#else
+static void
+keypad_send(uint8_t c)
+{
+	run(sim_keypad_at(sim_now, &c, 1) - sim_now + SIM_MS(20));
+}
+#endif
+
+static void
+em4100_send(const uint8_t *buf, size_t len)
+{
+	run(sim_em4100_at(sim_now, buf, len) - sim_now + SIM_MS(5));
+}
+
+static void
+host_send(const char *s)
+{
+#ifdef POWER_DOWN
+	/* wake the door up, the NUL itself is lost or ignored */
+	sim_host_at(sim_now, (const uint8_t *)"", 1);
+	run(F_CPU * 12 / sim_host_baud);
+#endif
+	run(sim_host_at(sim_now, (const uint8_t *)s, strlen(s)) - sim_now +
+	    SIM_MS(1));
+}
+
+static void
+expected_hash(const uint8_t *code, size_t len, char *out)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	uint8_t data[256];
+	struct sha1_context ctx;
+	char digest[SHA1_DIGEST_LENGTH];
+	unsigned int i;
+
+	for (i = 0; i < 256; i++)
+		data[i] = i;
+	memcpy(data, code, len);
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, (char *)data, 256);
+	sha1_final(&ctx, digest);
+
+	out += sprintf(out, "HASH+");
+	for (i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+		*out++ = hex[(uint8_t)digest[i] >> 4];
+		*out++ = hex[(uint8_t)digest[i] & 0x0f];
+	}
+	strcpy(out, "\n");
+}
+
+static void
+check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+/*
+ * check that line is printed within a second
+ * and consume all output up to it
+ */
+static void
+expect(const char *line, const char *what)
+{
+	uint64_t start = sim_now;
+	char *p;
+
+	while ((p = strstr(output, line)) == NULL && sim_now - start < SIM_MS(1000))
+		run(SIM_MS(1));
+
+	check(p != NULL, what);
+	if (p == NULL)
+		return;
+
+	p += strlen(line);
+	output_len -= p - output;
+	memmove(output, p, output_len + 1);
+}
+
+#ifndef WIEGAND
+static void
+test_keypad(void)
+{
+	static const uint8_t code[] = {
+		0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xB4
+	};
+	char hash[64];
+	size_t i;
+
+	for (i = 0; i < sizeof(code); i++)
+		keypad_send(code[i]);
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "keypad code gives HASH+");
+}
+#endif
+
+static void
+test_open(void)
+{
+	uint64_t start;
+
+	sim_uart_rx('O');
+	run(SIM_MS(10));
+	check(!sim_pin_level(SIM_PIN_OPEN_LOCK), "'O' opens the lock");
+	check(strstr(output, "OPENAKCK") == NULL, "OPENAKCK waits for the lock");
+	start = sim_now;
+	while (sim_pin_level(SIM_PIN_OPEN_LOCK) == 0 && sim_now - start < SIM_MS(1000))
+		run(SIM_MS(1));
+	check(sim_now - start >= SIM_MS(480) && sim_now - start <= SIM_MS(500),
+	      "lock is held for 500ms");
+	run(SIM_MS(10));
+	expect("OPENAKCK\n", "OPENAKCK after the lock closes");
+}
+
+/* with the pattern queue full of blinking, 'O' still opens */
+static void
+test_open_queue_full(void)
+{
+	uint64_t start;
+
+	host_send("RRRRRRRRRR");
+	expect("SEQFULL\n", "'R' that doesn't fit in the queue gives SEQFULL");
+	host_send("O");
+	start = sim_now;
+	while (sim_pin_level(SIM_PIN_OPEN_LOCK) && sim_now - start < SIM_MS(2000))
+		run(SIM_MS(1));
+	check(sim_now - start <= SIM_MS(600),
+	      "'O' opens after the playing pattern, not the queued ones");
+	expect("OPENAKCK\n", "OPENAKCK with a full pattern queue");
+	run(SIM_MS(100));
+}
+
+static void
+test_keypad_while_blinking(void)
+{
+	static const uint8_t code[] = {
+		1, 2, 3, 4, 5, 6, 7, 8, 9, 0xB4
+	};
+	char hash[64];
+	size_t i;
+
+	sim_uart_rx('V');
+	run(SIM_MS(1));
+	for (i = 0; i < sizeof(code); i++)
+		keypad_send(code[i]);
+	expected_hash(code, sizeof(code), hash);
+	check(!sim_pin_level(SIM_PIN_GREEN_LED), "'V' is still blinking");
+	expect(hash, "keypad is serviced while 'V' blinks");
+	run(SIM_MS(1500));
+}
+
+static void
+test_em4100(void)
+{
+	static const uint8_t frame[] = {
+		2, '0', '1', '0', '2', '0', '3', '0', '4', '0', '5',
+		'0', '1', 13, 10, 3
+	};
+	uint8_t frame2[sizeof(frame)];
+	uint8_t code[11];
+	char hash[64];
+
+	em4100_send(frame, sizeof(frame));
+#ifdef POWER_DOWN
+	/* the first one wakes the door up, the reader sends it again */
+	em4100_send(frame, sizeof(frame));
+#endif
+	run(SIM_MS(600));
+	keypad_send(0xB4);
+
+	memcpy(code, frame + 1, 10);
+	code[10] = 0xB4;
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "EM4100 tag + '#' gives HASH+");
+
+	/* a break is a framing error, the tag after it is read */
+	memcpy(frame2, frame, sizeof(frame));
+	frame2[10] = '6';
+	frame2[12] = '2';
+	memcpy(code, frame2 + 1, 10);
+	expected_hash(code, sizeof(code), hash);
+	run(SIM_MS(1000));
+	sim_pin_drive(SIM_PIN_SOFTSERIAL, 0);
+	run(SIM_MS(5));
+	sim_pin_drive(SIM_PIN_SOFTSERIAL, 1);
+	run(SIM_MS(1));
+	em4100_send(frame2, sizeof(frame2));
+#ifdef POWER_DOWN
+	em4100_send(frame2, sizeof(frame2));
+#endif
+	run(SIM_MS(600));
+	keypad_send(0xB4);
+	expect(hash, "EM4100 tag after a break gives HASH+");
+}
+
+static void
+test_mfrc522(void)
+{
+	static const struct sim_card card = {
+		{ 0xde, 0xad, 0xbe, 0xef }, 4, { 0x04, 0x00 }, 0x08
+	};
+	uint8_t code[11] = { 'M', 'F', 'R', 0x04, 0x00,
+	                     0xde, 0xad, 0xbe, 0xef, 0xde ^ 0xad ^ 0xbe ^ 0xef,
+	                     0xB4 };
+	char hash[64];
+
+	sim_mfrc522_card_add(SIM_PIN_MFRC522_SS, &card);
+	run(SIM_MS(600));
+	sim_mfrc522_card_remove(SIM_PIN_MFRC522_SS, &card);
+	keypad_send(0xB4);
+
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "MFRC522 card + '#' gives HASH+");
+}
+
+static void
+test_mfrc522_cascade(void)
+{
+	static const struct sim_card card = {
+		{ 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 }, 7, { 0x44, 0x00 }, 0x00
+	};
+	uint8_t code[16] = { 'M', 'F', 'R', 0x44, 0x00,
+	                     0x88, 0x04, 0x11, 0x22, 0x88 ^ 0x04 ^ 0x11 ^ 0x22,
+	                     0x33, 0x44, 0x55, 0x66, 0x33 ^ 0x44 ^ 0x55 ^ 0x66,
+	                     0xB4 };
+	char hash[64];
+
+	sim_mfrc522_card_add(SIM_PIN_MFRC522_SS, &card);
+	run(SIM_MS(600));
+	sim_mfrc522_card_remove(SIM_PIN_MFRC522_SS, &card);
+	keypad_send(0xB4);
+
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "7 byte UID card + '#' gives HASH+");
+}
+
+static void
+test_mfrc522_collision(void)
+{
+	static const struct sim_card cards[] = {
+		{ { 0xde, 0xad, 0xbe, 0x6f }, 4, { 0x04, 0x00 }, 0x08 },
+		{ { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 }, 7, { 0x44, 0x00 }, 0x00 },
+		{ { 0xde, 0xad, 0xbe, 0xef }, 4, { 0x04, 0x00 }, 0x08 },
+	};
+	/* the ATQAs collide, anticollision follows the 1 bits */
+	uint8_t code[11] = { 'M', 'F', 'R', 0x44, 0x00,
+	                     0xde, 0xad, 0xbe, 0xef, 0xde ^ 0xad ^ 0xbe ^ 0xef,
+	                     0xB4 };
+	char hash[64];
+	size_t i;
+
+	const char *p;
+	unsigned int lines = 0;
+
+	output_len = 0;
+	output[0] = '\0';
+	for (i = 0; i < 3; i++)
+		sim_mfrc522_card_add(SIM_PIN_MFRC522_SS, &cards[i]);
+	run(SIM_MS(600));
+	for (p = output; (p = strstr(p, "CARD+")) != NULL; p++)
+		lines++;
+	check(lines == 3, "three cards at once give a CARD+ line each");
+	check(strstr(output, "CARD+4D4652440088041122") != NULL,
+	      "CARD+ has the whole 7 byte UID");
+	for (i = 0; i < 3; i++)
+		sim_mfrc522_card_remove(SIM_PIN_MFRC522_SS, &cards[i]);
+	keypad_send(0xB4);
+
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "three cards at once, one wins anticollision");
+}
+
+static void
+test_mfrc522_resting(void)
+{
+	static const struct sim_card card = {
+		{ 0x12, 0x34, 0x56, 0x78 }, 4, { 0x04, 0x00 }, 0x08
+	};
+	static const uint8_t digits[] = {
+		9, 8, 7, 6, 5, 4, 3, 2, 1, 0xB4
+	};
+	uint8_t code[11] = { 'M', 'F', 'R', 0x04, 0x00,
+	                     0x12, 0x34, 0x56, 0x78, 0x12 ^ 0x34 ^ 0x56 ^ 0x78,
+	                     0xB4 };
+	char hash[64];
+	size_t i;
+
+	sim_mfrc522_card_add(SIM_PIN_MFRC522_SS, &card);
+	run(SIM_MS(600));
+	keypad_send(0xB4);
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "resting card + '#' gives HASH+");
+
+	/* the idle timeout clears the buffer, the card must not come back */
+	run(SIM_MS(10500));
+	expect("ALIVE\n", "ALIVE with a card resting on the reader");
+	for (i = 0; i < sizeof(digits); i++)
+		keypad_send(digits[i]);
+	expected_hash(digits, sizeof(digits), hash);
+	expect(hash, "resting card is only read once");
+
+	sim_mfrc522_card_remove(SIM_PIN_MFRC522_SS, &card);
+	run(SIM_MS(2500));
+	sim_mfrc522_card_add(SIM_PIN_MFRC522_SS, &card);
+	run(SIM_MS(600));
+	sim_mfrc522_card_remove(SIM_PIN_MFRC522_SS, &card);
+	keypad_send(0xB4);
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "card is read again once it was taken away");
+}
+
+#if MFRC522_READERS > 1
+static void
+test_mfrc522_readers(void)
+{
+	static const struct sim_card cards[] = {
+		{ { 0x11, 0x22, 0x33, 0x44 }, 4, { 0x04, 0x00 }, 0x08 },
+		{ { 0x55, 0x66, 0x77, 0x88 }, 4, { 0x04, 0x00 }, 0x08 },
+		{ { 0x99, 0xaa, 0xbb, 0xcc }, 4, { 0x04, 0x00 }, 0x08 },
+	};
+	static const uint8_t digits[] = {
+		7, 7, 3, 3, 5, 5, 1, 1, 9, 0xB4
+	};
+	uint8_t code[11] = { 'M', 'F', 'R', 0x04, 0x00 };
+	char line[8];
+	char hash[64];
+	size_t i;
+
+	/* a card on the last reader */
+	i = MFRC522_READERS - 1;
+	sim_mfrc522_card_add(mfrc522_ss[i], &cards[i]);
+	run(SIM_MS(600));
+	sim_mfrc522_card_remove(mfrc522_ss[i], &cards[i]);
+	keypad_send(0xB4);
+	memcpy(code + 5, cards[i].uid, 4);
+	code[9] = code[5] ^ code[6] ^ code[7] ^ code[8];
+	code[10] = 0xB4;
+	expected_hash(code, sizeof(code), hash);
+	sprintf(line, "RDR+%u\n", (unsigned int)i);
+	expect(line, "card on the last reader gives its RDR+");
+	expect(hash, "card on the last reader gives HASH+");
+
+	/* a card on every reader, they are all polled at once */
+	for (i = 0; i < MFRC522_READERS; i++)
+		sim_mfrc522_card_add(mfrc522_ss[i], &cards[i]);
+	run(SIM_MS(600));
+	for (i = 0; i < MFRC522_READERS; i++)
+		sim_mfrc522_card_remove(mfrc522_ss[i], &cards[i]);
+	keypad_send(0xB4);
+	expect("RDR+", "card on every reader, one of them wins");
+	i = output[0] - '0';
+	if (i >= MFRC522_READERS)
+		i = 0;
+	memcpy(code + 5, cards[i].uid, 4);
+	code[9] = code[5] ^ code[6] ^ code[7] ^ code[8];
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "card on every reader gives HASH+ of the winner");
+
+	for (i = 0; i < sizeof(digits); i++)
+		keypad_send(digits[i]);
+	expected_hash(digits, sizeof(digits), hash);
+	run(SIM_MS(100));
+	check(strstr(output, "RDR+") == NULL, "keypad codes have no RDR+");
+	expect(hash, "keypad code after the cards gives HASH+");
+}
+#endif
+
+static void
+test_local(void)
+{
+	static const uint8_t code[] = {
+		1, 3, 3, 7, 1, 3, 3, 7, 1, 0xB4
+	};
+	char hash[64];
+	char cmd[16];
+	size_t i;
+
+	host_send("C");
+	expect("LOCALACK\n", "'C' clears the local store");
+
+	expected_hash(code, sizeof(code), hash);
+	sprintf(cmd, "A%.8s", hash + 5);
+	host_send(cmd);
+	expect("LOCALACK\n", "'A' adds a code to the local store");
+
+	for (i = 0; i < sizeof(code); i++)
+		keypad_send(code[i]);
+	check(!sim_pin_level(SIM_PIN_OPEN_LOCK), "known code opens the lock");
+	expect("LOCALOPEN\n", "known code gives LOCALOPEN");
+	expect(hash, "known code still gives HASH+ after it");
+	expect("OPENAKCK\n", "OPENAKCK after a local open");
+
+	sprintf(cmd, "E%.8s", hash + 5);
+	host_send(cmd);
+	expect("LOCALACK\n", "'E' erases a code from the local store");
+
+	for (i = 0; i < sizeof(code); i++)
+		keypad_send(code[i]);
+	check(sim_pin_level(SIM_PIN_OPEN_LOCK), "erased code leaves the lock shut");
+	expect(hash, "erased code gives HASH+");
+	run(SIM_MS(10));
+	check(strstr(output, "LOCALOPEN") == NULL, "erased code is left to the host");
+}
+
+/*
+ * answers to commands that come in faster than they go out
+ * must be dropped whole, not overwrite each other
+ */
+static void
+test_serial_overflow(void)
+{
+	const char *cmd = "E00000000";
+	unsigned int acks = 0;
+	unsigned int burst, i;
+	const char *p;
+	char *line;
+
+	run(SIM_MS(50));
+	output_len = 0;
+	output[0] = '\0';
+
+	/* way faster than 9600 baud, but not so fast the UART overruns */
+	for (burst = 0; burst < 3; burst++) {
+		for (i = 0; i < 7; i++) {
+			for (p = cmd; *p; p++) {
+				sim_uart_rx(*p);
+				run(SIM_US(50));
+			}
+		}
+		run(SIM_MS(1));
+	}
+	run(SIM_MS(300));
+
+	for (line = strtok(output, "\n"); line; line = strtok(NULL, "\n")) {
+		if (strcmp(line, "LOCALACK"))
+			break;
+		acks++;
+	}
+	check(line == NULL, "a full output buffer never mangles a line");
+	check(acks > 0 && acks < 3 * 7, "what doesn't fit is dropped");
+	output_len = 0;
+	output[0] = '\0';
+}
+
+#ifdef POWER_DOWN
+static void
+test_power(void)
+{
+	static const uint8_t code[] = {
+		2, 1, 4, 3, 6, 5, 8, 7, 2, 0xB4
+	};
+	uint64_t start, asleep;
+	char hash[64];
+	char what[64];
+	size_t i;
+
+	run(SIM_MS(2000));
+	start = sim_now;
+	asleep = sim_power_down_cycles;
+	run(SIM_MS(10000));
+	asleep = sim_power_down_cycles - asleep;
+	sprintf(what, "idle door is powered down %.1f%% of the time",
+	        100.0 * asleep / (sim_now - start));
+	check(asleep * 10 >= (sim_now - start) * 9, what);
+	expect("ALIVE\n", "ALIVE while powered down");
+
+	/* the first edge wakes it up, and still counts */
+	for (i = 0; i < sizeof(code); i++)
+		keypad_send(code[i]);
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "keypad code typed into a sleeping door");
+
+	/* a key every second, it powers down in between */
+	run(SIM_MS(2000));
+	for (i = 0; i < sizeof(code); i++) {
+		keypad_send(code[i]);
+		run(SIM_MS(1000));
+	}
+	expect(hash, "keypad code typed slowly");
+}
+#endif
+
+#ifdef WIEGAND
+/* a card frame around number, with the parity bits */
+static uint64_t
+wiegand_card_frame(uint64_t number, uint8_t bits)
+{
+	uint64_t frame = number << 1;
+	unsigned int even = 0, odd = 1;
+	int i;
+
+	/* frame bit i, counting from the msb like the door does */
+	for (i = 1; i < (bits + 1) / 2; i++)
+		even ^= (frame >> (bits - 1 - i)) & 1;
+	for (i = bits / 2; i < bits - 1; i++)
+		odd ^= (frame >> (bits - 1 - i)) & 1;
+
+	return frame | (uint64_t)even << (bits - 1) | odd;
+}
+
+static void
+wiegand_expected_hash(uint64_t number, uint8_t bits, char *hash)
+{
+	uint8_t code[16];
+	int len;
+
+	len = sprintf((char *)code, "W%u%0*llX", bits, (bits + 1) / 4,
+	              (unsigned long long)number);
+	code[len++] = 0xB4;
+	expected_hash(code, len, hash);
+}
+
+static void
+test_wiegand(void)
+{
+	static const struct {
+		uint64_t number;
+		uint8_t bits;
+		const char *what;
+	} cards[] = {
+		{ 0x12abcd, 26, "26 bit Wiegand card + '#' gives HASH+" },
+		{ 0x1234abcd, 34, "34 bit Wiegand card + '#' gives HASH+" },
+		{ 0x5a5a5a5a5ULL, 37, "37 bit Wiegand card + '#' gives HASH+" },
+	};
+	static const uint8_t digits[] = {
+		5, 4, 3, 2, 1, 2, 3, 4, 5, 0xB4
+	};
+	static const uint8_t tag[] = {
+		2, '0', 'A', '0', 'B', '0', 'C', '0', 'D', '0', 'E',
+		'0', 'E', 13, 10, 3
+	};
+	uint8_t code[11];
+	char hash[64];
+	uint64_t t;
+	size_t i;
+
+	for (i = 0; i < sizeof(cards) / sizeof(cards[0]); i++) {
+		wiegand_send(wiegand_card_frame(cards[i].number, cards[i].bits),
+		             cards[i].bits);
+		run(SIM_MS(600));
+		keypad_send(0xB4);
+		wiegand_expected_hash(cards[i].number, cards[i].bits, hash);
+		expect(hash, cards[i].what);
+	}
+
+	/* a card with a bad parity bit doesn't make it into the code */
+	wiegand_send(wiegand_card_frame(0x345678, 26) ^ 1, 26);
+	for (i = 0; i < sizeof(digits); i++)
+		keypad_send(digits[i]);
+	expected_hash(digits, sizeof(digits), hash);
+	expect(hash, "Wiegand card with bad parity is dropped");
+
+	/* the Wiegand interrupts must not upset the soft UART */
+	t = sim_now;
+#ifdef POWER_DOWN
+	/* the first one wakes the door up, the reader sends it again */
+	t = sim_em4100_at(t, tag, sizeof(tag));
+#endif
+	sim_em4100_at(t, tag, sizeof(tag));
+	sim_wiegand_at(t + SIM_MS(2), (~11 & 0x0f) << 4 | 11, 8);
+	run(t - sim_now + SIM_MS(100));
+	memcpy(code, tag + 1, 10);
+	code[10] = 0xB4;
+	expected_hash(code, sizeof(code), hash);
+	expect(hash, "EM4100 tag is read while Wiegand pulses come in");
+
+#ifdef POWER_DOWN
+	/* the first pulse is lost, but can be worked out */
+	run(SIM_MS(2000));
+	wiegand_send(wiegand_card_frame(0x0badc0de, 34), 34);
+	run(SIM_MS(600));
+	keypad_send(0xB4);
+	wiegand_expected_hash(0x0badc0de, 34, hash);
+	expect(hash, "Wiegand card presented to a sleeping door");
+#endif
+	/* let the card pattern finish before the lock tests */
+	run(SIM_MS(500));
+}
+#endif
+
+#ifdef BLOOM_BYTES
+static void
+test_bloom(void)
+{
+	static const uint8_t member[] = {
+		4, 2, 4, 2, 4, 2, 4, 2, 4, 0xB4
+	};
+	static const uint8_t stranger[] = {
+		2, 4, 2, 4, 2, 4, 2, 4, 2, 0xB4
+	};
+	uint8_t filter[BLOOM_BYTES - 1 + 8];
+	char digest[SHA1_DIGEST_LENGTH];
+	char hash[64];
+	char cmd[32];
+	unsigned int acks = 0;
+	unsigned int i, j;
+	char *p;
+
+	expected_hash(member, sizeof(member), hash);
+	for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+		sscanf(hash + 5 + 2 * i, "%2hhx", (unsigned char *)&digest[i]);
+	memset(filter, 0, sizeof(filter));
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		uint16_t bit = bloom_bit(digest, i, BLOOM_BITS(BLOOM_BYTES));
+
+		filter[bit / 8] |= 1 << (bit % 8);
+	}
+
+	host_send("B");
+	expect("BLOOMACK\n", "'B' starts a filter upload");
+	for (i = 0; i < BLOOM_BYTES - 1; i += 8) {
+		p = cmd + sprintf(cmd, "W%04X", i);
+		for (j = i; j < i + 8; j++)
+			p += sprintf(p, "%02X", filter[j]);
+		host_send(cmd);
+		run(SIM_MS(30));
+	}
+	run(SIM_MS(20));
+	for (p = output; (p = strstr(p, "BLOOMACK\n")) != NULL; p++)
+		acks++;
+	check(acks == (BLOOM_BYTES - 1 + 7) / 8, "'W' writes the filter");
+	output_len = 0;
+	output[0] = '\0';
+	host_send("F");
+	expect("BLOOMACK\n", "'F' completes the filter");
+
+	for (i = 0; i < sizeof(member); i++)
+		keypad_send(member[i]);
+	expect(hash, "code in the filter goes to the host");
+
+	for (i = 0; i < sizeof(stranger); i++)
+		keypad_send(stranger[i]);
+	check(!sim_pin_level(SIM_PIN_YELLOW_LED), "code not in the filter is rejected");
+	expect("LOCALREJECT\n", "rejected code gives LOCALREJECT");
+	check(strstr(output, "HASH+") == NULL, "rejected code is not sent to the host");
+	run(SIM_MS(700));
+}
+#endif
+
+/* a frame with a good CRC at p, returns its length */
+static size_t
+frame_make(uint8_t *p, uint8_t type, const char *payload)
+{
+	uint8_t len = strlen(payload);
+	uint16_t crc = 0xffff;
+	size_t i;
+
+	p[0] = FRAME_SOF;
+	p[1] = len;
+	p[2] = type;
+	memcpy(p + 3, payload, len);
+	for (i = 1; i < 3u + len; i++)
+		crc = frame_crc(crc, p[i]);
+	p[3 + len] = crc;
+	p[4 + len] = crc >> 8;
+	return 5 + len;
+}
+
+/*
+ * frames with a bad CRC, the first with a FRAME_SOF and an overlong
+ * length in its payload, which the resync must not believe, the
+ * second with a whole good frame in it
+ */
+static void
+test_frame_resync(void)
+{
+	static const uint8_t bad[] = {
+		FRAME_SOF, 4, FRAME_HASH, 0x11, FRAME_SOF, 0xC8, 0x22, 0x00, 0x00
+	};
+	struct frame_decoder d;
+	uint8_t in[512];
+	size_t n = 0, i;
+	unsigned int frames = 0, inside = 1;
+
+	memcpy(in, bad, sizeof(bad));
+	n += sizeof(bad);
+	/* more than the 0xC8 bytes the bad length would wait for */
+	for (i = 0; i < 50; i++)
+		n += frame_make(in + n, FRAME_ALIVE, "");
+	in[n++] = FRAME_SOF;
+	in[n++] = 7;
+	in[n++] = FRAME_HASH;
+	n += frame_make(in + n, FRAME_OPENED, "ab");
+	in[n++] = 0x00;
+	in[n++] = 0x00;
+
+	memset(&d, 0, sizeof(d));
+	for (i = 0; i < n; i++) {
+		if (frame_decode(&d, in[i])) {
+			frames++;
+			if (frames == 51 && (d.type != FRAME_OPENED ||
+			                    strcmp((char *)d.payload, "ab")))
+				frames = 0;
+		}
+		if (d.len > sizeof(d.buf))
+			inside = 0;
+	}
+	check(inside, "a resync never overruns the frame buffer");
+	check(frames == 51 && d.crc_errors == 3 && d.len == 0,
+	      "frames are found again after bad CRCs");
+}
+
+static void
+test_frames(void)
+{
+	static const uint8_t code[] = {
+		3, 1, 4, 1, 5, 9, 2, 6, 5, 0xB4
+	};
+	char hash[64];
+	char cmd[8];
+	size_t i;
+
+	sprintf(cmd, "M%02X", FRAME_MODE_BINARY | FRAME_BAUD_115200);
+	host_send(cmd);
+	expect("MODEACK\n", "'M' is answered in the old mode");
+	run(SIM_MS(2500));
+	host_send("C");
+	expect("LOCALACK\n", "unconfirmed mode falls back to 9600 baud text");
+
+	host_send(cmd);
+	expect("MODEACK\n", "'M' is answered again");
+	run(SIM_MS(10));
+	sim_host_baud = 115200;
+	binary = 1;
+	host_send(cmd);
+	expect("MODEACK\n", "'M' is confirmed at 115200 baud");
+	run(SIM_MS(2500));
+	host_send("C");
+	expect("LOCALACK\n", "confirmed mode stays");
+
+	expected_hash(code, sizeof(code), hash);
+	for (i = 0; i < sizeof(code); i++)
+		keypad_send(code[i]);
+#ifdef WIEGAND
+	/* the key only counts once the frame has timed out */
+	run(SIM_MS(20));
+#endif
+	/* as text it would take 57ms at 9600 baud */
+	check(strstr(output, hash) != NULL, "HASH+ frame is there within 20ms");
+	expect(hash, "HASH+ comes as a frame");
+
+	sprintf(cmd, "M%02X", FRAME_BAUD_9600);
+	host_send(cmd);
+	expect("MODEACK\n", "'M' back to 9600 baud text");
+	run(SIM_MS(10));
+	sim_host_baud = 9600;
+	binary = 0;
+	check(unframed == 0 && decoder.crc_errors == 0, "only good frames in binary mode");
+	host_send("C");
+	expect("LOCALACK\n", "9600 baud text needs no confirmation");
+}
+
+#ifdef STATS
+static void
+test_stats(void)
+{
+	sim_uart_rx('S');
+	expect("STAT+SHA1+", "'S' dumps the SHA1 probe");
+	expect("STAT+KEYPAD+", "'S' dumps the keypad backend probe");
+	expect("STAT+PIN2+", "'S' dumps the keypad interrupt probe");
+	expect("STAT+DRE+", "'S' dumps the whole table");
+	expect("SEEN+", "'S' dumps the seen cache counters");
+	expect("SERIAL+", "'S' dumps the output buffer counters");
+	expect("READER+0000\n", "reader polls keep their deadlines");
+	expect("MFRC522+", "'S' dumps the dropped card ID count");
+#ifdef POWER_DOWN
+	expect("EM4100+", "'S' dumps the soft UART error counts");
+#else
+	expect("EM4100+0001+0000\n", "the break is the only framing error");
+#endif
+#ifdef WIEGAND
+	expect("WIEGAND+", "'S' dumps the Wiegand error count");
+#endif
+#ifdef POWER_DOWN
+	expect("POWER+", "'S' dumps the power-down ticks");
+#endif
+}
+#endif
+
+static void
+test_alive(void)
+{
+	run(SIM_MS(10500));
+	expect("ALIVE\n", "ALIVE after 10 seconds idle");
+}
+
+int
+main(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MFRC522_READERS; i++) {
+#ifdef MFRC522_USE_IRQ
+		sim_mfrc522_attach(mfrc522_ss[i], SIM_PIN_MFRC522_IRQ);
+#else
+		sim_mfrc522_attach(mfrc522_ss[i], 0xff);
+#endif
+	}
+	sim_pin_drive(SIM_PIN_SOFTSERIAL, 1);
+#ifdef WIEGAND
+	sim_pin_drive(SIM_PIN_WIEGAND_D0, 1);
+	sim_pin_drive(SIM_PIN_WIEGAND_D1, 1);
+#endif
+	sim_init(firmware);
+	run(SIM_MS(10));
+
+#ifdef WIEGAND
+	test_wiegand();
+#else
+	test_keypad();
+#endif
+	test_open();
+	test_open_queue_full();
+	test_keypad_while_blinking();
+	test_alive();
+	test_em4100();
+	test_alive();
+	test_mfrc522();
+	test_mfrc522_cascade();
+	test_alive();
+	test_mfrc522_collision();
+	test_mfrc522_resting();
+#if MFRC522_READERS > 1
+	test_mfrc522_readers();
+#endif
+	test_local();
+	test_serial_overflow();
+	test_frame_resync();
+	test_frames();
+#ifdef POWER_DOWN
+	test_power();
+#endif
+#ifdef BLOOM_BYTES
+	test_bloom();
+#endif
+#ifdef STATS
+	test_stats();
+#endif
+
+	printf("%s, %lu SPI bytes in %.1f virtual seconds\n",
+	       failures ? "FAILED" : "OK", sim_spi_bytes,
+	       (double)sim_now / F_CPU);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,653 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Feeds keypad clock and data edges into the firmware and checks what
+ * pin2_interrupt() and the timer1 tick make of them.
+ *
+ * Every edge sequence also goes through a model of the decoder: a
+ * rising clock edge shifts in the data line msb first, 8 bits make a
+ * key, and the tick 250ms after the last rising edge drops a partial
+ * key. Keys are appended to data[] while cnt is below 255, a '#'
+ * (0xB4) with at least 10 bytes gives HASH+, and a '#' or 10 seconds
+ * without a rising edge empty it. Once the lines have been quiet for
+ * longer than a tick, data[] and cnt must match the model, and so must
+ * the HASH+ lines.
+ *
+ * usage: doorkeys [-n sequences] [-s seed] [-b] [-f trace] [input]...
+ *
+ * Without arguments it checks random sequences: keys typed at the
+ * keypad's 5kHz with jitter, clock glitches, dropped bits, pauses
+ * that split a key and codes long enough to hit the cap on cnt. -b
+ * reports how many edges per second that runs at.
+ *
+ * A trace holds recorded edges, one per line: the time in usec from
+ * the start and the levels of the clock and data lines from then on.
+ *
+ *   1000 1 0
+ *   1100 0 1
+ *
+ * Other arguments are fuzz inputs, as kept in a libFuzzer corpus. Built
+ * with -DFUZZ and -fsanitize=fuzzer, see the doorkeys-fuzz target, this
+ * is a libFuzzer target which aborts on the first mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "doorduino.h"
+#include "tools/sha1.c"
+
+#ifndef MFRC522_READERS
+#define MFRC522_READERS 1
+#endif
+
+/* the tick fires when timer1 reaches 62499 after a rising edge */
+#define TICK_FIRST ((uint64_t)62499 * 64)
+#define TICK       ((uint64_t)62500 * 64)
+/* ALIVE and an empty buffer once second goes past 10*4 */
+#define IDLE       (TICK_FIRST + 40 * TICK)
+#define QUIET      SIM_MS(300)
+
+#define HASHES 512   /* a 64k fuzz input makes up to 409 */
+
+struct edge {
+	uint64_t when;
+	uint8_t clk;
+	uint8_t data;
+};
+
+/* the firmware's keypad decoder, as it is meant to work */
+static struct {
+	uint64_t last_rise;
+	uint8_t clk;
+	uint8_t data;
+	uint8_t bits;
+	uint8_t value;
+	unsigned int cnt;
+	uint8_t buf[256];
+	/* HASH+ lines the door owes us, oldest first */
+	char hash[HASHES][48];
+	unsigned int start;
+	unsigned int end;
+} model;
+
+static const uint8_t mfrc522_ss[] = {
+	SIM_PIN_MFRC522_SS, SIM_PIN_MFRC522_SS1, SIM_PIN_MFRC522_SS2
+};
+
+static char line[128];
+static size_t line_len;
+static unsigned int seen;           /* HASH+ lines checked */
+static unsigned long failures;
+static unsigned long edges;
+static unsigned long keys;
+static int verbose;
+
+static void
+firmware(void)
+{
+	door_main();
+}
+
+static void
+fail(const char *fmt, const char *what)
+{
+	fprintf(stderr, "doorkeys: at %.3f ms: ", (double)sim_now * 1000 / F_CPU);
+	fprintf(stderr, fmt, what);
+	fputc('\n', stderr);
+#ifdef FUZZ
+	abort();
+#endif
+	failures++;
+}
+
+/*************************************************************\
+ * The model                                                 *
+\*************************************************************/
+
+static void
+model_reset(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++)
+		model.buf[i] = i;
+	model.cnt = 0;
+}
+
+static void
+model_key(uint8_t c)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char digest[SHA1_DIGEST_LENGTH];
+	struct sha1_context ctx;
+	char *p;
+	unsigned int i;
+
+	keys++;
+	if (model.cnt < 255)
+		model.buf[model.cnt++] = c;
+	if (model.buf[model.cnt - 1] != 0xB4)
+		return;
+
+	if (model.cnt >= 10) {
+		sha1_init(&ctx);
+		sha1_update(&ctx, (char *)model.buf, 256);
+		sha1_final(&ctx, digest);
+
+		p = model.hash[model.end];
+		model.end = (model.end + 1) % HASHES;
+		p += sprintf(p, "HASH+");
+		for (i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+			*p++ = hex[(uint8_t)digest[i] >> 4];
+			*p++ = hex[(uint8_t)digest[i] & 0x0f];
+		}
+		*p = '\0';
+	}
+	model_reset();
+}
+
+/* the lines have been at their levels up to when */
+static void
+model_idle(uint64_t when)
+{
+	if (model.last_rise == 0)
+		return;
+	if (when - model.last_rise >= TICK_FIRST) {
+		model.bits = 0;
+		model.value = 0;
+	}
+	if (when - model.last_rise >= IDLE) {
+		model_reset();
+		model.last_rise = 0;
+	}
+}
+
+/* clock in the data line at when */
+static void
+model_rise(uint64_t when)
+{
+	model_idle(when);
+	model.last_rise = when;
+	if (model.data)
+		model.value |= 1 << (7 - model.bits);
+	if (++model.bits == 8) {
+		model_key(model.value);
+		model.bits = 0;
+		model.value = 0;
+	}
+}
+
+static void
+model_edge(const struct edge *e)
+{
+	uint8_t rise = e->clk && !model.clk;
+
+	model.clk = e->clk;
+	model.data = e->data;
+	if (rise)
+		model_rise(e->when);
+}
+
+/*************************************************************\
+ * Running and checking                                      *
+\*************************************************************/
+
+static void
+uart_tx(uint8_t c)
+{
+	if (c != '\n') {
+		if (line_len < sizeof(line) - 1)
+			line[line_len++] = c;
+		return;
+	}
+	line[line_len] = '\0';
+	line_len = 0;
+
+	if (strncmp(line, "HASH+", 5))
+		return;
+	if (model.start == model.end) {
+		fail("unexpected %s", line);
+		return;
+	}
+	if (strcmp(line, model.hash[model.start]))
+		fail("%s is not the expected hash", line);
+	model.start = (model.start + 1) % HASHES;
+	seen++;
+}
+
+/*
+ * the firmware never sees two changes at the same instant, and a
+ * rising edge exactly when the tick is due could go either way
+ */
+static size_t
+edges_clean(struct edge *e, size_t n)
+{
+	uint64_t rise = 0;
+	uint8_t clk = model.clk;
+	size_t i, j = 0;
+
+	for (i = 0; i < n; i++) {
+		if (j > 0 && e[i].when <= e[j - 1].when)
+			e[i].when = e[j - 1].when + 1;
+		if (e[i].clk && !clk) {
+			if (rise && (e[i].when - rise == TICK_FIRST ||
+			             e[i].when - rise == IDLE))
+				e[i].when++;
+			rise = e[i].when;
+		}
+		clk = e[i].clk;
+		e[j++] = e[i];
+	}
+
+	return j;
+}
+
+/*
+ * play n edges starting at sim_now, then wait for the lines to
+ * go quiet and compare the door with the model
+ */
+static void
+play(struct edge *e, size_t n)
+{
+	uint64_t start = sim_now + SIM_MS(1);
+	const unsigned char *data;
+	unsigned int cnt;
+	size_t i;
+#ifdef POWER_DOWN
+	uint8_t asleep = 0;
+	uint8_t clk = 0;
+#endif
+
+	for (i = 0; i < n; i++)
+		e[i].when += start;
+	n = edges_clean(e, n);
+
+	for (i = 0; i < n; i++) {
+		/* the data line first, it is sampled at the clock edge */
+		if (e[i].data != (i ? e[i - 1].data : model.data)) {
+			sim_drive_at(e[i].when, SIM_PIN_DATA, e[i].data);
+			edges++;
+		}
+		if (e[i].clk != (i ? e[i - 1].clk : model.clk)) {
+			sim_drive_at(e[i].when, SIM_PIN_CLK, e[i].clk);
+			edges++;
+		}
+	}
+	for (i = 0; i < n; i++) {
+#ifdef POWER_DOWN
+		/*
+		 * INT0 misses the edges while the door is powered down.
+		 * a clock edge wakes it up, and once the oscillator has
+		 * started the pin change interrupt clocks in a bit if the
+		 * clock went from low to high, with the data line as it
+		 * is by then. when that is depends on the firmware.
+		 */
+		if (e[i].when - 1 > sim_now)
+			sim_run(e[i].when - 1 - sim_now);
+		if (sim_powered_down()) {
+			if (!asleep)
+				clk = model.clk;
+			asleep = 1;
+			model.clk = e[i].clk;
+			model.data = e[i].data;
+			continue;
+		}
+		if (asleep && model.clk && !clk)
+			model_rise(e[i - 1].when);
+		asleep = 0;
+#endif
+		model_edge(&e[i]);
+	}
+#ifdef POWER_DOWN
+	if (asleep && model.clk && !clk)
+		model_rise(e[n - 1].when);
+#endif
+
+	sim_run((n ? e[n - 1].when : start) + QUIET - sim_now);
+	model_idle(sim_now);
+
+	if (model.start != model.end)
+		fail("%s never came", model.hash[model.start]);
+	model.start = model.end;
+
+	data = door_data(&cnt);
+	if (cnt != model.cnt) {
+		char buf[32];
+
+		sprintf(buf, "%u, not %u", cnt, model.cnt);
+		fail("cnt is %s", buf);
+	} else if (memcmp(data, model.buf, 256))
+		fail("%s", "data[] differs");
+	if (verbose)
+		printf("%lu changes, cnt %u\n", (unsigned long)n, cnt);
+}
+
+static void
+start(void)
+{
+	static int started;
+	unsigned int i;
+
+	if (started)
+		return;
+	started = 1;
+	for (i = 0; i < MFRC522_READERS; i++) {
+#ifdef MFRC522_USE_IRQ
+		sim_mfrc522_attach(mfrc522_ss[i], SIM_PIN_MFRC522_IRQ);
+#else
+		sim_mfrc522_attach(mfrc522_ss[i], 0xff);
+#endif
+	}
+	sim_pin_drive(SIM_PIN_SOFTSERIAL, 1);
+	sim_uart_hook = uart_tx;
+	sim_init(firmware);
+	sim_run(SIM_MS(10));
+	model_reset();
+}
+
+/*************************************************************\
+ * Edge sources                                              *
+\*************************************************************/
+
+static struct edge *seq;
+static size_t seq_len;
+static size_t seq_size;
+static uint64_t seq_t;
+
+static void
+seq_add(uint64_t gap, uint8_t clk, uint8_t data)
+{
+	if (seq_len == seq_size) {
+		seq_size = seq_size ? 2 * seq_size : 1024;
+		seq = realloc(seq, seq_size * sizeof(*seq));
+		if (seq == NULL) {
+			perror("doorkeys");
+			exit(EXIT_FAILURE);
+		}
+	}
+	seq_t += gap;
+	seq[seq_len].when = seq_t;
+	seq[seq_len].clk = clk;
+	seq[seq_len].data = data;
+	seq_len++;
+}
+
+static void
+seq_begin(void)
+{
+	seq_len = 0;
+	seq_t = 0;
+}
+
+/*
+ * a fuzz input is one edge per byte. the low 2 bits toggle the
+ * clock, the data line, both, or give the clock a glitch, and the
+ * upper 6 pick the time since the previous edge: 25usec steps up
+ * to 1.2ms, 20ms steps up to 280ms, 1 second or 11 seconds.
+ */
+static void
+seq_fuzz(const uint8_t *buf, size_t len)
+{
+	uint8_t clk = model.clk;
+	uint8_t data = model.data;
+	size_t i;
+
+	seq_begin();
+	for (i = 0; i < len; i++) {
+		uint8_t g = buf[i] >> 2;
+		uint64_t gap;
+
+		if (g < 48)
+			gap = SIM_US(25 * (g + 1));
+		else if (g < 62)
+			gap = SIM_MS(20 * (g - 47));
+		else if (g == 62)
+			gap = SIM_MS(1000);
+		else
+			gap = SIM_MS(11000);
+
+		switch (buf[i] & 3) {
+		case 0:
+			clk = !clk;
+			break;
+		case 1:
+			data = !data;
+			break;
+		case 2:
+			clk = !clk;
+			data = !data;
+			break;
+		case 3:
+			seq_add(gap, !clk, data);
+			gap = 1;
+			break;
+		}
+		seq_add(gap, clk, data);
+	}
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len)
+{
+	start();
+	seq_fuzz(buf, len);
+	play(seq, seq_len);
+
+	return 0;
+}
+
+#ifndef FUZZ
+static unsigned int
+rnd(unsigned int n)
+{
+	return (unsigned int)rand() % n;
+}
+
+/* one key at around 5kHz, sometimes mangled */
+static void
+seq_key(uint8_t c)
+{
+	uint64_t half = SIM_US(80 + rnd(40));
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		uint8_t bit = (c >> i) & 1;
+
+		switch (rnd(200)) {
+		case 0:
+			/* a glitch on the clock while it is low */
+			seq_add(half / 2, 1, bit);
+			seq_add(SIM_US(1 + rnd(5)), 0, bit);
+			break;
+		case 1:
+			/* a lost clock pulse */
+			seq_add(half, 0, bit);
+			seq_add(half, 0, bit);
+			continue;
+		case 2:
+			/* the keypad stalls halfway through the key */
+			seq_add(SIM_MS(260 + rnd(500)), 0, bit);
+			break;
+		}
+		seq_add(half, 0, bit);
+		seq_add(half, 1, bit);
+	}
+	seq_add(half, 0, 0);
+}
+
+static void
+seq_random(void)
+{
+	unsigned int len, i;
+
+	seq_begin();
+	switch (rnd(8)) {
+	case 0:
+		len = rnd(9);               /* too short for HASH+ */
+		break;
+	case 1:
+		len = 250 + rnd(20);        /* up to the cap and past it */
+		break;
+	default:
+		len = 9 + rnd(20);
+		break;
+	}
+
+	for (i = 0; i < len; i++) {
+		seq_key(rnd(4) ? '0' + rnd(10) : rnd(256));
+		seq_add(SIM_MS(rnd(4) ? 1 + rnd(200) : 300 + rnd(1000)), 0, 0);
+	}
+	if (rnd(8))
+		seq_key(0xB4);
+}
+
+static void
+seq_trace(const char *path)
+{
+	char buf[128];
+	unsigned long lineno = 0;
+	uint64_t last = 0;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	seq_begin();
+	while (fgets(buf, sizeof(buf), f)) {
+		unsigned long long us;
+		unsigned int clk, data;
+
+		lineno++;
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		if (sscanf(buf, "%llu %u %u", &us, &clk, &data) != 3 ||
+		    SIM_US(us) < last) {
+			fprintf(stderr, "%s:%lu: bad line\n", path, lineno);
+			exit(EXIT_FAILURE);
+		}
+		seq_add(SIM_US(us) - last, clk != 0, data != 0);
+		last = SIM_US(us);
+	}
+	fclose(f);
+}
+
+static void
+fuzz_file(const char *path)
+{
+	static uint8_t buf[65536];
+	size_t len;
+	FILE *f = fopen(path, "rb");
+
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	LLVMFuzzerTestOneInput(buf, len);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long count = 300;
+	unsigned long i;
+	const char *trace = NULL;
+	struct timespec t0, t1;
+	double wall;
+	int bench = 0;
+	int opt;
+
+#ifdef WIEGAND
+	(void)argc;
+	(void)argv;
+	(void)fuzz_file;
+	printf("doorkeys: no keypad with WIEGAND, skipped\n");
+	return EXIT_SUCCESS;
+#endif
+
+	while ((opt = getopt(argc, argv, "n:s:bf:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			srand(strtoul(optarg, NULL, 0));
+			break;
+		case 'b':
+			bench = 1;
+			break;
+		case 'f':
+			trace = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n sequences] [-s seed] [-b] "
+			        "[-f trace] [input]...\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	start();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (trace) {
+		seq_trace(trace);
+		play(seq, seq_len);
+	} else if (optind < argc) {
+		for (; optind < argc; optind++)
+			fuzz_file(argv[optind]);
+	} else {
+		for (i = 0; i < count; i++) {
+			seq_random();
+			play(seq, seq_len);
+			/* and some noise now and then */
+			if (i % 8 == 0) {
+				uint8_t noise[64];
+				unsigned int j;
+
+				for (j = 0; j < sizeof(noise); j++)
+					noise[j] = rnd(256);
+				LLVMFuzzerTestOneInput(noise, sizeof(noise));
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	if (bench)
+		printf("%lu edges in %.2f s, %.0f edges/s, %.0fx real time\n",
+		       edges, wall, edges / wall,
+		       (double)sim_now / F_CPU / wall);
+	if (failures) {
+		printf("doorkeys: FAILED, %lu mismatches\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("doorkeys: OK, %lu edges, %lu keys, %u HASH+\n",
+	       edges, keys, seen);
+	return EXIT_SUCCESS;
+}
+#endif
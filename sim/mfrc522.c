@@ -0,0 +1,626 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fake MFRC522 with ISO 14443-3 type A cards in its field.
+ *
+ * Only the registers and commands the firmware uses are modelled:
+ * SPI register access including address/data streaming, the FIFO,
+ * CalcCRC, Transceive with bit oriented framing and the timer used
+ * for the receive timeout. Cards answer REQA/WUPA, anticollision and
+ * SELECT on all cascade levels, and HLTA. Collisions between cards
+ * are reported through ErrorReg and CollReg.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define DEVICES 3
+#define CARDS 4
+
+#define REG_Command     0x01
+#define REG_ComIEn      0x02
+#define REG_DivIEn      0x03
+#define REG_ComIrq      0x04
+#define REG_DivIrq      0x05
+#define REG_Error       0x06
+#define REG_FIFOData    0x09
+#define REG_FIFOLevel   0x0a
+#define REG_Control     0x0c
+#define REG_BitFraming  0x0d
+#define REG_Coll        0x0e
+#define REG_Mode        0x11
+#define REG_TxControl   0x14
+#define REG_CRCResult_H 0x21
+#define REG_CRCResult_L 0x22
+#define REG_TMode       0x2a
+#define REG_TPrescaler  0x2b
+#define REG_TReload_H   0x2c
+#define REG_TReload_L   0x2d
+#define REG_Version     0x37
+
+#define CMD_Idle        0
+#define CMD_CalcCRC     3
+#define CMD_Transceive 12
+#define CMD_SoftReset  15
+
+/* 13.56MHz carrier, 128 carrier cycles per bit at 106kbit/s */
+#define FC 13560000UL
+#define BIT_CYCLES (128 * F_CPU / FC)
+#define FDT_CYCLES (1172 * F_CPU / FC)
+
+enum card_state {
+	CARD_IDLE,
+	CARD_READY,
+	CARD_ACTIVE,
+	CARD_HALT
+};
+
+struct card {
+	struct sim_card c;
+	uint8_t state;
+	uint8_t level;          /* cascade level being selected */
+};
+
+struct device {
+	uint8_t ss;
+	uint8_t irq;
+	uint8_t selected;
+	uint8_t started;        /* got the address byte */
+	uint8_t read;
+	uint8_t addr;
+	uint8_t reg[64];
+	uint8_t fifo[64];
+	uint8_t fifo_len;
+	uint64_t sent;          /* last bit of the running transceive sent */
+	uint64_t done;          /* end of the running transceive */
+	uint8_t rx[64];
+	uint8_t rx_len;
+	uint8_t rx_last_bits;
+	uint8_t coll;           /* CollReg value, 0 if no collision */
+	struct card cards[CARDS];
+	uint8_t ncards;
+};
+
+static struct device devices[DEVICES];
+static uint8_t ndevices;
+
+static uint16_t
+crc_a(const uint8_t *buf, uint8_t len)
+{
+	uint16_t crc = 0x6363;
+	uint8_t i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	}
+
+	return crc;
+}
+
+static struct device *
+device_by_ss(uint8_t ss)
+{
+	uint8_t i;
+
+	for (i = 0; i < ndevices; i++) {
+		if (devices[i].ss == ss)
+			return &devices[i];
+	}
+
+	return NULL;
+}
+
+/* the level d puts on its IRQ pin */
+static uint8_t
+irq_level(const struct device *d)
+{
+	uint8_t active;
+
+	active = (d->reg[REG_ComIrq] & d->reg[REG_ComIEn] & 0x7f) ||
+	         (d->reg[REG_DivIrq] & d->reg[REG_DivIEn] & 0x14);
+	if (d->reg[REG_ComIEn] & 0x80)
+		active = !active;
+
+	return active;
+}
+
+static void
+update_irq(struct device *d)
+{
+	uint8_t level = 1;
+	uint8_t i;
+
+	if (d->irq == 0xff)
+		return;
+
+	/*
+	 * readers sharing the line must have open drain outputs,
+	 * any of them pulls it low against the pull-up
+	 */
+	for (i = 0; i < ndevices; i++) {
+		if (devices[i].irq != d->irq)
+			continue;
+		if (&devices[i] != d &&
+		    ((devices[i].reg[REG_DivIEn] | d->reg[REG_DivIEn]) & 0x80)) {
+			fprintf(stderr, "sim: MFRC522 IRQ outputs short-circuited\n");
+			exit(EXIT_FAILURE);
+		}
+		level &= irq_level(&devices[i]);
+	}
+
+	sim_pin_drive(d->irq, level);
+}
+
+static void
+soft_reset(struct device *d)
+{
+	memset(d->reg, 0, sizeof(d->reg));
+	d->reg[REG_Command] = 0x20;
+	d->reg[REG_ComIEn] = 0x80;
+	d->reg[REG_ComIrq] = 0x14;
+	d->reg[REG_Mode] = 0x3f;
+	d->reg[REG_TxControl] = 0x80;
+	d->reg[REG_Version] = 0x92;
+	d->fifo_len = 0;
+	d->sent = UINT64_MAX;
+	d->done = UINT64_MAX;
+	update_irq(d);
+}
+
+static uint8_t
+card_levels(const struct card *card)
+{
+	return card->c.uid_len == 4 ? 1 : card->c.uid_len == 7 ? 2 : 3;
+}
+
+/* the 5 bytes of a card's UID sent on cascade level n */
+static void
+card_cl(const struct card *card, uint8_t n, uint8_t out[5])
+{
+	const uint8_t *uid = card->c.uid;
+
+	if (n + 1 < card_levels(card)) {
+		out[0] = 0x88;  /* cascade tag */
+		memcpy(out + 1, uid + 3 * n, 3);
+	} else
+		memcpy(out, uid + 3 * n, 4);
+
+	out[4] = out[0] ^ out[1] ^ out[2] ^ out[3];
+}
+
+static uint8_t
+get_bit(const uint8_t *buf, unsigned int n)
+{
+	return (buf[n / 8] >> (n % 8)) & 1;
+}
+
+static void
+put_bit(uint8_t *buf, unsigned int n, uint8_t v)
+{
+	if (v)
+		buf[n / 8] |= 1 << (n % 8);
+	else
+		buf[n / 8] &= ~(1 << (n % 8));
+}
+
+/*
+ * let the cards react to a frame. every responding card calls answer()
+ * with its reply; replies are overlaid bit by bit like on the air.
+ */
+struct reply {
+	uint8_t bits[64];
+	unsigned int nbits;
+	int coll;               /* first colliding bit, or -1 */
+	uint8_t count;
+};
+
+static void
+answer(struct reply *r, const uint8_t *buf, unsigned int nbits)
+{
+	unsigned int i;
+
+	if (r->count == 0) {
+		memcpy(r->bits, buf, (nbits + 7) / 8);
+		r->nbits = nbits;
+		r->coll = -1;
+	} else {
+		for (i = 0; i < nbits && i < r->nbits; i++) {
+			uint8_t a = get_bit(r->bits, i);
+			uint8_t b = get_bit(buf, i);
+
+			if (a != b && r->coll < 0)
+				r->coll = i;
+			put_bit(r->bits, i, a | b);
+		}
+	}
+	r->count++;
+}
+
+static void
+cards_react(struct device *d, const uint8_t *tx, unsigned int txbits,
+            struct reply *r)
+{
+	uint8_t i;
+
+	r->count = 0;
+	r->nbits = 0;
+	r->coll = -1;
+
+	/* antenna off */
+	if ((d->reg[REG_TxControl] & 0x03) == 0)
+		return;
+
+	for (i = 0; i < d->ncards; i++) {
+		struct card *card = &d->cards[i];
+		uint8_t cl[5];
+
+		if (txbits == 7 && (tx[0] == 0x26 || tx[0] == 0x52)) {
+			/* REQA, WUPA */
+			if (card->state == CARD_IDLE ||
+			    (card->state == CARD_HALT && tx[0] == 0x52)) {
+				card->state = CARD_READY;
+				card->level = 0;
+				answer(r, card->c.atqa, 16);
+			} else
+				card->state = card->state == CARD_HALT ?
+					CARD_HALT : CARD_IDLE;
+			continue;
+		}
+
+		if (txbits >= 16 && (tx[0] == 0x93 || tx[0] == 0x95 ||
+		                     tx[0] == 0x97)) {
+			uint8_t level = (tx[0] - 0x93) / 2;
+			unsigned int known = txbits - 16;
+			unsigned int k;
+			uint8_t buf[5];
+
+			if (card->state != CARD_READY || card->level != level)
+				continue;
+
+			card_cl(card, level, cl);
+
+			if (tx[1] == 0x70 && txbits == 72) {
+				/* SELECT */
+				uint16_t crc = crc_a(tx, 7);
+				uint8_t sak[3];
+
+				if ((crc & 0xff) != tx[7] || (crc >> 8) != tx[8] ||
+				    memcmp(cl, tx + 2, 5))
+					continue;
+
+				if (level + 1 < card_levels(card)) {
+					sak[0] = 0x04;
+					card->level++;
+				} else {
+					sak[0] = card->c.sak & ~0x04;
+					card->state = CARD_ACTIVE;
+				}
+				crc = crc_a(sak, 1);
+				sak[1] = crc & 0xff;
+				sak[2] = crc >> 8;
+				answer(r, sak, 24);
+				continue;
+			}
+
+			/* anticollision, NVB must agree with the frame length */
+			if (known > 32 || tx[1] != ((2 + known / 8) << 4 | known % 8))
+				continue;
+			for (k = 0; k < known; k++) {
+				if (get_bit(tx + 2, k) != get_bit(cl, k))
+					break;
+			}
+			if (k < known)
+				continue;
+
+			memset(buf, 0, sizeof(buf));
+			for (k = known; k < 40; k++)
+				put_bit(buf, k - known, get_bit(cl, k));
+			answer(r, buf, 40 - known);
+			continue;
+		}
+
+		if (txbits == 32 && tx[0] == 0x50 && tx[1] == 0x00) {
+			/* HLTA */
+			uint16_t crc = crc_a(tx, 2);
+
+			if ((crc & 0xff) != tx[2] || (crc >> 8) != tx[3])
+				continue;
+			if (card->state == CARD_ACTIVE)
+				card->state = CARD_HALT;
+			else if (card->state == CARD_READY)
+				card->state = CARD_IDLE;
+			continue;
+		}
+
+		/* anything else sends a card back to idle */
+		if (card->state == CARD_READY || card->state == CARD_ACTIVE)
+			card->state = CARD_IDLE;
+	}
+}
+
+static uint64_t
+timeout_cycles(struct device *d)
+{
+	uint32_t prescaler = (d->reg[REG_TMode] & 0x0f) << 8 |
+	                     d->reg[REG_TPrescaler];
+	uint32_t reload = d->reg[REG_TReload_H] << 8 | d->reg[REG_TReload_L];
+
+	return (uint64_t)F_CPU * (2 * prescaler + 1) * (reload + 1) / FC;
+}
+
+static void
+transceive(struct device *d)
+{
+	uint8_t last = d->reg[REG_BitFraming] & 0x07;
+	uint8_t align = (d->reg[REG_BitFraming] >> 4) & 0x07;
+	unsigned int txbits, i;
+	struct reply r;
+	uint64_t air;
+
+	if (d->fifo_len == 0)
+		return;
+
+	txbits = (d->fifo_len - 1) * 8 + (last ? last : 8);
+	cards_react(d, d->fifo, txbits, &r);
+	d->fifo_len = 0;
+
+	/* every byte on the air is followed by a parity bit */
+	air = (txbits + txbits / 8 + 2) * BIT_CYCLES;
+	d->sent = sim_now + air;
+
+	if (r.count == 0) {
+		d->rx_len = 0;
+		d->coll = 0;
+		d->done = sim_now + air + timeout_cycles(d);
+		sim_reschedule();
+		return;
+	}
+
+	memset(d->rx, 0, sizeof(d->rx));
+	for (i = 0; i < r.nbits; i++)
+		put_bit(d->rx, align + i, get_bit(r.bits, i));
+	d->rx_len = (align + r.nbits + 7) / 8;
+	d->rx_last_bits = (align + r.nbits) % 8;
+	d->coll = r.coll < 0 ? 0 : 0x80 | ((align + r.coll + 1) & 0x1f);
+
+	air += FDT_CYCLES + (r.nbits + r.nbits / 8 + 2) * BIT_CYCLES;
+	d->done = sim_now + air;
+	sim_reschedule();
+}
+
+static void
+transceive_done(struct device *d)
+{
+	d->done = UINT64_MAX;
+	d->reg[REG_Error] = 0;
+	d->reg[REG_Coll] = 0x20;
+
+	if (d->rx_len == 0) {
+		/* nobody answered, the timer ran out */
+		d->reg[REG_ComIrq] |= 0x01;
+	} else {
+		memcpy(d->fifo, d->rx, d->rx_len);
+		d->fifo_len = d->rx_len;
+		d->reg[REG_Control] = d->rx_last_bits;
+		if (d->coll) {
+			d->reg[REG_Error] |= 0x08;
+			d->reg[REG_Coll] = d->coll & 0x1f;
+		}
+		d->reg[REG_ComIrq] |= 0x20;
+	}
+
+	update_irq(d);
+}
+
+static void
+write_reg(struct device *d, uint8_t reg, uint8_t v)
+{
+	uint16_t crc;
+
+	switch (reg) {
+	case REG_Command:
+		d->reg[reg] = (d->reg[reg] & 0xf0) | (v & 0x0f);
+		switch (v & 0x0f) {
+		case CMD_Idle:
+			d->sent = UINT64_MAX;
+			d->done = UINT64_MAX;
+			break;
+		case CMD_CalcCRC:
+			crc = crc_a(d->fifo, d->fifo_len);
+			d->fifo_len = 0;
+			d->reg[REG_CRCResult_L] = crc & 0xff;
+			d->reg[REG_CRCResult_H] = crc >> 8;
+			d->reg[REG_DivIrq] |= 0x04;
+			d->reg[reg] &= 0xf0;
+			break;
+		case CMD_SoftReset:
+			soft_reset(d);
+			break;
+		}
+		break;
+	case REG_ComIrq:
+	case REG_DivIrq:
+		if (v & 0x80)
+			d->reg[reg] |= v & 0x7f;
+		else
+			d->reg[reg] &= ~v;
+		break;
+	case REG_FIFOData:
+		if (d->fifo_len < sizeof(d->fifo))
+			d->fifo[d->fifo_len++] = v;
+		break;
+	case REG_FIFOLevel:
+		if (v & 0x80)
+			d->fifo_len = 0;
+		break;
+	case REG_BitFraming:
+		d->reg[reg] = v;
+		if ((v & 0x80) && (d->reg[REG_Command] & 0x0f) == CMD_Transceive &&
+		    d->done == UINT64_MAX)
+			transceive(d);
+		break;
+	default:
+		d->reg[reg] = v;
+	}
+
+	update_irq(d);
+}
+
+static uint8_t
+read_reg(struct device *d, uint8_t reg)
+{
+	uint8_t v;
+
+	switch (reg) {
+	case REG_FIFOData:
+		if (d->fifo_len == 0)
+			return 0;
+		v = d->fifo[0];
+		memmove(d->fifo, d->fifo + 1, --d->fifo_len);
+		return v;
+	case REG_FIFOLevel:
+		return d->fifo_len;
+	default:
+		return d->reg[reg];
+	}
+}
+
+void
+sim_mfrc522_attach(uint8_t ss_pin, uint8_t irq_pin)
+{
+	struct device *d = &devices[ndevices++];
+
+	memset(d, 0, sizeof(*d));
+	d->ss = ss_pin;
+	d->irq = irq_pin;
+	soft_reset(d);
+}
+
+void
+sim_mfrc522_card_add(uint8_t ss_pin, const struct sim_card *card)
+{
+	struct device *d = device_by_ss(ss_pin);
+
+	if (d == NULL || d->ncards == CARDS)
+		return;
+
+	memset(&d->cards[d->ncards], 0, sizeof(d->cards[0]));
+	d->cards[d->ncards++].c = *card;
+}
+
+void
+sim_mfrc522_card_remove(uint8_t ss_pin, const struct sim_card *card)
+{
+	struct device *d = device_by_ss(ss_pin);
+	uint8_t i;
+
+	if (d == NULL)
+		return;
+
+	for (i = 0; i < d->ncards; i++) {
+		if (d->cards[i].c.uid_len == card->uid_len &&
+		    !memcmp(d->cards[i].c.uid, card->uid, card->uid_len)) {
+			d->ncards--;
+			memmove(&d->cards[i], &d->cards[i + 1],
+			        (d->ncards - i) * sizeof(d->cards[0]));
+			return;
+		}
+	}
+}
+
+void
+sim_mfrc522_select(uint8_t pin, uint8_t level)
+{
+	struct device *d = device_by_ss(pin);
+
+	if (d == NULL)
+		return;
+
+	d->selected = !level;
+	d->started = 0;
+}
+
+uint8_t
+sim_mfrc522_spi(uint8_t c)
+{
+	uint8_t i, v = 0xff;
+
+	for (i = 0; i < ndevices; i++) {
+		struct device *d = &devices[i];
+
+		if (!d->selected)
+			continue;
+
+		if (!d->started) {
+			d->started = 1;
+			d->read = c & 0x80;
+			d->addr = (c >> 1) & 0x3f;
+			v = 0;
+		} else if (d->read) {
+			/* every byte clocked out addresses the next read */
+			v = read_reg(d, d->addr);
+			d->addr = (c >> 1) & 0x3f;
+		} else {
+			write_reg(d, d->addr, c);
+			v = 0;
+		}
+	}
+
+	return v;
+}
+
+uint64_t
+sim_mfrc522_next_event(void)
+{
+	uint64_t t = UINT64_MAX;
+	uint8_t i;
+
+	for (i = 0; i < ndevices; i++) {
+		if (devices[i].sent < t)
+			t = devices[i].sent;
+		if (devices[i].done < t)
+			t = devices[i].done;
+	}
+
+	return t;
+}
+
+void
+sim_mfrc522_update(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < ndevices; i++) {
+		struct device *d = &devices[i];
+
+		if (d->sent <= sim_now) {
+			/* TxIRq */
+			d->sent = UINT64_MAX;
+			d->reg[REG_ComIrq] |= 0x40;
+			update_irq(d);
+		}
+		if (d->done <= sim_now)
+			transceive_done(d);
+	}
+}
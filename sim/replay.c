@@ -0,0 +1,666 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays door traffic against the firmware in virtual time and
+ * reports how long the door takes to react.
+ *
+ * All input is scheduled up front on the simulator's event queue, so
+ * keypad clock edges, EM4100 bits, cards entering the MFRC522 field
+ * and bytes from the host arrive at exact virtual instants no matter
+ * what the firmware is busy with. A simulated host answers every
+ * HASH+ line like the real one would.
+ *
+ * usage: doorreplay [-t hours] [-n badges] [-s seed] [-l host-ms]
+ *                   [-a accept-%] [-b baud] [-m] [-f trace]
+ *
+ * With -b and/or -m the host first switches the link to that baud
+ * rate and with -m to binary frames, see tools/frame.h.
+ *
+ * A trace has one stimulus per line, times in ms from the start:
+ *
+ *   1000 key 0102030405060708B4   keypad bytes, 200ms apart
+ *   5000 em4100 0102030405        EM4100 tag, checksum is added
+ *   9000 card DEADBEEF 1500       MFRC522 card held for 1500ms
+ *   9500 host VO                  bytes from the host
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "doorduino.h"
+#define FRAME_DECODER
+#include "tools/frame.h"
+
+#define KEY_GAP SIM_MS(200)
+#define LOST_AFTER SIM_MS(5000)
+#define TAG_REPEAT 2        /* frames after the first */
+#define TAG_GAP SIM_MS(50)
+
+struct metric {
+	const char *name;
+	uint64_t *v;
+	size_t n;
+	size_t size;
+	unsigned long lost;
+	/* stimuli still waiting for a reaction, oldest first */
+	uint64_t pending[64];
+	unsigned int start;
+	unsigned int end;
+};
+
+static struct metric m_hash = { .name = "'#' -> HASH+" };
+static struct metric m_lock = { .name = "'O' -> lock open" };
+static struct metric m_open = { .name = "'O' -> OPENAKCK" };
+static struct metric m_tag = { .name = "EM4100 -> read" };
+static struct metric m_card = { .name = "MFRC522 -> read" };
+static struct metric m_door = { .name = "'#' -> door open" };
+
+static struct metric *const metrics[] = {
+	&m_hash, &m_lock, &m_open, &m_tag, &m_card, &m_door
+};
+
+static const unsigned long bauds[FRAME_BAUDS] = {
+	9600, 19200, 38400, 57600, 115200, 250000
+};
+
+static uint64_t host_latency = SIM_MS(20);
+static unsigned int accept_percent = 90;
+static unsigned long alive;
+static unsigned long badges;
+
+/* the link mode to negotiate, and how far we got */
+static uint8_t link_mode;
+static unsigned long link_baud = 9600;
+static int link_acks = -1;
+static struct frame_decoder decoder;
+
+static void
+firmware(void)
+{
+	door_main();
+}
+
+/*************************************************************\
+ * Latency bookkeeping                                       *
+\*************************************************************/
+
+static void
+metric_start(struct metric *m, uint64_t when)
+{
+	unsigned int next = (m->end + 1) % 64;
+
+	if (next == m->start) {
+		m->lost++;
+		m->start = (m->start + 1) % 64;
+	}
+	m->pending[m->end] = when;
+	m->end = next;
+}
+
+/* returns when the stimulus happened, or 0 if there was none */
+static uint64_t
+metric_done(struct metric *m)
+{
+	uint64_t when;
+
+	/* forget stimuli that never got a reaction */
+	while (m->start != m->end && sim_now - m->pending[m->start] > LOST_AFTER) {
+		m->lost++;
+		m->start = (m->start + 1) % 64;
+	}
+	if (m->start == m->end)
+		return 0;
+
+	when = m->pending[m->start];
+	m->start = (m->start + 1) % 64;
+
+	if (m->n == m->size) {
+		m->size = m->size ? 2 * m->size : 256;
+		m->v = realloc(m->v, m->size * sizeof(*m->v));
+		if (m->v == NULL) {
+			perror("doorreplay");
+			exit(EXIT_FAILURE);
+		}
+	}
+	m->v[m->n++] = sim_now - when;
+	return when;
+}
+
+static void
+mark(void *ctx, unsigned long arg)
+{
+	(void)arg;
+	metric_start(ctx, sim_now);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+ms(uint64_t cycles)
+{
+	return (double)cycles * 1000 / F_CPU;
+}
+
+static void
+metric_print(struct metric *m)
+{
+	unsigned long buckets[40] = { 0 };
+	unsigned long most = 0;
+	size_t i;
+	int b, lo = 40, hi = -1;
+
+	/* stimuli still pending at the end count as lost */
+	m->lost += (m->end - m->start + 64) % 64;
+
+	printf("%-18s n=%-6lu lost=%-4lu", m->name, (unsigned long)m->n, m->lost);
+	if (m->n == 0) {
+		printf("\n");
+		return;
+	}
+
+	qsort(m->v, m->n, sizeof(*m->v), cmp_u64);
+	printf(" min %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f ms\n",
+	       ms(m->v[0]), ms(m->v[m->n / 2]), ms(m->v[m->n * 9 / 10]),
+	       ms(m->v[m->n * 99 / 100]), ms(m->v[m->n - 1]));
+
+	/* log2 histogram in usec */
+	for (i = 0; i < m->n; i++) {
+		uint64_t us = m->v[i] / (F_CPU / 1000000);
+
+		for (b = 0; us > 1 && b < 39; b++)
+			us >>= 1;
+		buckets[b]++;
+		if (b < lo)
+			lo = b;
+		if (b > hi)
+			hi = b;
+	}
+	for (b = lo; b <= hi; b++) {
+		if (buckets[b] > most)
+			most = buckets[b];
+	}
+	for (b = lo; b <= hi; b++) {
+		int bar = (int)(buckets[b] * 40 / most);
+
+		printf("  %9.3f ms |%-40.*s| %lu\n", (double)(1UL << b) / 1000,
+		       bar, "########################################",
+		       buckets[b]);
+	}
+}
+
+/*************************************************************\
+ * The host and the door's outputs                           *
+\*************************************************************/
+
+static void
+host_reply(const char *reply)
+{
+	uint64_t t = sim_host_at(sim_now + host_latency,
+	                         (const uint8_t *)reply, strlen(reply));
+
+	/* the 'O' is the last byte, so it is there at t */
+	if (reply[strlen(reply) - 1] == 'O') {
+		sim_at(t, mark, &m_lock, 0);
+		sim_at(t, mark, &m_open, 0);
+	}
+}
+
+static void
+link_mode_send(void *ctx, unsigned long arg)
+{
+	char cmd[4];
+
+	(void)ctx;
+	(void)arg;
+	sim_host_baud = link_baud;
+	sprintf(cmd, "M%02X", link_mode);
+	sim_host_at(sim_now, (const uint8_t *)cmd, 3);
+}
+
+static void
+uart_tx(uint8_t c)
+{
+	char line[2 * FRAME_MAX + 8];
+	uint64_t when;
+
+	if (!frame_decode(&decoder, c))
+		return;
+	frame_line(&decoder, line);
+
+	if (!strcmp(line, "MODEACK") && link_acks >= 0) {
+		/* switch once the firmware did, then confirm */
+		if (link_acks++ == 0)
+			sim_at(sim_now + SIM_MS(10), link_mode_send, NULL, 0);
+	} else if (!strncmp(line, "HASH+", 5)) {
+		when = metric_done(&m_hash);
+		if ((unsigned int)rand() % 100 < accept_percent) {
+			if (when)
+				metric_start(&m_door, when);
+			host_reply("VO");
+		} else
+			host_reply("R");
+	} else if (!strcmp(line, "OPENAKCK"))
+		metric_done(&m_open);
+	else if (!strcmp(line, "ALIVE"))
+		alive++;
+}
+
+static void
+output(uint8_t pin, uint8_t level)
+{
+	if (level)
+		return;
+
+	if (pin == SIM_PIN_OPEN_LOCK) {
+		metric_done(&m_lock);
+		metric_done(&m_door);
+	}
+	else if (pin == SIM_PIN_YELLOW_LED) {
+		/* the card blink, whichever reader it came from */
+		if (m_tag.start != m_tag.end)
+			metric_done(&m_tag);
+		else
+			metric_done(&m_card);
+	}
+}
+
+/*************************************************************\
+ * Stimuli                                                   *
+\*************************************************************/
+
+static void
+card_event(void *ctx, unsigned long arg)
+{
+	struct sim_card *card = ctx;
+
+	if (arg)
+		sim_mfrc522_card_add(SIM_PIN_MFRC522_SS, card);
+	else {
+		sim_mfrc522_card_remove(SIM_PIN_MFRC522_SS, card);
+		free(card);
+	}
+}
+
+static void
+card_at(uint64_t when, const uint8_t *uid, uint8_t uid_len, uint64_t hold)
+{
+	struct sim_card *card = calloc(1, sizeof(*card));
+
+	if (card == NULL) {
+		perror("doorreplay");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(card->uid, uid, uid_len);
+	card->uid_len = uid_len;
+	card->atqa[0] = 0x04;
+	card->sak = 0x08;
+
+	sim_at(when, card_event, card, 1);
+	sim_at(when, mark, &m_card, 0);
+	sim_at(when + hold, card_event, card, 0);
+}
+
+static void
+tag_at(uint64_t when, const uint8_t id[5])
+{
+	static const char hex[] = "0123456789ABCDEF";
+	uint8_t frame[16];
+	uint8_t checksum = 0;
+	uint64_t t;
+	int i;
+
+	frame[0] = 2;
+	for (i = 0; i < 5; i++) {
+		frame[1 + 2 * i] = hex[id[i] >> 4];
+		frame[2 + 2 * i] = hex[id[i] & 0x0f];
+		checksum ^= id[i];
+	}
+	frame[11] = hex[checksum >> 4];
+	frame[12] = hex[checksum & 0x0f];
+	frame[13] = 13;
+	frame[14] = 10;
+	frame[15] = 3;
+
+	/* the reader sends it over and over while the tag is in range */
+	t = sim_em4100_at(when, frame, sizeof(frame));
+	sim_at(t, mark, &m_tag, 0);
+	for (i = 0; i < TAG_REPEAT; i++)
+		t = sim_em4100_at(t + TAG_GAP, frame, sizeof(frame));
+}
+
+/* type bytes on the keypad, returns when the last one is in */
+static uint64_t
+keys_at(uint64_t when, const uint8_t *buf, size_t len)
+{
+	uint64_t t = when;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+#ifdef WIEGAND
+		/* 8 bit keys, '#' is 11 on a Wiegand keypad */
+		uint8_t k = buf[i] == 0xB4 ? 11 : buf[i];
+
+		t = sim_wiegand_at(t, (~k & 0x0f) << 4 | k, 8);
+		/* and it is only in once the frame has timed out */
+		t += SIM_MS(20);
+#else
+		t = sim_keypad_at(t, buf + i, 1);
+#endif
+		if (buf[i] == 0xB4)
+			sim_at(t, mark, &m_hash, 0);
+		if (i + 1 < len)
+			t += KEY_GAP;
+	}
+
+	return t;
+}
+
+static uint8_t
+random_key(void)
+{
+	uint8_t c;
+
+#ifdef WIEGAND
+	/* only digits can be typed */
+	c = rand() % 10;
+#else
+	do
+		c = rand();
+	while (c == 0xB4);
+#endif
+
+	return c;
+}
+
+/* one person at the door, returns when they are done */
+static uint64_t
+badge_at(uint64_t when)
+{
+	uint8_t buf[16];
+	uint64_t t = when;
+	size_t n = 0;
+	int i;
+
+	badges++;
+
+	switch (rand() % 3) {
+	case 0: /* pin code only */
+		n = 9 + rand() % 4;
+		break;
+	case 1: /* EM4100 tag and a short pin */
+		for (i = 0; i < 5; i++)
+			buf[i] = rand();
+		tag_at(t, buf);
+		t += SIM_MS(1000 + rand() % 1000);
+		n = 2 + rand() % 3;
+		break;
+	case 2: /* MFRC522 card and a short pin */
+		for (i = 0; i < 4; i++)
+			buf[i] = rand();
+		card_at(t, buf, 4, SIM_MS(500 + rand() % 1500));
+		t += SIM_MS(1500 + rand() % 1000);
+		n = 2 + rand() % 3;
+		break;
+	}
+
+	for (i = 0; i < (int)n; i++)
+		buf[i] = random_key();
+	buf[n++] = 0xB4;
+
+	return keys_at(t, buf, n);
+}
+
+static void
+generate(uint64_t duration, unsigned long count)
+{
+	uint64_t t = SIM_MS(100);
+	uint64_t gap = duration / (count + 1);
+
+	while (count--) {
+		/* exponential gaps with a 5 second minimum */
+		double u = (rand() + 1.0) / ((double)RAND_MAX + 2.0);
+		uint64_t d = (uint64_t)(-(double)gap * log(u));
+
+		t += SIM_MS(5000) + d;
+		if (t > duration)
+			break;
+		t = badge_at(t);
+
+		/* somebody right behind them */
+		if (count && rand() % 10 == 0) {
+			t = badge_at(t + SIM_MS(1500));
+			count--;
+		}
+	}
+}
+
+static int
+hex_bytes(const char *s, uint8_t *buf, size_t size)
+{
+	size_t n = 0;
+	unsigned int v;
+
+	while (n < size && sscanf(s, "%2x", &v) == 1) {
+		buf[n++] = v;
+		s += 2;
+	}
+
+	return n;
+}
+
+static uint64_t
+load_trace(const char *path)
+{
+	char line[256], kind[16], arg[128];
+	uint64_t end = 0;
+	unsigned long lineno = 0;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long at, hold = 0;
+		uint8_t buf[64];
+		uint64_t t;
+		int n, fields;
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		fields = sscanf(line, "%lu %15s %127s %lu", &at, kind, arg, &hold);
+		if (fields < 3) {
+			fprintf(stderr, "%s:%lu: bad line\n", path, lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		t = SIM_MS(at);
+		if (!strcmp(kind, "key")) {
+			n = hex_bytes(arg, buf, sizeof(buf));
+			t = keys_at(t, buf, n);
+			badges++;
+		} else if (!strcmp(kind, "em4100") &&
+		           hex_bytes(arg, buf, 5) == 5) {
+			tag_at(t, buf);
+		} else if (!strcmp(kind, "card")) {
+			n = hex_bytes(arg, buf, 10);
+			card_at(t, buf, n, SIM_MS(hold ? hold : 1000));
+			t += SIM_MS(hold);
+		} else if (!strcmp(kind, "host")) {
+			t = sim_host_at(t, (const uint8_t *)arg, strlen(arg));
+			if (strchr(arg, 'O')) {
+				sim_at(t, mark, &m_lock, 0);
+				sim_at(t, mark, &m_open, 0);
+			}
+		} else {
+			fprintf(stderr, "%s:%lu: unknown stimulus '%s'\n",
+			        path, lineno, kind);
+			exit(EXIT_FAILURE);
+		}
+
+		if (t > end)
+			end = t;
+	}
+
+	fclose(f);
+	return end + SIM_MS(5000);
+}
+
+int
+main(int argc, char *argv[])
+{
+	double hours = 24;
+	unsigned long count = 500;
+	const char *trace = NULL;
+	struct timespec t0, t1;
+	uint64_t duration;
+	double wall;
+	size_t i;
+	int opt;
+
+	srand(1);
+	while ((opt = getopt(argc, argv, "t:n:s:l:a:b:mf:")) != -1) {
+		switch (opt) {
+		case 't':
+			hours = atof(optarg);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			srand(strtoul(optarg, NULL, 0));
+			break;
+		case 'l':
+			host_latency = SIM_MS(atof(optarg));
+			break;
+		case 'a':
+			accept_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			link_baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			link_mode |= FRAME_MODE_BINARY;
+			break;
+		case 'f':
+			trace = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t hours] [-n badges] [-s seed] "
+			        "[-l host-ms] [-a accept-%%] [-b baud] [-m] "
+			        "[-f trace]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < FRAME_BAUDS && bauds[i] != link_baud; i++)
+		;
+	if (i == FRAME_BAUDS) {
+		fprintf(stderr, "%s: unsupported baud rate %lu\n", argv[0],
+		        link_baud);
+		return EXIT_FAILURE;
+	}
+	link_mode |= i;
+
+#ifdef MFRC522_USE_IRQ
+	sim_mfrc522_attach(SIM_PIN_MFRC522_SS, SIM_PIN_MFRC522_IRQ);
+#else
+	sim_mfrc522_attach(SIM_PIN_MFRC522_SS, 0xff);
+#endif
+	/* the cards are only ever shown to the first reader */
+#if defined(MFRC522_READERS) && MFRC522_READERS > 1
+#ifdef MFRC522_USE_IRQ
+	sim_mfrc522_attach(SIM_PIN_MFRC522_SS1, SIM_PIN_MFRC522_IRQ);
+#else
+	sim_mfrc522_attach(SIM_PIN_MFRC522_SS1, 0xff);
+#endif
+#endif
+#if defined(MFRC522_READERS) && MFRC522_READERS > 2
+#ifdef MFRC522_USE_IRQ
+	sim_mfrc522_attach(SIM_PIN_MFRC522_SS2, SIM_PIN_MFRC522_IRQ);
+#else
+	sim_mfrc522_attach(SIM_PIN_MFRC522_SS2, 0xff);
+#endif
+#endif
+	sim_pin_drive(SIM_PIN_SOFTSERIAL, 1);
+#ifdef WIEGAND
+	sim_pin_drive(SIM_PIN_WIEGAND_D0, 1);
+	sim_pin_drive(SIM_PIN_WIEGAND_D1, 1);
+#endif
+	sim_output_hook = output;
+	sim_uart_hook = uart_tx;
+	sim_init(firmware);
+
+	/* the host's bytes are scheduled at the rate they will be sent */
+	sim_host_baud = link_baud;
+	if (trace)
+		duration = load_trace(trace);
+	else {
+		duration = (uint64_t)(hours * 3600) * F_CPU;
+		generate(duration, count);
+	}
+
+	sim_host_baud = 9600;
+	if (link_mode) {
+		char cmd[4];
+
+		/* well before the first stimulus at 100ms */
+		link_acks = 0;
+		sprintf(cmd, "M%02X", link_mode);
+		sim_host_at(SIM_MS(10), (const uint8_t *)cmd, 3);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	sim_run(duration);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	printf("%.2f virtual hours, %lu badges, %lu ALIVE in %.2f s "
+	       "(%.0fx real time, %.0f badges/s, %.0f SPI bytes/virtual s)\n",
+	       (double)duration / F_CPU / 3600, badges, alive, wall,
+	       (double)duration / F_CPU / wall, badges / wall,
+	       (double)sim_spi_bytes * F_CPU / duration);
+	if (link_mode)
+		printf("link at %lu baud%s, %s, %lu CRC errors\n", link_baud,
+		       link_mode & FRAME_MODE_BINARY ? " with frames" : "",
+		       link_acks == 2 ? "confirmed" : "NOT confirmed",
+		       decoder.crc_errors);
+#ifdef POWER_DOWN
+	printf("powered down %.1f%% of the time\n",
+	       100.0 * sim_power_down_cycles / duration);
+#endif
+	for (i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++)
+		metric_print(metrics[i]);
+
+	return EXIT_SUCCESS;
+}
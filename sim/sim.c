@@ -0,0 +1,1047 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include "sim.h"
+
+#define PINS 20
+
+/* cycles per byte on the SPI bus at fosc/4, including the busy-wait */
+#define SPI_CYCLES 36
+
+#define TX_BUF 65536
+
+/* default interrupt handlers, the firmware overrides what it uses */
+#define SIM_WEAK_ISR(vector) \
+	__attribute__((weak)) SIM_ISR(vector) {}
+
+SIM_WEAK_ISR(INT0)
+SIM_WEAK_ISR(INT1)
+SIM_WEAK_ISR(PCINT0)
+SIM_WEAK_ISR(PCINT1)
+SIM_WEAK_ISR(PCINT2)
+SIM_WEAK_ISR(WDT)
+SIM_WEAK_ISR(TIMER2_OVF)
+SIM_WEAK_ISR(TIMER1_COMPA)
+SIM_WEAK_ISR(TIMER1_COMPB)
+SIM_WEAK_ISR(TIMER0_COMPA)
+SIM_WEAK_ISR(TIMER0_COMPB)
+SIM_WEAK_ISR(USART_RX)
+SIM_WEAK_ISR(USART_UDRE)
+
+static void (*const isr_table[SIM_VECTORS])(void) = {
+	sim_isr_INT0,
+	sim_isr_INT1,
+	sim_isr_PCINT0,
+	sim_isr_PCINT1,
+	sim_isr_PCINT2,
+	sim_isr_WDT,
+	sim_isr_TIMER2_OVF,
+	sim_isr_TIMER1_COMPA,
+	sim_isr_TIMER1_COMPB,
+	sim_isr_TIMER0_COMPA,
+	sim_isr_TIMER0_COMPB,
+	sim_isr_USART_RX,
+	sim_isr_USART_UDRE
+};
+
+uint64_t sim_now;
+void (*sim_output_hook)(uint8_t pin, uint8_t level);
+void (*sim_uart_hook)(uint8_t c);
+unsigned long sim_spi_bytes;
+unsigned long sim_host_baud = 9600;
+uint64_t sim_power_down_cycles;
+uint64_t sim_wake_cycles = 1024;
+volatile uint8_t sim_wdtcsr;
+
+static uint8_t irq_flag;
+static uint8_t in_isr;
+static uint16_t irq_enabled;
+static uint16_t irq_pending;
+static uint8_t int_sense[2];
+static uint8_t pcint_mask[3];
+
+static uint8_t sleep_enabled;
+static uint8_t sleep_mode;
+static uint8_t powered_down;    /* the I/O clock is stopped */
+
+/* the watchdog runs off its own 128kHz oscillator */
+#define WDT_HZ 128000
+#define WDIE   6
+static uint64_t wdt_base;
+
+static struct {
+	uint8_t output;
+	uint8_t port;
+	uint8_t ext;
+} pins[PINS];
+
+static struct {
+	uint16_t prescaler;
+	int64_t base;
+	uint8_t frozen;
+	uint8_t ocr[2];
+} timer0;
+
+static struct {
+	uint16_t prescaler;
+	int64_t base;
+	uint8_t frozen;
+} timer2;
+
+static struct {
+	uint16_t prescaler;
+	int64_t base;
+	uint16_t frozen;
+	uint8_t ctc;
+	uint16_t ocr_a;
+	uint16_t ocr_b;
+} timer1;
+
+static struct {
+	unsigned long baud;
+	uint8_t frame;
+	uint8_t rx[3];
+	uint8_t rx_count;
+	uint8_t udr;
+	uint8_t udr_full;
+	uint8_t shift;
+	uint8_t busy;
+	uint64_t done;
+	char out[TX_BUF];
+	size_t out_start;
+	size_t out_end;
+} uart = { .baud = 9600, .frame = 10 };
+
+static uint8_t spi_data;
+
+/* events scheduled by the harness, a binary heap ordered by time */
+struct event {
+	uint64_t when;
+	unsigned long seq;
+	void (*fn)(void *ctx, unsigned long arg);
+	void *ctx;
+	unsigned long arg;
+};
+
+static struct event *queue;
+static size_t queue_len;
+static size_t queue_size;
+static unsigned long queue_seq;
+
+/* nothing happens before this, unless something is rescheduled */
+static uint64_t next_due;
+
+static ucontext_t harness_ctx;
+static ucontext_t firmware_ctx;
+static char firmware_stack[1 << 18];
+static void (*firmware_entry)(void);
+static uint64_t deadline;
+
+/*************************************************************\
+ * Pins and external interrupts                              *
+\*************************************************************/
+
+static uint8_t
+pin_value(uint8_t pin)
+{
+	return pins[pin].output ? pins[pin].port : pins[pin].ext;
+}
+
+static void
+pin_changed(uint8_t pin, uint8_t level)
+{
+	next_due = 0;
+
+	/* edges are only seen with the I/O clock running */
+	if ((pin == 2 || pin == 3) && !powered_down) {
+		uint8_t n = pin - 2;
+
+		if (int_sense[n] == SIM_CHANGE ||
+		    (int_sense[n] == SIM_RISING && level) ||
+		    (int_sense[n] == SIM_FALLING && !level))
+			irq_pending |= 1 << (SIM_INT0 + n);
+	}
+
+	if (pin < 8) {
+		if (pcint_mask[2] & (1 << pin))
+			irq_pending |= 1 << SIM_PCINT2;
+	} else if (pin < 14) {
+		if (pcint_mask[0] & (1 << (pin - 8)))
+			irq_pending |= 1 << SIM_PCINT0;
+	} else {
+		if (pcint_mask[1] & (1 << (pin - 14)))
+			irq_pending |= 1 << SIM_PCINT1;
+	}
+
+	if (pins[pin].output) {
+		sim_mfrc522_select(pin, level);
+		if (sim_output_hook)
+			sim_output_hook(pin, level);
+	}
+}
+
+void
+sim_pin_mode(uint8_t pin, uint8_t output)
+{
+	uint8_t old = pin_value(pin);
+
+	pins[pin].output = output;
+	if (pin_value(pin) != old)
+		pin_changed(pin, !old);
+}
+
+void
+sim_pin_write(uint8_t pin, uint8_t level)
+{
+	uint8_t old = pin_value(pin);
+
+	pins[pin].port = level;
+	if (pin_value(pin) != old)
+		pin_changed(pin, !old);
+}
+
+uint8_t
+sim_pin_read(uint8_t pin)
+{
+	return pin_value(pin);
+}
+
+void
+sim_pin_drive(uint8_t pin, uint8_t level)
+{
+	uint8_t old = pin_value(pin);
+
+	pins[pin].ext = level;
+	if (pin_value(pin) != old)
+		pin_changed(pin, !old);
+}
+
+uint8_t
+sim_pin_level(uint8_t pin)
+{
+	return pin_value(pin);
+}
+
+void
+sim_int_sense(uint8_t n, enum sim_sense sense)
+{
+	int_sense[n] = sense;
+}
+
+void
+sim_pcint_mask(uint8_t pin)
+{
+	if (pin < 8)
+		pcint_mask[2] |= 1 << pin;
+	else if (pin < 14)
+		pcint_mask[0] |= 1 << (pin - 8);
+	else
+		pcint_mask[1] |= 1 << (pin - 14);
+}
+
+/*************************************************************\
+ * Timers                                                    *
+\*************************************************************/
+
+/* first instant after now where the counter hits match */
+static uint64_t
+timer_next(int64_t base, uint16_t prescaler, uint32_t period, uint32_t match)
+{
+	int64_t k = ((int64_t)sim_now - base) / prescaler;
+	int64_t n = k - k % period + match;
+
+	if (n <= k)
+		n += period;
+
+	return base + n * prescaler;
+}
+
+/* did the counter hit match exactly now */
+static int
+timer_hit(int64_t base, uint16_t prescaler, uint32_t period, uint32_t match)
+{
+	int64_t d = (int64_t)sim_now - base;
+
+	return d % prescaler == 0 && (d / prescaler) % period == match;
+}
+
+void
+sim_timer0_clock(uint16_t prescaler)
+{
+	uint8_t count = sim_timer0_count();
+
+	next_due = 0;
+
+	timer0.prescaler = prescaler;
+	if (prescaler)
+		timer0.base = (int64_t)sim_now - (int64_t)count * prescaler;
+	else
+		timer0.frozen = count;
+}
+
+uint8_t
+sim_timer0_count(void)
+{
+	if (!timer0.prescaler)
+		return timer0.frozen;
+
+	return (((int64_t)sim_now - timer0.base) / timer0.prescaler) & 0xff;
+}
+
+void
+sim_timer0_compare(uint8_t which, uint8_t value)
+{
+	next_due = 0;
+	timer0.ocr[which] = value;
+}
+
+void
+sim_timer0_flags_clear(void)
+{
+	irq_pending &= ~((1 << SIM_TIMER0_COMPA) | (1 << SIM_TIMER0_COMPB));
+}
+
+void
+sim_timer2_clock(uint16_t prescaler)
+{
+	uint8_t count = sim_timer2_count();
+
+	next_due = 0;
+
+	timer2.prescaler = prescaler;
+	if (prescaler)
+		timer2.base = (int64_t)sim_now - (int64_t)count * prescaler;
+	else
+		timer2.frozen = count;
+}
+
+uint8_t
+sim_timer2_count(void)
+{
+	if (!timer2.prescaler)
+		return timer2.frozen;
+
+	return (((int64_t)sim_now - timer2.base) / timer2.prescaler) & 0xff;
+}
+
+static uint32_t
+timer1_period(void)
+{
+	return timer1.ctc ? (uint32_t)timer1.ocr_a + 1 : 0x10000;
+}
+
+void
+sim_timer1_clock(uint16_t prescaler)
+{
+	uint16_t count = sim_timer1_count();
+
+	next_due = 0;
+
+	timer1.prescaler = prescaler;
+	if (prescaler)
+		timer1.base = (int64_t)sim_now - (int64_t)count * prescaler;
+	else
+		timer1.frozen = count;
+}
+
+void
+sim_timer1_ctc(uint8_t on)
+{
+	uint16_t count = sim_timer1_count();
+
+	timer1.ctc = on;
+	sim_timer1_count_set(count);
+}
+
+uint16_t
+sim_timer1_count(void)
+{
+	if (!timer1.prescaler)
+		return timer1.frozen;
+
+	return (((int64_t)sim_now - timer1.base) / timer1.prescaler) %
+		timer1_period();
+}
+
+void
+sim_timer1_count_set(uint16_t value)
+{
+	next_due = 0;
+	if (timer1.prescaler)
+		timer1.base = (int64_t)sim_now - (int64_t)value * timer1.prescaler;
+	else
+		timer1.frozen = value;
+}
+
+void
+sim_timer1_compare_a(uint16_t value)
+{
+	uint16_t count = sim_timer1_count();
+
+	timer1.ocr_a = value;
+	sim_timer1_count_set(count);
+}
+
+void
+sim_timer1_compare_b(uint16_t value)
+{
+	next_due = 0;
+	timer1.ocr_b = value;
+}
+
+void
+sim_timer1_flags_clear(void)
+{
+	irq_pending &= ~((1 << SIM_TIMER1_COMPA) | (1 << SIM_TIMER1_COMPB));
+}
+
+/*************************************************************\
+ * UART                                                      *
+\*************************************************************/
+
+void
+sim_uart_baud(unsigned long baud)
+{
+	uart.baud = baud;
+}
+
+void
+sim_uart_frame(uint8_t bits)
+{
+	uart.frame = bits;
+}
+
+static void
+uart_load(void)
+{
+	next_due = 0;
+	uart.shift = uart.udr;
+	uart.udr_full = 0;
+	uart.busy = 1;
+	uart.done = sim_now + (uint64_t)F_CPU * uart.frame / uart.baud;
+}
+
+uint8_t
+sim_uart_read(void)
+{
+	uint8_t c;
+
+	if (uart.rx_count == 0)
+		return uart.rx[0];
+
+	c = uart.rx[0];
+	memmove(uart.rx, uart.rx + 1, --uart.rx_count);
+	return c;
+}
+
+void
+sim_uart_write(uint8_t c)
+{
+	uart.udr = c;
+	uart.udr_full = 1;
+	if (!uart.busy)
+		uart_load();
+}
+
+void
+sim_uart_rx(uint8_t c)
+{
+	/* data overrun, the byte is lost */
+	if (uart.rx_count == sizeof(uart.rx))
+		return;
+
+	uart.rx[uart.rx_count++] = c;
+	next_due = 0;
+}
+
+size_t
+sim_uart_tx(char *buf, size_t size)
+{
+	size_t n = 0;
+
+	while (n < size && uart.out_start != uart.out_end) {
+		buf[n++] = uart.out[uart.out_start];
+		uart.out_start = (uart.out_start + 1) % TX_BUF;
+	}
+
+	return n;
+}
+
+/*************************************************************\
+ * SPI                                                       *
+\*************************************************************/
+
+void
+sim_spi_write(uint8_t c)
+{
+	spi_data = sim_mfrc522_spi(c);
+	sim_spi_bytes++;
+	sim_advance(SPI_CYCLES);
+}
+
+uint8_t
+sim_spi_read(void)
+{
+	return spi_data;
+}
+
+/*************************************************************\
+ * EEPROM                                                    *
+\*************************************************************/
+
+/* an erase and write cycle takes 3.4ms */
+#define EEPROM_WRITE_CYCLES SIM_US(3400)
+
+uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+uint8_t
+sim_eeprom_read(uint16_t addr)
+{
+	return sim_eeprom[addr % SIM_EEPROM_SIZE];
+}
+
+void
+sim_eeprom_write(uint16_t addr, uint8_t value)
+{
+	sim_eeprom[addr % SIM_EEPROM_SIZE] = value;
+	sim_advance(EEPROM_WRITE_CYCLES);
+}
+
+/*************************************************************\
+ * Event queue                                               *
+\*************************************************************/
+
+static int
+event_before(const struct event *a, const struct event *b)
+{
+	return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+void
+sim_at(uint64_t when, void (*fn)(void *ctx, unsigned long arg),
+       void *ctx, unsigned long arg)
+{
+	size_t i;
+
+	if (queue_len == queue_size) {
+		queue_size = queue_size ? 2 * queue_size : 64;
+		queue = realloc(queue, queue_size * sizeof(*queue));
+		if (queue == NULL) {
+			perror("sim");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (when < sim_now)
+		when = sim_now;
+
+	/* sift up */
+	i = queue_len++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+
+		if (queue[parent].when < when ||
+		    queue[parent].when == when)
+			break;
+		queue[i] = queue[parent];
+		i = parent;
+	}
+	queue[i].when = when;
+	queue[i].seq = queue_seq++;
+	queue[i].fn = fn;
+	queue[i].ctx = ctx;
+	queue[i].arg = arg;
+
+	next_due = 0;
+}
+
+static struct event
+queue_pop(void)
+{
+	struct event top = queue[0];
+	struct event last = queue[--queue_len];
+	size_t i = 0;
+
+	/* sift down */
+	while (1) {
+		size_t child = 2 * i + 1;
+
+		if (child >= queue_len)
+			break;
+		if (child + 1 < queue_len &&
+		    event_before(&queue[child + 1], &queue[child]))
+			child++;
+		if (!event_before(&queue[child], &last))
+			break;
+		queue[i] = queue[child];
+		i = child;
+	}
+	queue[i] = last;
+
+	return top;
+}
+
+static void
+drive_event(void *ctx, unsigned long arg)
+{
+	(void)ctx;
+	sim_pin_drive(arg >> 8, arg & 1);
+}
+
+void
+sim_drive_at(uint64_t when, uint8_t pin, uint8_t level)
+{
+	sim_at(when, drive_event, NULL, (unsigned long)pin << 8 | level);
+}
+
+static void
+uart_rx_event(void *ctx, unsigned long arg)
+{
+	(void)ctx;
+
+	/*
+	 * the start bit is a falling edge on RXD, pin 0. it is raised
+	 * here as the whole byte arrives, which is close enough.
+	 */
+	if (pcint_mask[2] & 1)
+		irq_pending |= 1 << SIM_PCINT2;
+
+	/* no clock, the receiver misses the byte */
+	if (powered_down)
+		return;
+
+	/* sent at another baud rate, it arrives as garbage if at all */
+	if (arg >> 8 == uart.baud)
+		sim_uart_rx(arg & 0xff);
+}
+
+void
+sim_uart_rx_at(uint64_t when, uint8_t c)
+{
+	sim_at(when, uart_rx_event, NULL, sim_host_baud << 8 | c);
+}
+
+void
+sim_reschedule(void)
+{
+	next_due = 0;
+}
+
+/*************************************************************\
+ * Interrupts and virtual time                               *
+\*************************************************************/
+
+void
+sim_irq_enable(enum sim_vector v)
+{
+	next_due = 0;
+	irq_enabled |= 1 << v;
+}
+
+void
+sim_irq_disable(enum sim_vector v)
+{
+	next_due = 0;
+	irq_enabled &= ~(1 << v);
+}
+
+uint8_t
+sim_irq_pending(enum sim_vector v)
+{
+	return (irq_pending >> v) & 1;
+}
+
+/* interrupts that can wake the MCU from power-down */
+#define WAKE_SOURCES ((1 << SIM_INT0) | (1 << SIM_INT1) | (1 << SIM_PCINT0) | \
+                      (1 << SIM_PCINT1) | (1 << SIM_PCINT2) | (1 << SIM_WDT))
+
+/* highest priority interrupt ready to fire, or -1 */
+static int
+irq_ready(void)
+{
+	uint16_t p = irq_pending;
+	uint16_t enabled = irq_enabled;
+	int v;
+
+	if (sim_wdtcsr & (1 << WDIE))
+		enabled |= 1 << SIM_WDT;
+
+	/* level triggered sources */
+	if (int_sense[0] == SIM_LOW && !pin_value(2))
+		p |= 1 << SIM_INT0;
+	if (int_sense[1] == SIM_LOW && !pin_value(3))
+		p |= 1 << SIM_INT1;
+	if (uart.rx_count)
+		p |= 1 << SIM_USART_RX;
+	if (!uart.udr_full)
+		p |= 1 << SIM_USART_UDRE;
+
+	p &= enabled;
+	if (powered_down)
+		p &= WAKE_SOURCES;
+	for (v = 0; v < SIM_VECTORS; v++) {
+		if (p & (1 << v))
+			return v;
+	}
+
+	return -1;
+}
+
+static void
+dispatch(void)
+{
+	int v;
+
+	if (!irq_flag || in_isr)
+		return;
+
+	while ((v = irq_ready()) >= 0) {
+		irq_pending &= ~(1 << v);
+		irq_flag = 0;
+		in_isr = 1;
+		isr_table[v]();
+		in_isr = 0;
+		irq_flag = 1;
+	}
+}
+
+void
+sim_cli(void)
+{
+	irq_flag = 0;
+}
+
+void
+sim_sei(void)
+{
+	irq_flag = 1;
+	/*
+	 * the instruction after sei runs before any interrupt, so
+	 * sei(); sleep_cpu(); sleeps and is woken up right away
+	 */
+	if (!sleep_enabled)
+		dispatch();
+}
+
+/* WDP3..0 select 2K to 1024K cycles of the watchdog oscillator */
+static uint64_t
+wdt_period(void)
+{
+	uint8_t wdp = (sim_wdtcsr & 0x07) | (sim_wdtcsr >> 2 & 0x08);
+
+	return ((uint64_t)2048 << wdp) * F_CPU / WDT_HZ;
+}
+
+void
+sim_wdt_reset(void)
+{
+	next_due = 0;
+	wdt_base = sim_now;
+}
+
+/* when the next peripheral event is due, or UINT64_MAX */
+static uint64_t
+next_event(void)
+{
+	uint64_t t = sim_mfrc522_next_event();
+	uint64_t n;
+
+	if (timer0.prescaler) {
+		if (irq_enabled & (1 << SIM_TIMER0_COMPA)) {
+			n = timer_next(timer0.base, timer0.prescaler,
+			               256, timer0.ocr[0]);
+			if (n < t)
+				t = n;
+		}
+		if (irq_enabled & (1 << SIM_TIMER0_COMPB)) {
+			n = timer_next(timer0.base, timer0.prescaler,
+			               256, timer0.ocr[1]);
+			if (n < t)
+				t = n;
+		}
+	}
+
+	if (timer2.prescaler && (irq_enabled & (1 << SIM_TIMER2_OVF))) {
+		n = timer_next(timer2.base, timer2.prescaler, 256, 0);
+		if (n < t)
+			t = n;
+	}
+
+	if (timer1.prescaler) {
+		if (irq_enabled & (1 << SIM_TIMER1_COMPA)) {
+			n = timer_next(timer1.base, timer1.prescaler,
+			               timer1_period(), timer1.ocr_a);
+			if (n < t)
+				t = n;
+		}
+		if ((irq_enabled & (1 << SIM_TIMER1_COMPB)) &&
+		    timer1.ocr_b < timer1_period()) {
+			n = timer_next(timer1.base, timer1.prescaler,
+			               timer1_period(), timer1.ocr_b);
+			if (n < t)
+				t = n;
+		}
+	}
+
+	if (sim_wdtcsr & (1 << WDIE)) {
+		uint64_t period = wdt_period();
+
+		n = wdt_base + ((sim_now - wdt_base) / period + 1) * period;
+		if (n < t)
+			t = n;
+	}
+
+	if (uart.busy && !powered_down && uart.done < t)
+		t = uart.done;
+
+	if (queue_len && queue[0].when < t)
+		t = queue[0].when;
+
+	return t;
+}
+
+/* raise the flags of everything that happens exactly now */
+static void
+fire_events(void)
+{
+	if (timer0.prescaler) {
+		if (timer_hit(timer0.base, timer0.prescaler,
+		              256, timer0.ocr[0]))
+			irq_pending |= 1 << SIM_TIMER0_COMPA;
+		if (timer_hit(timer0.base, timer0.prescaler,
+		              256, timer0.ocr[1]))
+			irq_pending |= 1 << SIM_TIMER0_COMPB;
+	}
+
+	if (timer2.prescaler &&
+	    timer_hit(timer2.base, timer2.prescaler, 256, 0))
+		irq_pending |= 1 << SIM_TIMER2_OVF;
+
+	if (timer1.prescaler) {
+		if (timer_hit(timer1.base, timer1.prescaler,
+		              timer1_period(), timer1.ocr_a))
+			irq_pending |= 1 << SIM_TIMER1_COMPA;
+		if (timer1.ocr_b < timer1_period() &&
+		    timer_hit(timer1.base, timer1.prescaler,
+		              timer1_period(), timer1.ocr_b))
+			irq_pending |= 1 << SIM_TIMER1_COMPB;
+	}
+
+	if ((sim_wdtcsr & (1 << WDIE)) && sim_now != wdt_base &&
+	    (sim_now - wdt_base) % wdt_period() == 0)
+		irq_pending |= 1 << SIM_WDT;
+
+	if (uart.busy && !powered_down && uart.done == sim_now) {
+		uart.busy = 0;
+		if (uart.baud == sim_host_baud) {
+			uart.out[uart.out_end] = uart.shift;
+			uart.out_end = (uart.out_end + 1) % TX_BUF;
+			if (sim_uart_hook)
+				sim_uart_hook(uart.shift);
+		}
+		if (uart.udr_full)
+			uart_load();
+	}
+
+	sim_mfrc522_update();
+
+	while (queue_len && queue[0].when == sim_now) {
+		struct event ev = queue_pop();
+
+		ev.fn(ev.ctx, ev.arg);
+	}
+}
+
+/* move time forward to target, firing interrupts on the way */
+static void
+run_until(uint64_t target)
+{
+	while (1) {
+		uint64_t t = next_event();
+
+		if (t > target) {
+			next_due = t;
+			break;
+		}
+
+		sim_now = t;
+		fire_events();
+		dispatch();
+	}
+
+	sim_now = target;
+}
+
+static void
+yield(void)
+{
+	swapcontext(&firmware_ctx, &harness_ctx);
+}
+
+void
+sim_advance(uint64_t cycles)
+{
+	uint64_t target = sim_now + cycles;
+
+	/* fast path for the common case of nothing happening */
+	if (target < next_due && target <= deadline) {
+		sim_now = target;
+		return;
+	}
+
+	while (!in_isr && target > deadline) {
+		run_until(deadline);
+		yield();
+		dispatch();
+	}
+
+	run_until(target);
+}
+
+void
+sim_sleep_mode(uint8_t mode)
+{
+	sleep_mode = mode;
+}
+
+void
+sim_sleep_enable(uint8_t on)
+{
+	sleep_enabled = on;
+}
+
+/* let time pass without the firmware until target or a wake-up */
+static void
+sleep_until(uint64_t target)
+{
+	while (!(irq_flag && irq_ready() >= 0)) {
+		uint64_t t = next_event();
+
+		if (t > target) {
+			sim_now = target;
+			return;
+		}
+		if (t > deadline) {
+			sim_now = deadline;
+			yield();
+			continue;
+		}
+
+		sim_now = t;
+		fire_events();
+	}
+}
+
+/*
+ * stop the I/O clock, so the timers and the UART stand still,
+ * until an interrupt that works without it wakes the MCU. the
+ * clock then takes sim_wake_cycles to start again.
+ */
+static void
+power_down(void)
+{
+	uint16_t prescaler[3] = {
+		timer0.prescaler, timer1.prescaler, timer2.prescaler
+	};
+	uint64_t start = sim_now;
+
+	/* an interrupt that is already pending wakes the MCU at once */
+	if (irq_flag && irq_ready() >= 0) {
+		dispatch();
+		return;
+	}
+
+	sim_timer0_clock(0);
+	sim_timer1_clock(0);
+	sim_timer2_clock(0);
+	powered_down = 1;
+
+	sleep_until(UINT64_MAX);
+
+	/* nothing happens meanwhile, not even a wake-up source firing */
+	irq_flag = 0;
+	sleep_until(sim_now + sim_wake_cycles);
+	irq_flag = 1;
+
+	powered_down = 0;
+	sim_power_down_cycles += sim_now - start;
+	if (uart.busy)
+		uart.done += sim_now - start;
+	sim_timer0_clock(prescaler[0]);
+	sim_timer1_clock(prescaler[1]);
+	sim_timer2_clock(prescaler[2]);
+
+	dispatch();
+}
+
+uint8_t
+sim_powered_down(void)
+{
+	return powered_down;
+}
+
+void
+sim_sleep_cpu(void)
+{
+	if (!sleep_enabled)
+		return;
+
+	if (sleep_mode == 2) {
+		power_down();
+		return;
+	}
+
+	sleep_until(UINT64_MAX);
+	dispatch();
+}
+
+/*************************************************************\
+ * Harness                                                   *
+\*************************************************************/
+
+static void
+firmware_start(void)
+{
+	firmware_entry();
+	fprintf(stderr, "sim: firmware returned\n");
+	exit(EXIT_FAILURE);
+}
+
+void
+sim_init(void (*firmware)(void))
+{
+	firmware_entry = firmware;
+	memset(sim_eeprom, 0xff, sizeof(sim_eeprom));
+
+	getcontext(&firmware_ctx);
+	firmware_ctx.uc_stack.ss_sp = firmware_stack;
+	firmware_ctx.uc_stack.ss_size = sizeof(firmware_stack);
+	firmware_ctx.uc_link = NULL;
+	makecontext(&firmware_ctx, firmware_start, 0);
+}
+
+void
+sim_run(uint64_t cycles)
+{
+	deadline = sim_now + cycles;
+	swapcontext(&harness_ctx, &firmware_ctx);
+}
@@ -0,0 +1,217 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simulated ATmega328p for running the firmware on a host.
+ *
+ * The headers in sim/arduino/ implement the subset of the oniudra
+ * API the firmware uses on top of the functions below. The firmware
+ * runs in its own context and only gives control back to the test
+ * harness when virtual time reaches the deadline passed to sim_run().
+ * Code between HAL calls takes no virtual time; SPI transfers,
+ * delays and sleeping advance it.
+ */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+/* where the door's readers are wired, see doorduino.c */
+#define SIM_PIN_CLK         2
+#define SIM_PIN_DATA        3
+#define SIM_PIN_WIEGAND_D0  2   /* instead of the keypad */
+#define SIM_PIN_WIEGAND_D1  3
+#define SIM_PIN_GREEN_LED   4
+#define SIM_PIN_YELLOW_LED  5
+#define SIM_PIN_OPEN_LOCK   6
+#define SIM_PIN_SOFTSERIAL  8
+#define SIM_PIN_MFRC522_IRQ 15
+#define SIM_PIN_MFRC522_SS  10
+#define SIM_PIN_MFRC522_SS1 16  /* the second and third reader */
+#define SIM_PIN_MFRC522_SS2 17
+
+#ifdef SOFTSERIAL_BAUD
+#define SIM_EM4100_BAUD SOFTSERIAL_BAUD
+#else
+#define SIM_EM4100_BAUD 9600
+#endif
+
+#define SIM_US(us) ((uint64_t)(us) * (F_CPU / 1000000UL))
+#define SIM_MS(ms) ((uint64_t)(ms) * (F_CPU / 1000UL))
+
+/* interrupt vectors in ATmega328p vector table order, ie. priority */
+enum sim_vector {
+	SIM_INT0,
+	SIM_INT1,
+	SIM_PCINT0,
+	SIM_PCINT1,
+	SIM_PCINT2,
+	SIM_WDT,
+	SIM_TIMER2_OVF,
+	SIM_TIMER1_COMPA,
+	SIM_TIMER1_COMPB,
+	SIM_TIMER0_COMPA,
+	SIM_TIMER0_COMPB,
+	SIM_USART_RX,
+	SIM_USART_UDRE,
+	SIM_VECTORS
+};
+
+#define SIM_ISR(vector) void sim_isr_##vector(void)
+
+enum sim_sense {
+	SIM_LOW,
+	SIM_CHANGE,
+	SIM_FALLING,
+	SIM_RISING
+};
+
+/* virtual time in cpu cycles */
+extern uint64_t sim_now;
+
+/* called whenever an output pin changes level */
+extern void (*sim_output_hook)(uint8_t pin, uint8_t level);
+
+/* called when a byte has left the UART */
+extern void (*sim_uart_hook)(uint8_t c);
+
+/*
+ * baud rate of the host end of the serial link. bytes in
+ * either direction are lost while the firmware uses another.
+ */
+extern unsigned long sim_host_baud;
+
+/* number of bytes clocked over SPI so far */
+extern unsigned long sim_spi_bytes;
+
+/*
+ * time spent in power-down so far, and how long the oscillator
+ * takes to start again, 1K CK unless set otherwise
+ */
+extern uint64_t sim_power_down_cycles;
+extern uint64_t sim_wake_cycles;
+/* 1 while the I/O clock is stopped, until the oscillator has started */
+uint8_t sim_powered_down(void);
+
+/* EEPROM contents, erased by sim_init() */
+#define SIM_EEPROM_SIZE 1024
+extern uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+/* firmware side */
+void sim_cli(void);
+void sim_sei(void);
+void sim_irq_enable(enum sim_vector v);
+void sim_irq_disable(enum sim_vector v);
+uint8_t sim_irq_pending(enum sim_vector v);
+void sim_int_sense(uint8_t n, enum sim_sense sense);
+void sim_pcint_mask(uint8_t pin);
+void sim_advance(uint64_t cycles);
+void sim_sleep_mode(uint8_t mode);
+void sim_sleep_enable(uint8_t on);
+void sim_sleep_cpu(void);
+
+extern volatile uint8_t sim_wdtcsr;
+void sim_wdt_reset(void);
+
+void sim_pin_mode(uint8_t pin, uint8_t output);
+void sim_pin_write(uint8_t pin, uint8_t level);
+uint8_t sim_pin_read(uint8_t pin);
+
+void sim_timer0_clock(uint16_t prescaler);
+uint8_t sim_timer0_count(void);
+void sim_timer0_compare(uint8_t which, uint8_t value);
+void sim_timer0_flags_clear(void);
+
+void sim_timer2_clock(uint16_t prescaler);
+uint8_t sim_timer2_count(void);
+
+void sim_timer1_clock(uint16_t prescaler);
+void sim_timer1_ctc(uint8_t on);
+uint16_t sim_timer1_count(void);
+void sim_timer1_count_set(uint16_t value);
+void sim_timer1_compare_a(uint16_t value);
+void sim_timer1_compare_b(uint16_t value);
+void sim_timer1_flags_clear(void);
+
+void sim_uart_baud(unsigned long baud);
+void sim_uart_frame(uint8_t bits);
+uint8_t sim_uart_read(void);
+void sim_uart_write(uint8_t c);
+
+void sim_spi_write(uint8_t c);
+uint8_t sim_spi_read(void);
+
+uint8_t sim_eeprom_read(uint16_t addr);
+void sim_eeprom_write(uint16_t addr, uint8_t value);
+
+/* harness side */
+void sim_init(void (*firmware)(void));
+void sim_run(uint64_t cycles);
+void sim_pin_drive(uint8_t pin, uint8_t level);
+uint8_t sim_pin_level(uint8_t pin);
+void sim_uart_rx(uint8_t c);
+size_t sim_uart_tx(char *buf, size_t size);
+
+/*
+ * schedule fn to be called at a virtual instant. it runs in the
+ * firmware's context at exactly that time, even if the firmware
+ * is busy, so interrupts it triggers fire when they would on
+ * real hardware.
+ */
+void sim_at(uint64_t when, void (*fn)(void *ctx, unsigned long arg),
+            void *ctx, unsigned long arg);
+void sim_drive_at(uint64_t when, uint8_t pin, uint8_t level);
+void sim_uart_rx_at(uint64_t when, uint8_t c);
+
+/* a peripheral model has scheduled something new */
+void sim_reschedule(void);
+
+/*
+ * input waveforms, see sim/stimulus.c. each returns the instant
+ * the firmware can first see the last byte.
+ */
+uint64_t sim_keypad_at(uint64_t when, const uint8_t *buf, size_t len);
+uint64_t sim_em4100_at(uint64_t when, const uint8_t *buf, size_t len);
+/* the low bits of frame msb first, the door waits for more after that */
+uint64_t sim_wiegand_at(uint64_t when, uint64_t frame, uint8_t bits);
+uint64_t sim_host_at(uint64_t when, const uint8_t *buf, size_t len);
+
+/* fake MFRC522 attached to the SPI bus, see sim/mfrc522.c */
+struct sim_card {
+	uint8_t uid[10];
+	uint8_t uid_len;        /* 4, 7 or 10 */
+	uint8_t atqa[2];
+	uint8_t sak;
+};
+
+void sim_mfrc522_attach(uint8_t ss_pin, uint8_t irq_pin);
+void sim_mfrc522_card_add(uint8_t ss_pin, const struct sim_card *card);
+void sim_mfrc522_card_remove(uint8_t ss_pin, const struct sim_card *card);
+
+/* used by sim.c to clock the fake MFRC522s */
+void sim_mfrc522_select(uint8_t pin, uint8_t level);
+uint8_t sim_mfrc522_spi(uint8_t c);
+uint64_t sim_mfrc522_next_event(void);
+void sim_mfrc522_update(void);
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Scheduled input waveforms for the pins the door readers are wired to.
+ */
+
+#include "sim.h"
+
+/* the keypad clocks bits at 5kHz */
+#define KEYPAD_HALF_PERIOD SIM_US(100)
+
+uint64_t
+sim_keypad_at(uint64_t when, const uint8_t *buf, size_t len)
+{
+	uint64_t t = when;
+	size_t i;
+	int j;
+
+	for (i = 0; i < len; i++) {
+		for (j = 7; j >= 0; j--) {
+			sim_drive_at(t, SIM_PIN_DATA, (buf[i] >> j) & 1);
+			t += KEYPAD_HALF_PERIOD;
+			sim_drive_at(t, SIM_PIN_CLK, 1);
+			t += KEYPAD_HALF_PERIOD;
+			sim_drive_at(t, SIM_PIN_CLK, 0);
+		}
+	}
+
+	/* the rising edge that clocked in the last bit */
+	return t - KEYPAD_HALF_PERIOD;
+}
+
+uint64_t
+sim_em4100_at(uint64_t when, const uint8_t *buf, size_t len)
+{
+	const uint64_t bit = F_CPU / SIM_EM4100_BAUD;
+	unsigned int n = 0;
+	size_t i;
+	int j;
+
+	for (i = 0; i < len; i++) {
+		/* start bit, 8 data bits lsb first, stop bit */
+		uint16_t frame = 0x200 | buf[i] << 1;
+
+		for (j = 0; j < 10; j++, n++)
+			sim_drive_at(when + n * bit, SIM_PIN_SOFTSERIAL,
+			             (frame >> j) & 1);
+	}
+
+	return when + n * bit;
+}
+
+/* Wiegand pulses are 20-100usec, 0.5-2msec apart */
+#define WIEGAND_PULSE    SIM_US(50)
+#define WIEGAND_INTERVAL SIM_MS(1)
+
+uint64_t
+sim_wiegand_at(uint64_t when, uint64_t frame, uint8_t bits)
+{
+	uint64_t t = when;
+	int i;
+
+	for (i = bits - 1; i >= 0; i--) {
+		uint8_t pin = (frame >> i) & 1 ? SIM_PIN_WIEGAND_D1 :
+		                                 SIM_PIN_WIEGAND_D0;
+
+		sim_drive_at(t, pin, 0);
+		sim_drive_at(t + WIEGAND_PULSE, pin, 1);
+		if (i)
+			t += WIEGAND_INTERVAL;
+	}
+
+	/* the falling edge of the last bit */
+	return t;
+}
+
+uint64_t
+sim_host_at(uint64_t when, const uint8_t *buf, size_t len)
+{
+	/* the host talks 8E2, a byte is there after its stop bits */
+	const uint64_t byte = F_CPU * 12 / sim_host_baud;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sim_uart_rx_at(when + (i + 1) * byte, buf[i]);
+
+	return when + len * byte;
+}
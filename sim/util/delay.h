@@ -0,0 +1,13 @@
+/*
+ * Simulated <util/delay.h>, see sim/sim.h
+ */
+
+#ifndef _UTIL_DELAY_H
+#define _UTIL_DELAY_H
+
+#include <sim.h>
+
+#define _delay_us(us) sim_advance(SIM_US(us))
+#define _delay_ms(ms) sim_advance(SIM_MS(ms))
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bloom filter over the digests of all authorized codes.
+ *
+ * Build with -DBLOOM_BYTES=n to keep a filter in the last n bytes
+ * of the EEPROM, see tools/bloom.h for the layout. A code whose
+ * digest is not in the filter cannot be valid, so it is rejected
+ * without asking the host. The local store gets what is left of
+ * the EEPROM.
+ *
+ * The filter is generated and uploaded by host/doorbloom.c. The
+ * marker byte is cleared before the upload and only set when it
+ * is complete, so a half written filter is never used. Until then
+ * every code is let through to the host.
+ */
+
+#ifdef BLOOM_BYTES
+#include <avr/eeprom.h>
+#include "tools/bloom.h"
+
+#define BLOOM_BASE ((uint8_t *)(uintptr_t)(E2END + 1 - BLOOM_BYTES))
+
+static uint8_t bloom_loading;
+
+/*
+ * returns 0 if the code with this digest is certainly
+ * not authorized, 1 if it may be
+ */
+static uint8_t
+bloom_check(const char *digest)
+{
+	uint8_t i;
+	uint16_t bit;
+
+	if (bloom_loading || eeprom_read_byte(BLOOM_BASE) != BLOOM_MAGIC)
+		return 1;
+
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = bloom_bit(digest, i, BLOOM_BITS(BLOOM_BYTES));
+		if (!(eeprom_read_byte(BLOOM_BASE + 1 + bit / 8) &
+		      (1 << (bit % 8))))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+bloom_begin(void)
+{
+	bloom_loading = 1;
+	eeprom_update_byte(BLOOM_BASE, 0xff);
+}
+
+/*
+ * write len bytes of the bit array at offset, anything past
+ * its end is dropped. returns 0 unless an upload is going on.
+ */
+static uint8_t
+bloom_write(uint16_t offset, const char *buf, uint8_t len)
+{
+	if (!bloom_loading || offset >= BLOOM_BYTES - 1)
+		return 0;
+	if (len > BLOOM_BYTES - 1 - offset)
+		len = BLOOM_BYTES - 1 - offset;
+
+	eeprom_update_block(buf, BLOOM_BASE + 1 + offset, len);
+	return 1;
+}
+
+static uint8_t
+bloom_finish(void)
+{
+	if (!bloom_loading)
+		return 0;
+
+	eeprom_update_byte(BLOOM_BASE, BLOOM_MAGIC);
+	bloom_loading = 0;
+	return 1;
+}
+
+#else /* BLOOM_BYTES */
+
+#define bloom_check(digest) 1
+
+#endif /* BLOOM_BYTES */
@@ -0,0 +1,32 @@
+/*
+ * Bloom filter layout shared by the firmware and host/doorbloom.c.
+ *
+ * The filter is BLOOM_BYTES of EEPROM: a marker byte followed by
+ * the bit array. SHA-1 digests are uniformly distributed already,
+ * so the bits for a digest are simply its first BLOOM_HASHES 16 bit
+ * big endian words modulo the number of bits.
+ */
+
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+#include <stdint.h>
+
+#ifndef BLOOM_HASHES
+#define BLOOM_HASHES 4
+#endif
+
+/* marker byte of a complete filter */
+#define BLOOM_MAGIC 0xB1
+
+#define BLOOM_BITS(bytes) (8 * ((uint16_t)(bytes) - 1))
+
+static inline uint16_t
+bloom_bit(const char *digest, uint8_t i, uint16_t bits)
+{
+	const uint8_t *d = (const uint8_t *)digest + 2 * i;
+
+	return ((uint16_t)d[0] << 8 | d[1]) % bits;
+}
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * Binary framing of the events the door sends to the host,
+ * shared by the firmware and the host side tools.
+ *
+ * A frame is
+ *
+ *   FRAME_SOF, length, type, payload[length], crc low, crc high
+ *
+ * with a CRC-16/CCITT (polynomial 0x1021, initial 0xffff) over the
+ * length, type and payload. FRAME_SOF is not ASCII, so a decoder can
+ * take frames and lines of text from the same stream, which is what
+ * it sees while the mode changes. There is no escaping; a decoder
+ * that finds a bad CRC drops the FRAME_SOF and looks again.
+ */
+
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include <stdint.h>
+
+#define FRAME_SOF 0xA5
+#define FRAME_MAX 64            /* longest payload */
+
+enum frame_type {
+	FRAME_TEXT        = 0x00, /* any other line, without the '\n' */
+	FRAME_HASH        = 0x01, /* HASH+, the raw 20 byte digest */
+	FRAME_OPENED      = 0x02, /* OPENAKCK */
+	FRAME_ALIVE       = 0x03, /* ALIVE */
+	FRAME_LOCALOPEN   = 0x04, /* LOCALOPEN */
+	FRAME_LOCALREJECT = 0x05  /* LOCALREJECT */
+};
+
+/* 'M' argument: FRAME_MODE_BINARY or'ed with one of the baud rates */
+#define FRAME_MODE_BINARY 0x80
+
+enum frame_baud {
+	FRAME_BAUD_9600,
+	FRAME_BAUD_19200,
+	FRAME_BAUD_38400,
+	FRAME_BAUD_57600,
+	FRAME_BAUD_115200,
+	FRAME_BAUD_250000,
+	FRAME_BAUDS
+};
+
+static inline uint16_t
+frame_crc(uint16_t crc, uint8_t c)
+{
+	uint8_t i;
+
+	crc ^= (uint16_t)c << 8;
+	for (i = 0; i < 8; i++)
+		crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+
+	return crc;
+}
+
+#ifdef FRAME_DECODER
+/*
+ * host side decoder, feed it one byte at a time.
+ * needs <stdio.h> and <string.h>.
+ */
+struct frame_decoder {
+	uint8_t buf[3 + FRAME_MAX + 2];
+	unsigned int len;
+	/* the last complete frame or line */
+	uint8_t framed;         /* 0 for a line of text */
+	uint8_t type;
+	uint8_t payload[FRAME_MAX + 1];
+	unsigned int payload_len;
+	unsigned long crc_errors;
+};
+
+static inline unsigned int
+frame_need(const struct frame_decoder *d)
+{
+	return d->len < 2 ? 2 : 3 + d->buf[1] + 2;
+}
+
+/* drop what is buffered up to the next FRAME_SOF at or after from */
+static inline void
+frame_resync(struct frame_decoder *d, unsigned int from)
+{
+	unsigned int i;
+
+	for (i = from; i < d->len && d->buf[i] != FRAME_SOF; i++)
+		;
+	d->len -= i;
+	memmove(d->buf, d->buf + i, d->len);
+}
+
+/*
+ * returns 1 when c completes a frame or a line of text, which is
+ * then in d->type and d->payload, NUL terminated for convenience
+ */
+static inline int
+frame_decode(struct frame_decoder *d, uint8_t c)
+{
+	unsigned int i, n;
+	uint16_t crc;
+
+	if (d->len == 0 || d->buf[0] != FRAME_SOF) {
+		/* text */
+		if (c == FRAME_SOF && d->len == 0) {
+			d->buf[d->len++] = c;
+			return 0;
+		}
+		if (c != '\n') {
+			if (d->len < FRAME_MAX)
+				d->buf[d->len++] = c;
+			return 0;
+		}
+		d->framed = 0;
+		d->type = FRAME_TEXT;
+		memcpy(d->payload, d->buf, d->len);
+		d->payload_len = d->len;
+		d->payload[d->len] = '\0';
+		d->len = 0;
+		return 1;
+	}
+
+	/*
+	 * frame_need() is never more than the buffer, as long as every
+	 * length byte that gets to buf[1] is checked, including those
+	 * that a resync moves there. after a resync what is buffered
+	 * may be a whole frame already.
+	 */
+	d->buf[d->len++] = c;
+	while (d->len >= 2) {
+		if (d->buf[1] > FRAME_MAX) {
+			d->crc_errors++;
+			frame_resync(d, 1);
+			continue;
+		}
+		n = frame_need(d);
+		if (d->len < n)
+			return 0;
+
+		crc = 0xffff;
+		for (i = 1; i < n - 2; i++)
+			crc = frame_crc(crc, d->buf[i]);
+		if ((crc & 0xff) != d->buf[n - 2] || crc >> 8 != d->buf[n - 1]) {
+			/* resynchronise on the next FRAME_SOF after this one */
+			d->crc_errors++;
+			frame_resync(d, 1);
+			continue;
+		}
+
+		d->framed = 1;
+		d->type = d->buf[2];
+		d->payload_len = d->buf[1];
+		memcpy(d->payload, d->buf + 3, d->payload_len);
+		d->payload[d->payload_len] = '\0';
+		frame_resync(d, n);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * the line the door would have printed in ASCII mode, without
+ * the '\n'. out must have room for 2 * FRAME_MAX + 6 bytes.
+ */
+static inline void
+frame_line(const struct frame_decoder *d, char *out)
+{
+	static const char *const names[] = {
+		NULL, "HASH+", "OPENAKCK", "ALIVE", "LOCALOPEN", "LOCALREJECT"
+	};
+	unsigned int i;
+
+	if (d->type == FRAME_TEXT || d->type >= sizeof(names) / sizeof(names[0])) {
+		strcpy(out, (const char *)d->payload);
+		return;
+	}
+
+	out += sprintf(out, "%s", names[d->type]);
+	for (i = 0; i < d->payload_len; i++)
+		out += sprintf(out, "%02X", d->payload[i]);
+}
+#endif
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Local store of authorized codes, so the door opens without
+ * waiting for the host, or when the host is down.
+ *
+ * The EEPROM holds a header followed by an open addressing hash
+ * table of keys, the first LOCAL_KEY bytes of the SHA-1 digest of
+ * each authorized code. SHA-1 output is uniformly distributed, so
+ * the key itself is a good enough hash and linear probing from the
+ * slot its first byte points to finds it after a read or two.
+ *
+ * Erased EEPROM reads as all ones, which marks a free slot. Removed
+ * keys become all zeros so the probing goes on past them. Keys that
+ * happen to look like either have their last bit flipped.
+ *
+ * The table is only used once it has been cleared, which writes the
+ * header. It is invalidated while being cleared, so a reset half way
+ * never leaves stale codes behind. The header records the number of
+ * slots, so a table laid out for another BLOOM_BYTES is not used.
+ *
+ * An EEPROM write takes 3.4ms, so a clear of a full table would take
+ * seconds, and even a single key 13.6ms. local_clear() only starts
+ * the clear, and local_add() and local_remove() only queue the key
+ * for its slot. local_work() writes one byte at a time from the main
+ * loop once the last write is done. Lookups see the queued keys as
+ * if they had been written already.
+ */
+
+#include <avr/eeprom.h>
+
+#ifdef BLOOM_BYTES
+#define LOCAL_END    (E2END + 1 - BLOOM_BYTES)
+#else
+#define LOCAL_END    (E2END + 1)
+#endif
+
+#define LOCAL_KEY    4
+#define LOCAL_HEADER 4
+#define LOCAL_SLOTS  ((LOCAL_END - LOCAL_HEADER) / LOCAL_KEY)
+
+static const uint8_t local_magic[LOCAL_HEADER] = {
+	'D', 'O', LOCAL_SLOTS >> 8, LOCAL_SLOTS & 0xff
+};
+
+enum local_state {
+	LOCAL_INVALID,
+	LOCAL_VALID,
+	LOCAL_CLEARING
+};
+static uint8_t local_valid;
+static uint16_t local_next;          /* byte to clear next */
+
+#ifndef LOCAL_QUEUE
+#define LOCAL_QUEUE  4
+#endif
+
+/* keys on their way to their slots, the first written up to local_byte */
+static struct {
+	uint16_t slot;
+	uint8_t key[LOCAL_KEY];
+} local_queue[LOCAL_QUEUE];
+static uint8_t local_first;
+static uint8_t local_queued;
+static uint8_t local_byte;
+
+static uint8_t *
+local_slot(uint16_t i)
+{
+	return (uint8_t *)(uintptr_t)(LOCAL_HEADER + i * LOCAL_KEY);
+}
+
+static uint8_t
+local_is(const uint8_t *key, uint8_t v)
+{
+	uint8_t i;
+
+	for (i = 0; i < LOCAL_KEY; i++) {
+		if (key[i] != v)
+			return 0;
+	}
+	return 1;
+}
+
+static void
+local_key(uint8_t *key, const char *digest)
+{
+	memcpy(key, digest, LOCAL_KEY);
+	if (local_is(key, 0xff) || local_is(key, 0x00))
+		key[LOCAL_KEY - 1] ^= 1;
+}
+
+/*
+ * read slot i, as it will be once the queue has been written
+ */
+static void
+local_read(uint16_t i, uint8_t *k)
+{
+	uint8_t j, q;
+
+	eeprom_read_block(k, local_slot(i), LOCAL_KEY);
+	for (j = 0, q = local_first; j < local_queued; j++) {
+		if (local_queue[q].slot == i)
+			memcpy(k, local_queue[q].key, LOCAL_KEY);
+		q = (q + 1) % LOCAL_QUEUE;
+	}
+}
+
+/*
+ * queue key for slot i, the caller checks that there is room
+ */
+static void
+local_write(uint16_t i, const uint8_t *key)
+{
+	uint8_t q = (local_first + local_queued) % LOCAL_QUEUE;
+
+	local_queue[q].slot = i;
+	memcpy(local_queue[q].key, key, LOCAL_KEY);
+	local_queued++;
+}
+
+#define local_queue_full() (local_queued == LOCAL_QUEUE)
+
+/*
+ * find the slot holding key, or if it isn't there, the
+ * first free or removed one it could go in. returns
+ * LOCAL_SLOTS if neither is found.
+ */
+static uint16_t
+local_find(const uint8_t *key, uint8_t *found)
+{
+	uint16_t i = key[0] % LOCAL_SLOTS;
+	uint16_t n;
+	uint16_t hole = LOCAL_SLOTS;
+	uint8_t k[LOCAL_KEY];
+
+	for (n = 0; n < LOCAL_SLOTS; n++) {
+		local_read(i, k);
+		if (!memcmp(k, key, LOCAL_KEY)) {
+			*found = 1;
+			return i;
+		}
+		if (hole == LOCAL_SLOTS && local_is(k, 0x00))
+			hole = i;
+		if (local_is(k, 0xff)) {
+			if (hole == LOCAL_SLOTS)
+				hole = i;
+			break;
+		}
+		if (++i == LOCAL_SLOTS)
+			i = 0;
+	}
+
+	*found = 0;
+	return hole;
+}
+
+static void
+local_init(void)
+{
+	uint8_t h[LOCAL_HEADER];
+
+	eeprom_read_block(h, (const void *)0, LOCAL_HEADER);
+	local_valid = memcmp(h, local_magic, LOCAL_HEADER) ?
+		LOCAL_INVALID : LOCAL_VALID;
+}
+
+/*
+ * returns 1 if the code with this digest may open the door
+ */
+static uint8_t
+local_lookup(const char *digest)
+{
+	uint8_t key[LOCAL_KEY];
+	uint8_t found;
+
+	if (local_valid != LOCAL_VALID)
+		return 0;
+
+	local_key(key, digest);
+	local_find(key, &found);
+	return found;
+}
+
+/*
+ * add the key starting digest, returns 0 if the table is full.
+ * the queue must have room.
+ */
+static uint8_t
+local_add(const char *digest)
+{
+	uint8_t key[LOCAL_KEY];
+	uint8_t found;
+	uint16_t i;
+
+	if (local_valid != LOCAL_VALID)
+		return 0;
+
+	local_key(key, digest);
+	i = local_find(key, &found);
+	if (found)
+		return 1;
+	if (i == LOCAL_SLOTS)
+		return 0;
+
+	local_write(i, key);
+	return 1;
+}
+
+/*
+ * the queue must have room
+ */
+static void
+local_remove(const char *digest)
+{
+	static const uint8_t removed[LOCAL_KEY];
+	uint8_t key[LOCAL_KEY];
+	uint8_t found;
+	uint16_t i;
+
+	if (local_valid != LOCAL_VALID)
+		return;
+
+	local_key(key, digest);
+	i = local_find(key, &found);
+	if (found)
+		local_write(i, removed);
+}
+
+/*
+ * start forgetting all keys, local_work() does the rest.
+ * the table can't be used until it is done.
+ */
+static void
+local_clear(void)
+{
+	/* what is queued was meant for the old table */
+	local_valid = LOCAL_CLEARING;
+	local_next = 0;
+	local_queued = 0;
+	local_byte = 0;
+	eeprom_update_byte((uint8_t *)0, 0xff);
+}
+
+/*
+ * write the next byte of the first queued key, or while clearing,
+ * clear the next byte of the table, then write the header
+ * backwards so it is only valid once all of it is there. only
+ * bytes that change are written. returns 1 when the clear has
+ * just finished.
+ */
+static uint8_t
+local_work(void)
+{
+	uint16_t i = local_next;
+
+	if (!eeprom_is_ready())
+		return 0;
+
+	if (local_queued) {
+		eeprom_update_byte(local_slot(local_queue[local_first].slot) +
+		                   local_byte,
+		                   local_queue[local_first].key[local_byte]);
+		if (++local_byte == LOCAL_KEY) {
+			local_byte = 0;
+			local_first = (local_first + 1) % LOCAL_QUEUE;
+			local_queued--;
+		}
+		return 0;
+	}
+	if (local_valid != LOCAL_CLEARING)
+		return 0;
+
+	if (i < LOCAL_SLOTS * LOCAL_KEY)
+		eeprom_update_byte(local_slot(0) + i, 0xff);
+	else {
+		i = LOCAL_SLOTS * LOCAL_KEY + LOCAL_HEADER - 1 - i;
+		eeprom_update_byte((uint8_t *)(uintptr_t)i, local_magic[i]);
+		if (i == 0) {
+			local_valid = LOCAL_VALID;
+			return 1;
+		}
+	}
+	local_next++;
+	return 0;
+}
+
+#define local_busy() (local_valid == LOCAL_CLEARING || local_queued)
@@ -1,22 +1,25 @@
 #include <stdio.h>
+#include <string.h>
 
 #include <arduino/pins.h>
 #include <arduino/spi.h>
 
 #include "tools/serial.h"
+#include "tools/mfrc522.h"
 
 
-/* Pinout */
+/* Pinout, the slave select pins are in struct mfrc522. */
 #define MFRC522_NRSTPD A0
-#define MFRC522_SS 10
 #define MFRC522_MOSI 11
 #define MFRC522_MISO 12
 #define MFRC522_SCK 13
+#define MFRC522_IRQ A1
 
 
 /* MFRC522 registers. */
 #define REG_Command     0x01
 #define REG_ComIEn      0x02
+#define REG_DivIEn      0x03
 #define REG_ComIrq      0x04
 #define REG_DivIrq      0x05
 #define REG_Error       0x06
@@ -24,6 +27,7 @@
 #define REG_FIFOLevel   0x0a
 #define REG_Control     0x0c
 #define REG_BitFraming  0x0d
+#define REG_Coll        0x0e
 #define REG_Mode        0x11
 #define REG_TxControl   0x14
 #define REG_TxAuto      0x15
@@ -43,256 +47,712 @@
 
 /* Select the MFRC522 active. */
 static void
-mfrc522_slave_select(void)
+mfrc522_slave_select(const struct mfrc522 *m)
 {
-  pin_low(MFRC522_SS);
+  pin_low(m->ss);
 }
 
 
 /* Deselect the MFRC522. */
 static void
-mfrc522_slave_deselect(void)
+mfrc522_slave_deselect(const struct mfrc522 *m)
 {
-  pin_high(MFRC522_SS);
+  pin_high(m->ss);
 }
 
 
+/* Clock one byte out over SPI and return the byte clocked in. */
 static uint8_t
-mfrc522_read_reg(uint8_t reg)
+mfrc522_spi(uint8_t c)
 {
-  uint8_t v;
-
-  mfrc522_slave_select();
-  spi_write(0x80 | ((reg<<1) & 0x7f));
-  while (!spi_interrupt_flag())
-    ;
-  spi_write(0);
+  spi_write(c);
   while (!spi_interrupt_flag())
     ;
-  v = spi_read();
-  mfrc522_slave_deselect();
+  return spi_read();
+}
+
+
+static uint8_t
+mfrc522_read_reg(struct mfrc522 *m, uint8_t reg)
+{
+  uint8_t v;
+
+  mfrc522_slave_select(m);
+  mfrc522_spi(0x80 | ((reg<<1) & 0x7f));
+  v = mfrc522_spi(0);
+  mfrc522_slave_deselect(m);
   return v;
 }
 
 
 static void
-mfrc522_write_reg(uint8_t reg, uint8_t val)
+mfrc522_write_reg(struct mfrc522 *m, uint8_t reg, uint8_t val)
 {
-  mfrc522_slave_select();
-  spi_write((reg<<1) & 0x7f);
-  while (!spi_interrupt_flag())
-    ;
-  spi_write(val);
-  while (!spi_interrupt_flag())
-    ;
-  mfrc522_slave_deselect();
+  mfrc522_slave_select(m);
+  mfrc522_spi((reg<<1) & 0x7f);
+  mfrc522_spi(val);
+  mfrc522_slave_deselect(m);
 }
 
 
+/*
+  Read reg len times within one chip select. The address of each read is
+  clocked out while the value of the previous one is clocked in, so this
+  costs len+1 SPI bytes instead of 2*len. Used to drain the FIFO.
+*/
 static void
-mfrc522_reg_set_bits(uint8_t reg, uint8_t bits)
+mfrc522_read_burst(struct mfrc522 *m, uint8_t reg, uint8_t *buf,
+                   uint8_t len)
 {
-  mfrc522_write_reg(reg, mfrc522_read_reg(reg) | bits);
+  uint8_t addr = 0x80 | ((reg<<1) & 0x7f);
+
+  if (len == 0)
+    return;
+
+  mfrc522_slave_select(m);
+  mfrc522_spi(addr);
+  while (--len)
+    *buf++ = mfrc522_spi(addr);
+  *buf = mfrc522_spi(0);
+  mfrc522_slave_deselect(m);
 }
 
 
+/*
+  Write len bytes to reg within one chip select. The MFRC522 keeps the
+  address for all of them, so this costs len+1 SPI bytes instead of 2*len.
+  Used to fill the FIFO.
+*/
 static void
-mfrc522_reg_clear_bits(uint8_t reg, uint8_t bits)
+mfrc522_write_burst(struct mfrc522 *m, uint8_t reg, const uint8_t *buf,
+                    uint8_t len)
 {
-  mfrc522_write_reg(reg, mfrc522_read_reg(reg) & ~bits);
+  mfrc522_slave_select(m);
+  mfrc522_spi((reg<<1) & 0x7f);
+  while (len--)
+    mfrc522_spi(*buf++);
+  mfrc522_slave_deselect(m);
 }
 
 
-__attribute__((unused))
 static void
-get_crc(uint8_t *buf, uint8_t len, uint8_t *out_crc)
+mfrc522_reg_set_bits(struct mfrc522 *m, uint8_t reg, uint8_t bits)
 {
-  uint8_t v, i;
+  mfrc522_write_reg(m, reg, mfrc522_read_reg(m, reg) | bits);
+}
 
-  mfrc522_reg_clear_bits(REG_DivIrq, 0x4);
-  mfrc522_reg_set_bits(REG_FIFOLevel, 0x80);
 
-  for (i = 0; i < len; ++i)
-    mfrc522_write_reg(REG_FIFOData, buf[i]);
-  mfrc522_write_reg(REG_Command, CMD_CalcCRC);
+/*
+  CRC_A of ISO/IEC 14443-3 (polynomial x^16 + x^12 + x^5 + 1, reflected,
+  preset 0x6363) as computed by the MFRC522's CalcCRC command, but without
+  any SPI traffic. The CRC is appended to buf[len] low byte first.
+*/
+static void
+mfrc522_crc_a(uint8_t *buf, uint8_t len)
+{
+  uint16_t crc = 0x6363;
+  uint8_t ch;
 
-  for (i = 0; i < 0xff; ++i)
+  while (len--)
   {
-    v = mfrc522_read_reg(REG_DivIrq);
-    if (v & 0x04)
-      break;
+    ch = *buf++ ^ (uint8_t)crc;
+    ch ^= ch << 4;
+    crc = (crc >> 8) ^ ((uint16_t)ch << 8) ^ ((uint16_t)ch << 3) ^ (ch >> 4);
   }
 
-  out_crc[0] = mfrc522_read_reg(REG_CRCResult_L);
-  out_crc[1] = mfrc522_read_reg(REG_CRCResult_H);
+  buf[0] = crc;
+  buf[1] = crc >> 8;
 }
 
 
-static uint8_t
-mfrc522_trx(uint8_t *txbuf, uint8_t txbuflen,
-            uint8_t *rxbuf, uint8_t rxbuflen, uint8_t *rx_bits)
-{
-  uint8_t v, v2, avail;
-  uint16_t i;
+/* HLTA is constant, so is its CRC_A. */
+static const uint8_t mfrc522_hlta[4] = { 0x50, 0x00, 0x57, 0xcd };
+
 
-  /* Enable interrupt requests. */
-  mfrc522_write_reg(REG_ComIEn, 0xf7);
-  mfrc522_reg_clear_bits(REG_ComIrq, 0x80);
+/*
+  Start a transceive of txbuf with the given REG_BitFraming bits;
+  completion is flagged in REG_ComIrq.
+*/
+static void
+mfrc522_trx_start(struct mfrc522 *m, const uint8_t *txbuf, uint8_t txbuflen,
+                  uint8_t framing)
+{
+  mfrc522_write_reg(m, REG_Command, CMD_Idle);
+  /* Clear all interrupt request bits. */
+  mfrc522_write_reg(m, REG_ComIrq, 0x7f);
   /* Flush FIFO. */
-  mfrc522_reg_set_bits(REG_FIFOLevel, 0x80);
+  mfrc522_write_reg(m, REG_FIFOLevel, 0x80);
 
-  mfrc522_write_reg(REG_Command, CMD_Idle);
-  for (i = 0; i < txbuflen; ++i)
-    mfrc522_write_reg(REG_FIFOData, txbuf[i]);
-  mfrc522_write_reg(REG_Command, CMD_Transceive);
+  mfrc522_write_burst(m, REG_FIFOData, txbuf, txbuflen);
+  mfrc522_write_reg(m, REG_Command, CMD_Transceive);
   /* Set the "start transmission of data" bit. */
-  mfrc522_reg_set_bits(REG_BitFraming, 0x80);
+  mfrc522_write_reg(m, REG_BitFraming, 0x80 | framing);
+}
 
-  /* Wait for read complete. */
-  for (i = 0; i < 2000; ++i)
-  {
-    v2 = mfrc522_read_reg(REG_ComIrq);
-    if ((v2 & 0x31))
-      break;
-  }
 
-  /* Clear the transmit-start bit. */
-  mfrc522_reg_clear_bits(REG_BitFraming, 0x80);
+/* Outcome of mfrc522_trx_finish(). */
+enum {
+  MFRC522_OK,
+  MFRC522_COLL,
+  MFRC522_ERR
+};
+
+/*
+  Collect the answer of a transceive once REG_ComIrq says it is done.
+  Returns MFRC522_COLL if several cards answered with different bits.
+*/
+static uint8_t
+mfrc522_trx_finish(struct mfrc522 *m, uint8_t irq, uint8_t *rxbuf,
+                   uint8_t rxbuflen, uint8_t *rx_bits)
+{
+  uint8_t err, v, avail;
+
+  /* Clear the transmit-start bit, all other bits are ours to set. */
+  mfrc522_write_reg(m, REG_BitFraming, 0);
 
-  if (i == 2000)
-    return 1;
+  /* Not done, or timed out with nobody answering. */
+  if (!(irq & 0x30) || (irq & 0x01))
+    return MFRC522_ERR;
 
-  v = mfrc522_read_reg(REG_Error);
-  /* Return error in case of BufferOvfl, CollErr, ParityErr, or ProtocolErr. */
-  if (v & 0x1B)
-    return 1;
+  err = mfrc522_read_reg(m, REG_Error);
+  /* Return error in case of BufferOvfl, ParityErr, or ProtocolErr. */
+  if (err & 0x13)
+    return MFRC522_ERR;
 
-  avail = mfrc522_read_reg(REG_FIFOLevel);
+  avail = mfrc522_read_reg(m, REG_FIFOLevel);
   /* Check number of bits in last byte. */
-  v = mfrc522_read_reg(REG_Control);
+  v = mfrc522_read_reg(m, REG_Control);
   *rx_bits = (v & 7) ? (avail-1)*8 + (v & 7) : avail*8;
   if (avail == 0)
     avail = 1;
   else if (avail > rxbuflen)
     avail = rxbuflen;
 
-  for (i = 0; i < avail; ++i)
-    rxbuf[i] = mfrc522_read_reg(REG_FIFOData);
+  mfrc522_read_burst(m, REG_FIFOData, rxbuf, avail);
+
+  if (err & 0x08)
+  {
+    v = mfrc522_read_reg(m, REG_Coll);
+    /* CollPosNotValid */
+    if (v & 0x20)
+      return MFRC522_ERR;
+    m->coll = (v & 0x1f) ? (v & 0x1f) : 32;
+    return MFRC522_COLL;
+  }
+
+  return MFRC522_OK;
+}
+
+
+/*
+  Card detection is a chain of exchanges, see ISO/IEC 14443-3 6.4:
+
+    WUPA -> (ANTICOLLISION -> SELECT) per cascade level -> HLTA
+         -> REQA -> ... for the next card, until REQA goes unanswered
+
+  Each exchange is started by mfrc522_step() when the previous one
+  completes, so the same code runs whether completion is busy-waited for
+  or signalled on the IRQ pin. Collisions are resolved bit by bit,
+  following the cards that sent a 1. Selected cards are halted so that
+  the REQA after them wakes only the ones not seen yet, and the WUPA that
+  starts the next pass wakes them all again.
+
+  Every card found is reported as "MFR", its ATQA and the 5 bytes sent on
+  each cascade level (a cascade tag and 3 UID bytes, or 4 UID bytes, and
+  the BCC). For a 4 byte UID this is the original 10 byte format.
+*/
+enum {
+  MFRC522_IDLE,
+  MFRC522_REQA,
+  MFRC522_ANTICOLL,
+  MFRC522_SELECT,
+  MFRC522_HALT
+};
+
+uint16_t mfrc522_dropped;
+
+static void
+mfrc522_request(struct mfrc522 *m, uint8_t cmd)
+{
+  /* Short frame, only 7 bits of the last byte are sent. */
+  mfrc522_trx_start(m, &cmd, 1, 7);
+  m->state = MFRC522_REQA;
+}
+
+
+/* Start a pass over all the cards in the field. */
+static void
+mfrc522_start(struct mfrc522 *m)
+{
+  m->cards = 0;
+  mfrc522_request(m, 0x52);                     /* WUPA */
+}
+
+
+static void
+mfrc522_anticoll(struct mfrc522 *m)
+{
+  uint8_t *cl = m->id + 5 + 5 * m->level;
+  uint8_t buf[7];
+  uint8_t bits = m->known % 8;
+  uint8_t len = (m->known + 7) / 8;
+
+  buf[0] = 0x93 + 2 * m->level;            /* SEL */
+  buf[1] = (2 + m->known / 8) << 4 | bits; /* NVB */
+  memcpy(buf + 2, cl, len);
+  /* The answer continues right after the last bit we send. */
+  mfrc522_trx_start(m, buf, 2 + len, bits << 4 | bits);
+  m->state = MFRC522_ANTICOLL;
+}
+
+
+static void
+mfrc522_select(struct mfrc522 *m)
+{
+  uint8_t buf[9];
+
+  buf[0] = 0x93 + 2 * m->level;
+  buf[1] = 0x70;
+  memcpy(buf + 2, m->id + 5 + 5 * m->level, 5);
+  mfrc522_crc_a(buf, 7);
+  mfrc522_trx_start(m, buf, 9, 0);
+  m->state = MFRC522_SELECT;
+}
+
+
+static void
+mfrc522_halt(struct mfrc522 *m)
+{
+  mfrc522_trx_start(m, mfrc522_hlta, sizeof(mfrc522_hlta), 0);
+  m->state = MFRC522_HALT;
+}
+
+
+/*
+  Handle completion of the current exchange and start the next one.
+  Returns the length of a card ID written to outbuf, if any.
+*/
+static uint8_t
+mfrc522_step(struct mfrc522 *m, uint8_t irq, char *outbuf,
+             uint8_t outbufsize)
+{
+  uint8_t *cl = m->id + 5 + 5 * m->level;
+  uint8_t buf[5];
+  uint8_t rx_bits = 0;
+  uint8_t err, i, n;
+
+  switch (m->state) {
+  case MFRC522_REQA:
+    /* Check for card type. ATQAs of different cards may collide. */
+    err = mfrc522_trx_finish(m, irq, buf, 2, &rx_bits);
+    if (err == MFRC522_ERR || rx_bits != 16 ||
+        m->cards == MFRC522_CARDS)
+    {
+      /* Nothing answered the WUPA, so the expected card is gone too. */
+      if (m->cards == 0)
+        m->expected_len = 0;
+      m->state = MFRC522_IDLE;
+      return 0;
+    }
+    m->cards++;
+
+    m->id[0] = 'M';
+    m->id[1] = 'F';
+    m->id[2] = 'R';
+    m->id[3] = buf[0];
+    m->id[4] = buf[1];
+    m->level = 0;
+    m->known = 0;
+
+    /*
+      Most likely this is the card that was here last time. Then it is
+      enough to check that it answers a SELECT, without the anticollision.
+    */
+    m->fast = m->cards == 1 && m->expected_len &&
+      !memcmp(m->id, m->expected, 5);
+    if (m->fast)
+    {
+      memcpy(m->id, m->expected, m->expected_len);
+      mfrc522_select(m);
+      return 0;
+    }
+
+    memset(m->id + 5, 0, 5);
+    mfrc522_anticoll(m);
+    return 0;
+
+  case MFRC522_ANTICOLL:
+    err = mfrc522_trx_finish(m, irq, buf, 5, &rx_bits);
+    if (err == MFRC522_ERR)
+      break;
+
+    /* The answer starts in the byte of the first unknown bit. */
+    n = m->known / 8;
+    i = 0xff << (m->known % 8);
+    cl[n] = (cl[n] & ~i) | (buf[0] & i);
+    for (i = 1; n + i < 5; ++i)
+      cl[n + i] = buf[i];
+
+    if (err == MFRC522_COLL)
+    {
+      /* Bit n is the first one the cards disagree on. */
+      n = 8 * n + m->coll - 1;
+      if (n < m->known || n >= 32)
+        break;
+
+      /* Keep what came before it, and go on with the cards that sent a 1. */
+      cl[n / 8] &= (1 << (n % 8)) - 1;
+      cl[n / 8] |= 1 << (n % 8);
+      for (i = n / 8 + 1; i < 5; ++i)
+        cl[i] = 0;
+      m->known = n + 1;
+      mfrc522_anticoll(m);
+      return 0;
+    }
+
+    /* Checksum. */
+    if (cl[0] ^ cl[1] ^ cl[2] ^ cl[3] ^ cl[4])
+      break;
+
+    mfrc522_select(m);
+    return 0;
+
+  case MFRC522_SELECT:
+    err = mfrc522_trx_finish(m, irq, buf, 3, &rx_bits);
+    if (err != MFRC522_OK || rx_bits != 24)
+      break;
+    n = buf[1];
+    i = buf[2];
+    mfrc522_crc_a(buf, 1);
+    if (buf[1] != n || buf[2] != i)
+      break;
+
+    if (buf[0] & 0x04)
+    {
+      /* Cascade bit, the UID goes on at the next level. */
+      if (m->level == 2 || cl[0] != 0x88)
+        break;
+      m->level++;
+      if (m->fast && 10 + 5 * m->level <= m->expected_len)
+      {
+        mfrc522_select(m);
+        return 0;
+      }
+      m->fast = 0;
+      memset(cl + 5, 0, 5);
+      m->known = 0;
+      mfrc522_anticoll(m);
+      return 0;
+    }
+
+    /* We saw a card; hand out "MFR", ATQA and the cascade levels. */
+    n = 10 + 5 * m->level;
+    if (n > outbufsize)
+    {
+      n = 0;
+      mfrc522_dropped++;
+    }
+    memcpy(outbuf, m->id, n);
+
+    /* Go to halt/hibernation. */
+    mfrc522_halt(m);
+    return n;
+
+  case MFRC522_HALT:
+    mfrc522_trx_finish(m, irq, buf, 5, &rx_bits);
+    /* Look for more cards, the halted ones keep quiet. */
+    mfrc522_request(m, 0x26);                   /* REQA */
+    return 0;
+
+  default:
+    return 0;
+  }
 
-  if (v2 & 1)
-    return 1;
-  else
+  if (m->fast)
+  {
+    /* The card we expected has gone, start over with a full pass. */
+    m->fast = 0;
+    m->expected_len = 0;
+    mfrc522_start(m);
     return 0;
+  }
+
+  /* Something went wrong with this card, send it back to idle. */
+  mfrc522_halt(m);
+  return 0;
 }
 
 
 static void
-mfrc522_init(void)
+mfrc522_init(struct mfrc522 *m, uint8_t shared)
 {
   uint8_t v;
   int i;
 
   /* Do a reset. */
-  mfrc522_write_reg(REG_Command, CMD_SoftReset);
+  mfrc522_write_reg(m, REG_Command, CMD_SoftReset);
   /* A delay after reset seems to be required. */
   for (i = 0; i < 1000; ++i)
     asm volatile ("nop");
 
   /* Set Tauto flag, and set prescaler high bits to 0xd. */
-  mfrc522_write_reg(REG_TMode, 0x8D);
+  mfrc522_write_reg(m, REG_TMode, 0x8D);
   /* Set low bits of prescaler to 0x3e. */
-  mfrc522_write_reg(REG_TPrescaler, 0x3e);
-
-  mfrc522_write_reg(REG_TReload_L, 30);
-  mfrc522_write_reg(REG_TReload_H, 0);
-
-  mfrc522_write_reg(REG_TxAuto, 0x40);
-  mfrc522_write_reg(REG_Mode, 0x3D);
+  mfrc522_write_reg(m, REG_TPrescaler, 0x3e);
+
+#ifdef MFRC522_USE_IRQ
+  /*
+    Time out after 5ms (10 ticks of 0.5ms). Each REQA timeout is the tick
+    of the background polling, so this bounds the card detection latency.
+  */
+  mfrc522_write_reg(m, REG_TReload_L, 10);
+#else
+  mfrc522_write_reg(m, REG_TReload_L, 30);
+#endif
+  mfrc522_write_reg(m, REG_TReload_H, 0);
+
+  mfrc522_write_reg(m, REG_TxAuto, 0x40);
+  mfrc522_write_reg(m, REG_Mode, 0x3D);
 
   /* Enable the antenna. */
-  v = mfrc522_read_reg(REG_TxControl);
+  v = mfrc522_read_reg(m, REG_TxControl);
   if (!(v & 0x03))
-    mfrc522_reg_set_bits(REG_TxControl, 0x03);
+    mfrc522_reg_set_bits(m, REG_TxControl, 0x03);
+
+#ifdef MFRC522_USE_IRQ
+  /*
+    IRQ is active low on RxIRq, IdleIRq and TimerIRq. It is driven
+    push-pull, or open drain when the readers share the line.
+  */
+  mfrc522_write_reg(m, REG_DivIEn, shared ? 0x00 : 0x80);
+  mfrc522_write_reg(m, REG_ComIEn, 0x80 | 0x31);
+#else
+  (void)shared;
+#endif
 }
 
 
 /*
-  Check for the presence of a card.
+  Polls of REG_ComIrq before giving up on an exchange, and per turn
+  when several readers are waited for.
+*/
+#define MFRC522_POLLS 2000
+#define MFRC522_POLLS_SHARED 16
+
+/* Poll REG_ComIrq up to polls times within one chip select. */
+static uint8_t
+mfrc522_wait(struct mfrc522 *m, uint8_t mask, uint16_t polls)
+{
+  const uint8_t addr = 0x80 | (REG_ComIrq << 1);
+  uint8_t irq = 0;
+
+  /*
+    REG_ComIrq is read over and over within one chip select, so each
+    poll costs a single SPI byte.
+  */
+  mfrc522_slave_select(m);
+  mfrc522_spi(addr);
+  while (polls--)
+  {
+    irq = mfrc522_spi(addr);
+    if ((irq & mask))
+      break;
+  }
+  mfrc522_spi(0);
+  mfrc522_slave_deselect(m);
+
+  return irq;
+}
+
+
+/*
+  Check for the presence of cards on the n readers at m.
+
+  The readers run their passes side by side: all of them are started,
+  and whichever has finished its exchange takes its next step, so a pass
+  over n readers takes about as long as the slowest one instead of the
+  sum of them. A reader that is on its own is waited for like before.
+
+  Reader i gets outbufsize bytes at outbuf + i * outbufsize for the binary
+  ID strings of the cards it found, as many as fit, and their total length
+  in outlen[i], 0 if it found none. Those that don't fit are counted in
+  mfrc522_dropped. See mfrc522_id_len() for telling them
+  apart.
+*/
+void
+check_mfrc522(struct mfrc522 *m, uint8_t n, char *outbuf,
+              uint8_t outbufsize, uint8_t *outlen)
+{
+  uint16_t stalled = 0;
+  uint8_t busy, stepped;
+  uint8_t irq, mask;
+  uint8_t i;
+
+  for (i = 0; i < n; ++i)
+  {
+    outlen[i] = 0;
+    if (outbufsize < 10)
+      continue;
+    /* Enable interrupt requests. */
+    mfrc522_write_reg(&m[i], REG_ComIEn, 0xf7);
+    mfrc522_start(&m[i]);
+  }
+
+  while (1)
+  {
+    busy = 0;
+    for (i = 0; i < n; ++i)
+      if (m[i].state != MFRC522_IDLE)
+        busy++;
+    if (busy == 0)
+      break;
+
+    stepped = 0;
+    for (i = 0; i < n; ++i)
+    {
+      if (m[i].state == MFRC522_IDLE)
+        continue;
+
+      /*
+        Wait for read complete, or just for TxIRq after HLTA which is
+        never answered. Alone a reader is waited for until it is done,
+        otherwise each gets a few polls per round. Once the polls of all
+        of them add up to what one would get alone without any of them
+        being done, they go on anyway.
+      */
+      mask = m[i].state == MFRC522_HALT ? 0x40 : 0x31;
+      irq = mfrc522_wait(&m[i], mask,
+                         busy == 1 ? MFRC522_POLLS : MFRC522_POLLS_SHARED);
+      if (!(irq & mask) && busy > 1 && stalled < MFRC522_POLLS)
+        continue;
+
+      outlen[i] += mfrc522_step(&m[i], irq,
+                                outbuf + i * outbufsize + outlen[i],
+                                outbufsize - outlen[i]);
+      stepped = 1;
+    }
+    stalled = stepped ? 0 : stalled + busy * MFRC522_POLLS_SHARED;
+  }
+}
 
-  If found, and if supplied buffer is sufficiently large, fill in buffer with
-  a binary ID string, and return the length of it.
 
-  Else, return 0.
+/*
+  Length of the card ID string at id: 10 bytes, and 5 more for every
+  cascade tag.
 */
 uint8_t
-check_mfrc522(char *outbuf, uint8_t outbufsize)
+mfrc522_id_len(const char *id)
 {
-  uint8_t buf1[4];
-  uint8_t buf2[2];
-  uint8_t buf3[5];
-  uint8_t rx_bits;
-  uint8_t err;
-  uint8_t i, outlen = 0;
-  // char txtbuf[32];
-
-  if (outbufsize < 10)
-    return 0;
+  uint8_t len = 10;
+
+  while (len < MFRC522_ID_MAX && (uint8_t)id[len - 5] == 0x88)
+    len += 5;
+
+  return len;
+}
+
+
+/*
+  Tell reader m that the card with ID string id is likely to still be in
+  its field. The next passes then only check that it is there by
+  selecting it directly, until it fails to answer.
+*/
+void
+mfrc522_expect(struct mfrc522 *m, const char *id)
+{
+  m->expected_len = mfrc522_id_len(id);
+  memcpy(m->expected, id, m->expected_len);
+}
 
-  /* Check for card type. */
-  mfrc522_write_reg(REG_BitFraming, 7);
-  buf1[0] = 0x26;
-  err = mfrc522_trx(buf1, 1, buf2, 2, &rx_bits);
-  if (err)
-    goto end;
-  if (rx_bits != 16)
-    goto end;
-
-  // sprintf(txtbuf, "Typ: %02x %02x\n", buf2[0], buf2[1]);
-  // serial_print(txtbuf);
-
-  /* Read card ID number. */
-  mfrc522_write_reg(REG_BitFraming, 0);
-  buf1[0] = 0x93;
-  buf1[1] = 0x20;
-  err = mfrc522_trx(buf1, 2, buf3, 5, &rx_bits);
-  if (err)
-    goto end;
-  /* Checksum. */
-  if (buf3[0] ^ buf3[1] ^ buf3[2] ^ buf3[3] ^ buf3[4])
-    goto end;
-
-  // sprintf(txtbuf, "Num: %02x %02x %02x %02x %02x\n",
-  //         buf3[0], buf3[1], buf3[2], buf3[3], buf3[4]);
-  // serial_print(txtbuf);
-
-  /* We saw a card; format a 10-byte ID string from type / serial number. */
-  outbuf[outlen++] = 'M';
-  outbuf[outlen++] = 'F';
-  outbuf[outlen++] = 'R';
-  for (i = 0; i < 2; ++i)
-    outbuf[outlen++] = buf2[i];
-  for (i = 0; i < 5; ++i)
-    outbuf[outlen++] = buf3[i];
-
-end:
-  /* Go to halt/hibernation. */
-  buf1[0] = 0x50;
-  buf1[1] = 0x0;
-  get_crc(buf1, 2, buf1+2);
-  mfrc522_trx(buf1, 4, buf3, 5, &rx_bits);
-
-  return outlen;
+
+#ifdef MFRC522_USE_IRQ
+/*
+  Start looking for cards in the background. A reader pulls MFRC522_IRQ
+  low whenever an exchange completes, and mfrc522_irq_event() must then be
+  called to take the next step.
+*/
+void
+mfrc522_irq_start(struct mfrc522 *m, uint8_t n)
+{
+  uint8_t i;
+
+  for (i = 0; i < n; ++i)
+    mfrc522_start(&m[i]);
 }
 
 
+/*
+  Handle a falling edge on MFRC522_IRQ. Every reader that has finished
+  its exchange takes its next step, the cards found are handed out like
+  check_mfrc522() does, and the polling keeps going.
+*/
 void
-init_mfrc522(void)
+mfrc522_irq_event(struct mfrc522 *m, uint8_t n, char *outbuf,
+                  uint8_t outbufsize, uint8_t *outlen)
 {
+  uint8_t irq;
+  uint8_t i;
+
+  for (i = 0; i < n; ++i)
+  {
+    outlen[i] = 0;
+    if (outbufsize < 10)
+      continue;
+
+    irq = mfrc522_read_reg(&m[i], REG_ComIrq);
+    if (!(irq & 0x31))
+      continue;                                 /* Not done yet. */
+
+    outlen[i] = mfrc522_step(&m[i], irq, outbuf + i * outbufsize,
+                             outbufsize);
+#ifdef POWER_DOWN
+    /* Let go of a shared IRQ line until the next pass. */
+    if (m[i].state == MFRC522_IDLE && n > 1)
+      mfrc522_write_reg(&m[i], REG_ComIrq, 0x7f);
+#else
+    if (m[i].state == MFRC522_IDLE)
+      mfrc522_start(&m[i]);
+#endif
+  }
+}
+
+
+#ifdef POWER_DOWN
+/*
+  With POWER_DOWN a finished pass leaves the readers idle, so the MCU can
+  sleep until its next tick instead of waking up for every REQA timeout.
+  Call this on every tick to start the next passes.
+*/
+void
+mfrc522_irq_poll(struct mfrc522 *m, uint8_t n)
+{
+  uint8_t i;
+
+  for (i = 0; i < n; ++i)
+    if (m[i].state == MFRC522_IDLE)
+      mfrc522_start(&m[i]);
+}
+#endif
+#endif
+
+
+/*
+  Set up the SPI bus and the n readers at m, with their ss pins filled
+  in. Readers beyond the first share the reset and IRQ lines.
+*/
+void
+init_mfrc522(struct mfrc522 *m, uint8_t n)
+{
+  uint8_t i;
+
   pin_mode_output(MFRC522_NRSTPD);
   pin_high(MFRC522_NRSTPD);
-  /* Slave select pin, high (deselected) initially. */
-  pin_mode_output(MFRC522_SS);
-  pin_high(MFRC522_SS);
+  /* Slave select pins, high (deselected) initially. */
+  for (i = 0; i < n; ++i)
+  {
+    pin_mode_output(m[i].ss);
+    pin_high(m[i].ss);
+  }
   pin_mode_output(MFRC522_MOSI);
   pin_low(MFRC522_MOSI);
   pin_mode_input(MFRC522_MISO);
@@ -302,5 +762,15 @@ init_mfrc522(void)
   spi_mode_master();
   spi_enable();
 
-  mfrc522_init();
+  for (i = 0; i < n; ++i)
+    mfrc522_init(&m[i], n > 1);
+
+#ifdef MFRC522_USE_IRQ
+  pin_mode_input(MFRC522_IRQ);
+  /* The open drain outputs need the pull-up. */
+  if (n > 1)
+    pin_high(MFRC522_IRQ);
+  pin_interrupt_mask(MFRC522_IRQ);
+  pin_A0toA5_interrupt_enable();
+#endif
 }
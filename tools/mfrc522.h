@@ -1,2 +1,46 @@
-extern uint8_t check_mfrc522(char *outbuf, uint8_t outbufsize);
-extern void init_mfrc522(void);
+/* Longest card ID string, a 10 byte UID on three cascade levels. */
+#define MFRC522_ID_MAX 20
+/* Give up on a pass after this many cards, in case one never halts. */
+#define MFRC522_CARDS 4
+/* Room for the ID strings of all the cards of one pass. */
+#define MFRC522_IDS_MAX (MFRC522_CARDS * MFRC522_ID_MAX)
+
+/*
+  One reader on the SPI bus. Fill in ss, its slave select pin, the rest
+  is kept by the driver.
+*/
+struct mfrc522 {
+  uint8_t ss;
+  uint8_t state;
+  uint8_t cards;                /* tried in this pass */
+  uint8_t level;                /* cascade level, from 0 */
+  uint8_t known;                /* UID bits known on this level */
+  /*
+    Bit position of the first collision in the last answer, from 1,
+    counted from bit 0 of the first FIFO byte (ie. including any RxAlign
+    bits).
+  */
+  uint8_t coll;
+  uint8_t fast;                 /* selecting expected directly */
+  uint8_t expected_len;         /* 0 if nothing is expected */
+  uint8_t id[MFRC522_ID_MAX];
+  uint8_t expected[MFRC522_ID_MAX];
+};
+
+/* Card IDs found that didn't fit in outbuf. */
+extern uint16_t mfrc522_dropped;
+
+extern void check_mfrc522(struct mfrc522 *m, uint8_t n, char *outbuf,
+                          uint8_t outbufsize, uint8_t *outlen);
+extern void init_mfrc522(struct mfrc522 *m, uint8_t n);
+extern uint8_t mfrc522_id_len(const char *id);
+extern void mfrc522_expect(struct mfrc522 *m, const char *id);
+
+#ifdef MFRC522_USE_IRQ
+extern void mfrc522_irq_start(struct mfrc522 *m, uint8_t n);
+extern void mfrc522_irq_event(struct mfrc522 *m, uint8_t n, char *outbuf,
+                              uint8_t outbufsize, uint8_t *outlen);
+#ifdef POWER_DOWN
+extern void mfrc522_irq_poll(struct mfrc522 *m, uint8_t n);
+#endif
+#endif
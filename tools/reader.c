@@ -0,0 +1,146 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reader backends and a cooperative scheduler for them.
+ *
+ * Every way of entering a credential is a backend with an init
+ * function, an event handler that runs once its interrupt handler has
+ * raised its bit in events, and a poll function that runs every so
+ * many ticks. The includer keeps them in a table, hands it to
+ * reader_init() and calls reader_tick() on every tick and
+ * reader_work() from the main loop.
+ *
+ * reader_work() runs one handler to completion per call, so the main
+ * loop gets to the host and the lock in between. Raised events go
+ * first, in table order. Polls that have come due are then run
+ * earliest deadline first, the deadline being the next time the same
+ * poll comes due. A poll that is still waiting by then is run once,
+ * not twice, and counted in reader_missed.
+ *
+ * Each handler runs under the backend's stats probe, so 'S' tells
+ * how much time every backend takes.
+ *
+ * The includer must define the events variable with an EV_POLL bit,
+ * which is raised while polls are waiting. The event bits are raised
+ * from interrupt handlers, so every other bit in events must be
+ * cleared with interrupts off as well. A plain events &= ~bit can lose
+ * a reader event that comes in between the load and the store, and
+ * that reader then stalls until its next one.
+ */
+
+#ifndef READER_MAX
+#define READER_MAX 4
+#endif
+
+struct reader {
+	void (*init)(void);
+	void (*event)(void);     /* once event is raised */
+	void (*poll)(void);      /* every interval ticks */
+	uint8_t event_mask;      /* bit in events, 0 for none */
+	uint8_t interval;        /* ticks, 0 to never poll */
+	uint8_t probe;           /* stats probe */
+};
+
+static const struct reader *reader_table;
+static uint8_t reader_count;
+static uint8_t reader_due[READER_MAX];    /* ticks until the next poll */
+static uint8_t reader_waiting;            /* bitmask of polls due */
+static uint16_t reader_missed;
+
+static void
+reader_init(const struct reader *table, uint8_t n)
+{
+	uint8_t i;
+
+	reader_table = table;
+	reader_count = n;
+	for (i = 0; i < n; i++) {
+		reader_due[i] = table[i].interval;
+		table[i].init();
+	}
+}
+
+/*
+ * count down the polls, called 4 times every second
+ */
+static void
+reader_tick(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < reader_count; i++) {
+		if (reader_table[i].interval == 0 || --reader_due[i])
+			continue;
+
+		reader_due[i] = reader_table[i].interval;
+		if (reader_waiting & (1 << i))
+			reader_missed++;
+		reader_waiting |= 1 << i;
+	}
+
+	if (reader_waiting) {
+		cli();
+		events |= EV_POLL;
+		sei();
+	}
+}
+
+/*
+ * run the most urgent handler, returns 0 if there was none
+ */
+static uint8_t
+reader_work(void)
+{
+	const struct reader *r;
+	uint8_t next = READER_MAX;
+	uint8_t i;
+
+	for (i = 0; i < reader_count; i++) {
+		r = &reader_table[i];
+		if (!(events & r->event_mask))
+			continue;
+
+		cli();
+		events &= ~r->event_mask;
+		sei();
+		stats_start(r->probe);
+		r->event();
+		stats_stop(r->probe);
+		return 1;
+	}
+
+	for (i = 0; i < reader_count; i++) {
+		if ((reader_waiting & (1 << i)) &&
+		    (next == READER_MAX || reader_due[i] < reader_due[next]))
+			next = i;
+	}
+
+	if (next == READER_MAX) {
+		cli();
+		events &= ~EV_POLL;
+		sei();
+		return 0;
+	}
+
+	reader_waiting &= ~(1 << next);
+	r = &reader_table[next];
+	stats_start(r->probe);
+	r->poll();
+	stats_stop(r->probe);
+	return 1;
+}
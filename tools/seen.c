@@ -0,0 +1,116 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cache of the card IDs seen lately.
+ *
+ * The readers report a card over and over for as long as it rests on
+ * them. Looking the ID up here tells a card that was just presented
+ * from one that has been there all along. Every time a card is seen
+ * its entry is kept alive for another SEEN_TTL calls to seen_tick(),
+ * so a card only counts as new again after it has been taken away
+ * for that long. When the table is full the least recently seen
+ * card is forgotten.
+ */
+
+#ifndef SEEN_ENTRIES
+#define SEEN_ENTRIES 4
+#endif
+#ifndef SEEN_TTL
+#define SEEN_TTL 8         /* ticks */
+#endif
+#define SEEN_ID_MAX MFRC522_ID_MAX
+
+struct seen_entry {
+	uint8_t len;       /* 0 for an unused entry */
+	uint8_t ttl;
+	char id[SEEN_ID_MAX];
+};
+
+/* most recently seen first */
+static struct seen_entry seen_table[SEEN_ENTRIES];
+static uint16_t seen_hits;
+static uint16_t seen_misses;
+
+/* move entry i to the front of the table */
+static void
+seen_touch(uint8_t i)
+{
+	struct seen_entry e = seen_table[i];
+
+	memmove(&seen_table[1], &seen_table[0], i * sizeof(e));
+	seen_table[0] = e;
+	seen_table[0].ttl = SEEN_TTL;
+}
+
+/*
+ * returns 1 and keeps the entry alive if id
+ * was seen lately, otherwise 0
+ */
+static uint8_t
+seen_lookup(const char *id, uint8_t len)
+{
+	uint8_t i;
+
+	for (i = 0; i < SEEN_ENTRIES; i++) {
+		if (seen_table[i].len == len &&
+		    !memcmp(seen_table[i].id, id, len)) {
+			seen_touch(i);
+			seen_hits++;
+			return 1;
+		}
+	}
+
+	seen_misses++;
+	return 0;
+}
+
+/*
+ * remember id, which must not be in the table already
+ */
+static void
+seen_add(const char *id, uint8_t len)
+{
+	uint8_t i;
+
+	if (len > SEEN_ID_MAX)
+		len = SEEN_ID_MAX;
+
+	/* take an unused entry, or else the least recently seen one */
+	for (i = 0; i < SEEN_ENTRIES - 1; i++) {
+		if (seen_table[i].len == 0)
+			break;
+	}
+
+	seen_table[i].len = len;
+	memcpy(seen_table[i].id, id, len);
+	seen_touch(i);
+}
+
+/*
+ * age the entries, called 4 times every second
+ */
+static void
+seen_tick(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < SEEN_ENTRIES; i++) {
+		if (seen_table[i].len && --seen_table[i].ttl == 0)
+			seen_table[i].len = 0;
+	}
+}
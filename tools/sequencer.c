@@ -0,0 +1,225 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Output pattern sequencer.
+ *
+ * A pattern is a list of (output, level, duration) steps terminated by
+ * SEQ_END. Patterns are queued with seq_play() and played back from the
+ * timer0 compare B interrupt, so the main loop never has to busy-wait
+ * while a LED blinks or the lock is held open.
+ *
+ * Patterns live in flash, declare them PROGMEM.
+ *
+ * Timer0 must already be running at SOFTSERIAL_PRESCALER (see
+ * softserial.c), and the includer must define the PIN_* outputs and
+ * the events variable.
+ */
+
+#include <avr/pgmspace.h>
+#include <arduino/timer0.h>
+
+#ifndef SEQ_QUEUE
+#define SEQ_QUEUE 8
+#endif
+
+/*
+ * one step tick every 2msec, which takes SEQ_DIV compare interrupts
+ * SEQ_TICK timer0 ticks apart: 2 of 250 ticks of 4usec at 16MHz / 64
+ */
+#define SEQ_2MS (F_CPU / SOFTSERIAL_PRESCALER / 500)
+#if SEQ_2MS <= 250
+#define SEQ_TICK SEQ_2MS
+#define SEQ_DIV 1
+#else
+#define SEQ_TICK 250
+#define SEQ_DIV (SEQ_2MS / 250)
+#endif
+#define SEQ_MS(ms) ((ms) / 2)
+
+enum seq_output {
+	SEQ_END = 0,
+	SEQ_GREEN,
+	SEQ_YELLOW,
+	SEQ_LOCK,
+	SEQ_DAYMODE,
+	SEQ_STATUS,
+	SEQ_EVENT    /* not a pin: or level into events */
+};
+
+struct seq_step {
+	uint8_t output;
+	uint8_t level;
+	uint8_t duration;    /* in SEQ_MS() units, 0 means go on at once */
+};
+
+static struct {
+	const struct seq_step *buf[SEQ_QUEUE];
+	uint8_t start;
+	uint8_t end;
+} seq_queue;
+
+static const struct seq_step *seq_step;
+static volatile uint8_t seq_left;
+static uint8_t seq_ocr;
+#if SEQ_DIV > 1
+static uint8_t seq_div;
+#endif
+
+static void
+seq_output(uint8_t output, uint8_t level)
+{
+	switch (output) {
+	case SEQ_GREEN:
+		if (level)
+			pin_high(PIN_GREEN_LED);
+		else
+			pin_low(PIN_GREEN_LED);
+		break;
+	case SEQ_YELLOW:
+		if (level)
+			pin_high(PIN_YELLOW_LED);
+		else
+			pin_low(PIN_YELLOW_LED);
+		break;
+	case SEQ_LOCK:
+		if (level)
+			pin_high(PIN_OPEN_LOCK);
+		else
+			pin_low(PIN_OPEN_LOCK);
+		break;
+	case SEQ_DAYMODE:
+		if (level)
+			pin_high(PIN_DAYMODE);
+		else
+			pin_low(PIN_DAYMODE);
+		break;
+	case SEQ_STATUS:
+		if (level)
+			pin_high(PIN_STATUS_LED);
+		else
+			pin_low(PIN_STATUS_LED);
+		break;
+	case SEQ_EVENT:
+		events |= level;
+		break;
+	}
+}
+
+/*
+ * execute steps until one of them has a duration
+ * or the queue runs dry. call with interrupts disabled.
+ */
+static void
+seq_run(void)
+{
+	uint8_t output;
+
+	while (1) {
+		if (seq_step == NULL) {
+			uint8_t start = seq_queue.start;
+
+			if (start == seq_queue.end) {
+				timer0_interrupt_b_disable();
+				return;
+			}
+			seq_step = seq_queue.buf[start];
+			seq_queue.start = (start + 1) & (SEQ_QUEUE - 1);
+		}
+
+		output = pgm_read_byte(&seq_step->output);
+		if (output == SEQ_END) {
+			seq_step = NULL;
+			continue;
+		}
+
+		seq_output(output, pgm_read_byte(&seq_step->level));
+		seq_left = pgm_read_byte(&seq_step->duration);
+		seq_step++;
+		if (seq_left)
+			return;
+	}
+}
+
+/*
+ * triggered every SEQ_TICK timer0 ticks while a pattern is playing
+ */
+timer0_interrupt_b()
+{
+	seq_ocr += SEQ_TICK;
+	timer0_compare_b_set(seq_ocr);
+
+#if SEQ_DIV > 1
+	if (--seq_div)
+		return;
+	seq_div = SEQ_DIV;
+#endif
+	if (--seq_left == 0)
+		seq_run();
+}
+
+/*
+ * queue a pattern for playback. returns 0 if the queue is full.
+ */
+static uint8_t
+seq_play(const struct seq_step *pattern)
+{
+	uint8_t end, next;
+
+	cli();
+	end = seq_queue.end;
+	next = (end + 1) & (SEQ_QUEUE - 1);
+	if (next == seq_queue.start) {
+		sei();
+		return 0;
+	}
+	seq_queue.buf[end] = pattern;
+	seq_queue.end = next;
+
+	if (seq_left == 0) {
+		/* idle, start right away */
+		seq_run();
+		if (seq_left) {
+			seq_ocr = timer0_count() + SEQ_TICK;
+			timer0_compare_b_set(seq_ocr);
+#if SEQ_DIV > 1
+			seq_div = SEQ_DIV;
+#endif
+			timer0_interrupt_b_enable();
+		}
+	}
+	sei();
+
+	return 1;
+}
+
+/*
+ * queue a pattern that must not be lost, like opening the lock. if
+ * the queue is full, the patterns waiting in it are dropped to make
+ * room. the one that is playing is finished first.
+ */
+static void
+seq_play_urgent(const struct seq_step *pattern)
+{
+	if (seq_play(pattern))
+		return;
+
+	cli();
+	seq_queue.end = seq_queue.start;
+	sei();
+	seq_play(pattern);
+}
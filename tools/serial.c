@@ -15,6 +15,8 @@
  * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "tools/frame.h"
+
 #define serial_init(baud, mode) do {\
 	serial_baud_##baud();\
 	serial_mode_##mode();\
@@ -31,6 +33,11 @@
 #define SERIAL_OUTBUF 128
 #endif
 
+/* bytes of the output buffer only urgent messages may use */
+#ifndef SERIAL_HEADROOM
+#define SERIAL_HEADROOM 0
+#endif
+
 static volatile struct {
 	uint8_t buf[SERIAL_INBUF];
 	uint8_t start;
@@ -43,6 +50,10 @@ static volatile struct {
 	uint8_t end;
 } serial_output;
 
+static uint8_t serial_highwater;     /* most bytes ever queued */
+static uint16_t serial_dropped;      /* bytes of messages that didn't fit */
+static uint8_t serial_recent = 2;    /* ticks since a message was queued */
+
 serial_interrupt_rx()
 {
 	uint8_t end = serial_input.end;
@@ -57,12 +68,14 @@ serial_interrupt_dre()
 {
 	uint8_t start = serial_output.start;
 
+	stats_isr_start(STATS_SERIAL_DRE);
 	if (start == serial_output.end)
 		serial_interrupt_dre_disable();
 	else {
 		serial_write(serial_output.buf[start]);
 		serial_output.start = (start + 1) & (SERIAL_OUTBUF - 1);
 	}
+	stats_isr_stop(STATS_SERIAL_DRE);
 }
 
 static uint8_t
@@ -86,6 +99,64 @@ serial_getchar(void)
 	return r;
 }
 
+static uint8_t
+serial_queued(void)
+{
+	return (serial_output.end - serial_output.start) & (SERIAL_OUTBUF - 1);
+}
+
+/*
+ * free bytes in the output buffer for a message, the
+ * last SERIAL_HEADROOM are kept for urgent ones
+ */
+static uint8_t
+serial_room(uint8_t urgent)
+{
+	uint8_t room = SERIAL_OUTBUF - 1 - serial_queued();
+
+	if (urgent)
+		return room;
+	return room > SERIAL_HEADROOM ? room - SERIAL_HEADROOM : 0;
+}
+
+/*
+ * check that a message of len bytes fits before queueing it with
+ * the functions below, so it goes out whole or not at all. only
+ * the interrupt takes bytes out, so the room can only grow until
+ * the message is queued. returns 0 and counts the bytes as dropped
+ * if it doesn't fit.
+ */
+static uint8_t
+serial_reserve(uint8_t len, uint8_t urgent)
+{
+	uint8_t queued;
+
+	if (serial_room(urgent) < len) {
+		serial_dropped += len;
+		return 0;
+	}
+
+	queued = serial_queued() + len;
+	if (queued > serial_highwater)
+		serial_highwater = queued;
+	serial_recent = 0;
+	return 1;
+}
+
+/*
+ * the last byte is still on the wire for a while after it has left
+ * the buffer. call this on every tick, then serial_quiet() is 1 once
+ * the buffer has been empty for a whole tick and the UART is idle.
+ */
+static void
+serial_tick(void)
+{
+	if (serial_recent < 2 && !serial_queued())
+		serial_recent++;
+}
+
+#define serial_quiet() (serial_recent == 2)
+
 void
 serial_print(const char *str)
 {
@@ -121,3 +192,37 @@ serial_hexdump(const void *data, size_t len)
 	serial_output.end = end;
 	serial_interrupt_dre_enable();
 }
+
+/*
+ * queue a binary frame, see tools/frame.h
+ */
+static void
+serial_frame(uint8_t type, const void *data, uint8_t len)
+{
+	const uint8_t *p = data;
+	uint8_t end = serial_output.end;
+	uint16_t crc = 0xffff;
+
+	serial_output.buf[end] = FRAME_SOF;
+	end = (end + 1) & (SERIAL_OUTBUF - 1);
+	serial_output.buf[end] = len;
+	end = (end + 1) & (SERIAL_OUTBUF - 1);
+	crc = frame_crc(crc, len);
+	serial_output.buf[end] = type;
+	end = (end + 1) & (SERIAL_OUTBUF - 1);
+	crc = frame_crc(crc, type);
+
+	for (; len > 0; len--, p++) {
+		serial_output.buf[end] = *p;
+		end = (end + 1) & (SERIAL_OUTBUF - 1);
+		crc = frame_crc(crc, *p);
+	}
+
+	serial_output.buf[end] = crc & 0xff;
+	end = (end + 1) & (SERIAL_OUTBUF - 1);
+	serial_output.buf[end] = crc >> 8;
+	end = (end + 1) & (SERIAL_OUTBUF - 1);
+
+	serial_output.end = end;
+	serial_interrupt_dre_enable();
+}
@@ -39,6 +39,10 @@ struct sha1_context {
 	block[(i -  3) & 15] ^ block[(i - 8) & 15] ^ \
 	block[(i - 14) & 15] ^ block[i & 15], 1))
 
+#if defined(SHA1_ASM) && defined(__AVR__)
+/* in tools/sha1.S */
+void sha1_transform(uint32_t state[5], char buf[SHA1_BLOCKSIZE]);
+#else
 /* transform one 512bit block. this is the core of the algorithm. */
 static void
 sha1_transform(uint32_t state[5], char buf[SHA1_BLOCKSIZE])
@@ -122,6 +126,7 @@ sha1_transform(uint32_t state[5], char buf[SHA1_BLOCKSIZE])
 	state[3] += d;
 	state[4] += e;
 }
+#endif
 
 /* initialize new context */
 static void
@@ -137,6 +142,7 @@ sha1_init(struct sha1_context *ctx)
 }
 
 /* hash more data */
+__attribute__((unused))
 static void
 sha1_update(struct sha1_context *ctx, const char *data, size_t len)
 {
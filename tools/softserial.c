@@ -3,16 +3,60 @@
 /* Also need to change the interrupt references if changing pin */
 #define SOFTSERIAL_RX_PIN 8
 
-static uint8_t ev_softserial = 0;
+#ifndef SOFTSERIAL_BAUD
+#define SOFTSERIAL_BAUD 9600
+#endif
+
+/*
+  Timer0 prescaler, which sets the oversampling. 64 gives 4usec ticks at
+  16MHz, that is 26 ticks per bit at 9600 baud and 4.3 at 57600. 8 gives
+  0.5usec ticks for 8 times that, at the cost of a few more timeout
+  interrupts per byte at the lower rates. The sequencer runs off the
+  same timer.
+*/
+#ifndef SOFTSERIAL_PRESCALER
+#define SOFTSERIAL_PRESCALER 64
+#endif
+
+#define SOFTSERIAL_TICKS (F_CPU / SOFTSERIAL_PRESCALER)
+
+#if SOFTSERIAL_TICKS / SOFTSERIAL_BAUD < 4
+#error "SOFTSERIAL_PRESCALER is too coarse for SOFTSERIAL_BAUD"
+#endif
+
+/* Ticks from the start bit edge to the middle of data bit n, 8 is the stop bit */
+#define SOFTSERIAL_MIDDLE(n) \
+  ((uint16_t)(((2 * (n) + 3) * SOFTSERIAL_TICKS + SOFTSERIAL_BAUD) \
+              / (2 * SOFTSERIAL_BAUD)))
+
+/*
+  An edge, or a timeout, after the middle of a bit means that bit is over
+  and had the level the line had before. This is all the decoder needs, so
+  looking up the next bound replaces the multiply.
+*/
+static const uint16_t softserial_middle[9] = {
+  SOFTSERIAL_MIDDLE(0), SOFTSERIAL_MIDDLE(1), SOFTSERIAL_MIDDLE(2),
+  SOFTSERIAL_MIDDLE(3), SOFTSERIAL_MIDDLE(4), SOFTSERIAL_MIDDLE(5),
+  SOFTSERIAL_MIDDLE(6), SOFTSERIAL_MIDDLE(7), SOFTSERIAL_MIDDLE(8)
+};
+
 static uint8_t softserial_pin_oldstate;
 static uint8_t softserial_state = 0;
 static uint8_t softserial_data;
 static uint8_t softserial_bit_count = 0;
-static uint8_t softserial_startbit_time;
+static uint8_t softserial_last;         /* timer0 at the last edge or timeout */
+/*
+  Ticks from the start bit edge to softserial_last. Added up one edge at a
+  time so a frame can be longer than the 256 ticks timer0 wraps at.
+*/
+static uint16_t softserial_elapsed;
+static uint16_t softserial_framing_errors; /* stop bit was low */
+static uint16_t softserial_overruns;       /* fifo was full */
 
 #define SOFTSERIAL_EOF -256
+#define SOFTSERIAL_FIFO 16      /* must be a power of 2 */
 static volatile struct {
-  uint8_t buf[16];
+  uint8_t buf[SOFTSERIAL_FIFO];
   uint8_t start;
   uint8_t end;
 } softserial_input;
@@ -21,9 +65,16 @@ static void
 softserial_put_in_fifo(void)
 {
   uint8_t end = softserial_input.end;
+  uint8_t next = (end + 1) & (SOFTSERIAL_FIFO - 1);
+
+  if (next == softserial_input.start)
+  {
+    softserial_overruns++;
+    return;
+  }
   softserial_input.buf[end] = softserial_data;
-  softserial_input.end = (end + 1) % sizeof(softserial_input.buf);
-  ev_softserial = 1;
+  softserial_input.end = next;
+  events |= EV_RFID;
 }
 
 static int
@@ -35,67 +86,99 @@ softserial_getchar(void)
   cli();
   if (start == softserial_input.end)
   {
-    ev_softserial = 0;
+    events &= ~EV_RFID;
     sei();
     return SOFTSERIAL_EOF;
   }
   sei();
 
   r = (char)softserial_input.buf[start];
-  softserial_input.start = (start + 1) % sizeof(softserial_input.buf);
+  softserial_input.start = (start + 1) & (SOFTSERIAL_FIFO - 1);
 
   return r;
 }
 
-pin_8to13_interrupt()
+/*
+  Bring the frame up to now, the line having been at level since
+  softserial_last. Returns 1 once the stop bit is in and the frame is
+  done with.
+*/
+static uint8_t
+softserial_advance(uint8_t now, uint8_t level)
 {
-  uint8_t state;
-  uint8_t current, delta;
-  state = pin_is_high(SOFTSERIAL_RX_PIN);
-  if (state == softserial_pin_oldstate)
-    return;                                     /* Not for us... */
-  softserial_pin_oldstate = state;
+  uint16_t elapsed = softserial_elapsed + (uint8_t)(now - softserial_last);
+  uint8_t n = softserial_bit_count;
 
-  switch (softserial_state) {
-  case 0:  /* Waiting for start bit. */
-  start_bit:
-    if (state)
-      return;
-    softserial_startbit_time = timer0_count();
-    /* Trigger a timeout interrupt in 11 bits -> 11/9600/16usec -> 72 */
-    timer0_compare_a_set(softserial_startbit_time + 72);
-    timer0_flags_clear();
-    timer0_interrupt_a_enable();
-    softserial_bit_count = 0;
-    softserial_data = 0;
-    softserial_state = 1;
-    break;
-
-  case 1:  /* Collecting bits */
-    current = timer0_count();
-    delta = current - softserial_startbit_time;
-    while (softserial_bit_count < 8)
-    {
-      // delta * 154 <= 154 * 16e6 Hz / 256 clocks/timertick / 9600 baud * (count+1.5)
-      if ((uint16_t)delta * 154 <= (uint16_t)softserial_bit_count*1000 + 1500)
-        break;
-      /*
-        Add any bits since last; note that those bits had the reverse state of
-        what we currently have.
-      */
-      if (!state)
-        softserial_data |= (1 << softserial_bit_count);
-      ++softserial_bit_count;
-    }
-    if (softserial_bit_count >= 8)
+  softserial_last = now;
+  softserial_elapsed = elapsed;
+  while (elapsed > softserial_middle[n])
+  {
+    if (n == 8)
     {
       timer0_interrupt_a_disable();
       softserial_state = 0;
-      softserial_put_in_fifo();
-      goto start_bit;
+      if (level)
+        softserial_put_in_fifo();
+      else
+        softserial_framing_errors++;
+      return 1;
     }
-    break;
+    /* Data comes lsb first */
+    softserial_data >>= 1;
+    if (level)
+      softserial_data |= 0x80;
+    ++n;
   }
+  softserial_bit_count = n;
+  return 0;
+}
+
+/*
+  Trigger a timeout interrupt just after the middle of the stop bit, or as
+  far towards it as timer0 reaches.
+*/
+static void
+softserial_timeout(void)
+{
+  uint16_t left = softserial_middle[8] + 1 - softserial_elapsed;
+
+  if (left > 255)
+    left = 255;
+  timer0_compare_a_set(softserial_last + (uint8_t)left);
+}
+
+static void
+softserial_pin_change(void)
+{
+  uint8_t state;
+  uint8_t now;
+  state = pin_is_high(SOFTSERIAL_RX_PIN);
+  if (state == softserial_pin_oldstate)
+    return;                                     /* Not for us... */
+  softserial_pin_oldstate = state;
+  now = timer0_count();
+
+  /* The bits since the last edge had the reverse state of what we have now */
+  if (softserial_state && !softserial_advance(now, !state))
+    return;
+
+  /* Waiting for start bit. */
+  if (state)
+    return;
+  softserial_last = now;
+  softserial_elapsed = 0;
+  softserial_bit_count = 0;
+  softserial_data = 0;
+  softserial_state = 1;
+  softserial_timeout();
+  timer0_interrupt_a_enable();
+}
+
+pin_8to13_interrupt()
+{
+  stats_isr_start(STATS_SOFTSERIAL);
+  softserial_pin_change();
+  stats_isr_stop(STATS_SOFTSERIAL);
 }
 
 timer0_interrupt_a()
@@ -103,14 +186,12 @@ timer0_interrupt_a()
   /*
     Handle the timeout we get if the last bit(s) are zero (so we do not get a
     transition on the stop bit) and there is no immediately following new
-    start bit.
+    start bit, or if the frame is longer than timer0 wraps around.
   */
-  timer0_interrupt_a_disable();
-  while (softserial_bit_count < 8)
-    softserial_data |= (1 << softserial_bit_count++);
-  softserial_state = 0;
-  softserial_bit_count = 8;
-  softserial_put_in_fifo();
+  stats_isr_start(STATS_SOFTSERIAL);
+  if (!softserial_advance(timer0_count(), softserial_pin_oldstate))
+    softserial_timeout();
+  stats_isr_stop(STATS_SOFTSERIAL);
 }
 
 static void
@@ -119,7 +200,13 @@ softserial_init(void)
   timer0_clock_off();
   timer0_interrupt_a_disable();
   timer0_mode_normal();
-  timer0_clock_d256();  /* 16MHz / 256 -> 16usec / tick. */
+#if SOFTSERIAL_PRESCALER == 8
+  timer0_clock_d8();    /* 16MHz / 8 -> 0.5usec / tick. */
+#elif SOFTSERIAL_PRESCALER == 64
+  timer0_clock_d64();   /* 16MHz / 64 -> 4usec / tick. */
+#else
+#error "SOFTSERIAL_PRESCALER must be 8 or 64"
+#endif
 
   pin_mode_input(SOFTSERIAL_RX_PIN);
   softserial_pin_oldstate = pin_is_high(SOFTSERIAL_RX_PIN);
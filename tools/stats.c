@@ -0,0 +1,199 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Timing probes for the hot paths.
+ *
+ * Build with -DSTATS to have every probe keep count, min, max and sum
+ * of its run time. Time is read from timer2 running at 0.5usec (8 cpu
+ * cycles) per tick, extended to 24 bits by the overflow interrupt, so
+ * a single run can be up to 8 seconds long. Probes in the main loop
+ * include the time spent in interrupts that hit while they ran.
+ *
+ * Without STATS the probes expand to nothing and timer2 is not touched.
+ */
+
+enum stats_probe {
+	STATS_SHA1,        /* sha1_transform()               */
+	STATS_MFRC522,     /* MFRC522 reader backend         */
+	STATS_RFID,        /* EM4100 reader backend          */
+	STATS_KEYPAD,      /* keypad reader backend          */
+	STATS_PIN2,        /* keypad clock interrupt         */
+	STATS_SOFTSERIAL,  /* EM4100 soft UART interrupts    */
+	STATS_SERIAL_DRE,  /* serial data register empty     */
+	STATS_PROBES
+};
+
+#ifdef STATS
+#include <avr/pgmspace.h>
+#include <arduino/timer2.h>
+
+/* "STAT+SOFTSERIAL+" and four 8 digit hex numbers separated by '+' */
+#define STATS_LINE 56
+
+struct stats_entry {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t sum;
+	uint32_t start;
+};
+
+static const char stats_names[STATS_PROBES][11] PROGMEM = {
+	"SHA1",
+	"MFRC522",
+	"RFID",
+	"KEYPAD",
+	"PIN2",
+	"SOFTSERIAL",
+	"DRE"
+};
+
+static struct stats_entry stats_table[STATS_PROBES];
+static volatile uint16_t stats_high;
+
+timer2_interrupt_overflow()
+{
+	stats_high++;
+}
+
+/*
+ * timer2 ticks as a 24 bit number, must be called with interrupts off
+ */
+static uint32_t
+stats_now(void)
+{
+	uint8_t low = timer2_count();
+	uint16_t high = stats_high;
+
+	/* timer2 wrapped before we read it, but the interrupt is pending */
+	if (timer2_overflow_flag() && low < 0x80)
+		high++;
+
+	return (uint32_t)high << 8 | low;
+}
+
+static void
+stats_isr_start(uint8_t probe)
+{
+	stats_table[probe].start = stats_now();
+}
+
+static void
+stats_isr_stop(uint8_t probe)
+{
+	struct stats_entry *e = &stats_table[probe];
+	uint32_t t = (stats_now() - e->start) & 0xffffffUL;
+
+	e->count++;
+	e->sum += t;
+	if (t < e->min)
+		e->min = t;
+	if (t > e->max)
+		e->max = t;
+}
+
+#define stats_start(probe) do {\
+	cli();\
+	stats_isr_start(probe);\
+	sei();\
+	} while (0)
+
+#define stats_stop(probe) do {\
+	cli();\
+	stats_isr_stop(probe);\
+	sei();\
+	} while (0)
+
+static void
+stats_clear(uint8_t probe)
+{
+	struct stats_entry *e = &stats_table[probe];
+
+	e->count = 0;
+	e->min = 0xffffffffUL;
+	e->max = 0;
+	e->sum = 0;
+}
+
+static void
+stats_init(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < STATS_PROBES; i++)
+		stats_clear(i);
+
+	timer2_mode_normal();
+	timer2_clock_d8();
+	timer2_interrupt_overflow_enable();
+}
+
+static char *
+stats_hex(char *p, uint32_t v)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	int8_t shift;
+
+	*p++ = '+';
+	for (shift = 28; shift >= 0; shift -= 4)
+		*p++ = hex[(v >> shift) & 0x0f];
+
+	return p;
+}
+
+/*
+ * format probe as
+ *   STAT+<name>+<count>+<min>+<max>+<sum>
+ * into buf of STATS_LINE bytes and start it over.
+ * times are in timer2 ticks of 0.5usec.
+ */
+static void
+stats_format(uint8_t probe, char *buf)
+{
+	struct stats_entry e;
+	const char *s;
+	char *p = buf;
+
+	cli();
+	e = stats_table[probe];
+	stats_clear(probe);
+	sei();
+
+	if (e.count == 0)
+		e.min = 0;
+
+	for (s = "STAT+"; *s; s++)
+		*p++ = *s;
+	for (s = stats_names[probe]; pgm_read_byte(s); s++)
+		*p++ = pgm_read_byte(s);
+	p = stats_hex(p, e.count);
+	p = stats_hex(p, e.min);
+	p = stats_hex(p, e.max);
+	p = stats_hex(p, e.sum);
+	*p = '\0';
+}
+
+#else /* STATS */
+
+#define stats_init()           do {} while (0)
+#define stats_start(probe)     do {} while (0)
+#define stats_stop(probe)      do {} while (0)
+#define stats_isr_start(probe) do {} while (0)
+#define stats_isr_stop(probe)  do {} while (0)
+
+#endif /* STATS */
@@ -0,0 +1,242 @@
+/*
+ * This file is part of doorduino.
+ *
+ * doorduino is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or(at your option) any later version.
+ *
+ * doorduino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with doorduino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Wiegand decoder.
+ *
+ * A Wiegand reader pulls D0 low for a 0 and D1 low for a 1, for
+ * 20-100usec every 0.5-2msec, msb first, and the frame is over when
+ * the pulses stop. The includer calls wiegand_bit() from the falling
+ * edge interrupts of D0 and D1, which only stores the bit so the soft
+ * UART interrupt behind it is hardly held up, and wiegand_end() once
+ * the lines have been quiet for a while. The main loop then picks the
+ * frame up with wiegand_take().
+ *
+ * Frames of 26 (H10301), 34 (H10306) and 37 (H10304) bits are cards.
+ * Their first bit is even parity over the first half of the frame and
+ * the last bit is odd parity over the second half, the halves of a 37
+ * bit frame share the middle bit. Frames of 4 bits are keys, and so
+ * are frames of 8 bits with the complement of the key in front of it.
+ */
+
+#define WIEGAND_BITS      40
+#define WIEGAND_KEY_STAR  10
+#define WIEGAND_KEY_HASH  11
+
+static const uint8_t wiegand_mask[8] = {
+	0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+};
+
+static volatile uint8_t wiegand_buf[WIEGAND_BITS / 8];
+static volatile uint8_t wiegand_count;
+/* the last frame, until the main loop takes it */
+static uint8_t wiegand_frame[WIEGAND_BITS / 8];
+static volatile uint8_t wiegand_frame_bits;
+static uint16_t wiegand_errors;     /* bad or lost frames */
+#ifdef POWER_DOWN
+static volatile uint8_t wiegand_woken;
+static uint8_t wiegand_frame_woken;
+#endif
+
+static inline void
+wiegand_bit(uint8_t one)
+{
+	uint8_t n = wiegand_count;
+
+	if (n == WIEGAND_BITS)
+		return;
+	if (one)
+		wiegand_buf[n >> 3] |= wiegand_mask[n & 7];
+	wiegand_count = n + 1;
+}
+
+#ifdef POWER_DOWN
+/*
+ * a pulse woke the MCU up. it is usually over by the time the
+ * oscillator has started, so the frame comes in a bit short.
+ */
+static inline void
+wiegand_wake(void)
+{
+	if (wiegand_count == 0)
+		wiegand_woken = 1;
+}
+#endif
+
+/*
+ * the lines have gone quiet, called with interrupts disabled
+ */
+static void
+wiegand_end(void)
+{
+	uint8_t i;
+
+	if (wiegand_count == 0) {
+		/* woken up by something else */
+#ifdef POWER_DOWN
+		wiegand_woken = 0;
+#endif
+		return;
+	}
+
+	if (wiegand_frame_bits == 0) {
+		for (i = 0; i < sizeof(wiegand_frame); i++)
+			wiegand_frame[i] = wiegand_buf[i];
+		wiegand_frame_bits = wiegand_count;
+#ifdef POWER_DOWN
+		wiegand_frame_woken = wiegand_woken;
+#endif
+	} else
+		wiegand_errors++;
+
+	for (i = 0; i < sizeof(wiegand_frame); i++)
+		wiegand_buf[i] = 0;
+	wiegand_count = 0;
+#ifdef POWER_DOWN
+	wiegand_woken = 0;
+#endif
+}
+
+static uint8_t
+wiegand_get(const uint8_t *f, uint8_t n)
+{
+	return f[n >> 3] & wiegand_mask[n & 7] ? 1 : 0;
+}
+
+/* xor of bits from up to, but not including, to */
+static uint8_t
+wiegand_parity(const uint8_t *f, uint8_t from, uint8_t to)
+{
+	uint8_t p = 0;
+
+	for (; from < to; from++)
+		p ^= wiegand_get(f, from);
+
+	return p;
+}
+
+static uint8_t
+wiegand_is_card(uint8_t bits)
+{
+	return bits == 26 || bits == 34 || bits == 37;
+}
+
+#ifdef POWER_DOWN
+/*
+ * put back the first bit of a frame that woke us up, if it can be
+ * worked out from the rest: the even parity bit of a card, or the
+ * complement of the top bit of the key in an 8 bit key frame
+ */
+static uint8_t
+wiegand_repair(uint8_t *f, uint8_t bits)
+{
+	uint8_t i;
+	uint8_t first;
+
+	if (!wiegand_is_card(bits + 1) && bits != 7)
+		return bits;
+
+	for (i = sizeof(wiegand_frame) - 1; i > 0; i--)
+		f[i] = f[i] >> 1 | f[i - 1] << 7;
+	f[0] >>= 1;
+	bits++;
+
+	if (bits == 8)
+		first = !wiegand_get(f, 4);
+	else
+		first = wiegand_parity(f, 1, (bits + 1) / 2);
+	if (first)
+		f[0] |= 0x80;
+
+	return bits;
+}
+#endif
+
+/*
+ * copy the last frame to f, returns its
+ * length in bits or 0 if there is none
+ */
+static uint8_t
+wiegand_take(uint8_t *f)
+{
+	uint8_t bits;
+	uint8_t i;
+
+	cli();
+	bits = wiegand_frame_bits;
+	for (i = 0; i < sizeof(wiegand_frame); i++)
+		f[i] = wiegand_frame[i];
+	wiegand_frame_bits = 0;
+	sei();
+
+#ifdef POWER_DOWN
+	if (wiegand_frame_woken)
+		bits = wiegand_repair(f, bits);
+#endif
+	return bits;
+}
+
+/*
+ * card frames come out as 'W', the number of bits in decimal and the
+ * card number, without the parity bits, in hex. returns the length of
+ * that in id, or 0 if f isn't a card or the parity is wrong.
+ */
+static uint8_t
+wiegand_card(const uint8_t *f, uint8_t bits, char *id)
+{
+	char *p = id;
+	uint8_t v = 0;
+	uint8_t i;
+
+	if (!wiegand_is_card(bits) ||
+	    wiegand_parity(f, 0, (bits + 1) / 2) != 0 ||
+	    wiegand_parity(f, bits / 2, bits) != 1)
+		return 0;
+
+	*p++ = 'W';
+	*p++ = '0' + bits / 10;
+	*p++ = '0' + bits % 10;
+	/* a hex digit whenever the bits left are a multiple of 4 */
+	for (i = 1; i < bits - 1; i++) {
+		v = v << 1 | wiegand_get(f, i);
+		if ((bits - 2 - i) % 4 == 0) {
+			*p++ = serial_hexdigit[v];
+			v = 0;
+		}
+	}
+
+	return p - id;
+}
+
+/*
+ * returns the key in f, 0-9, WIEGAND_KEY_STAR or
+ * WIEGAND_KEY_HASH, or 0xff if it isn't a key
+ */
+static uint8_t
+wiegand_key(const uint8_t *f, uint8_t bits)
+{
+	uint8_t k = f[0] >> 4;
+
+	if (bits == 8) {
+		if ((f[0] & 0x0f) != (~k & 0x0f))
+			return 0xff;
+		k = f[0] & 0x0f;
+	} else if (bits != 4)
+		return 0xff;
+
+	return k <= WIEGAND_KEY_HASH ? k : 0xff;
+}